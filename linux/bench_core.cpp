@@ -0,0 +1,195 @@
+/* Micro benchmarks of the editing primitives.
+ *
+ * Usage: bench_core [megabytes]
+ *
+ * Synthetic C documents of 1 KB, 32 KB, 1 MB, 32 MB and so on up to the
+ * size given (32 MB by default, 1024 for 1 GB, that takes some GB of
+ * memory) are built row by row, then every primitive runs on random rows of
+ * them for a fraction of a second: inserting and deleting rows, inserting
+ * chars, updating the render and the highlight of a row, joining the rows
+ * for a save, the scan of a find, and drawing a frame into a buffer.
+ *
+ * Every result is printed as a line of JSON, so that the output of two
+ * commits can be compared by a script:
+ *
+ *   {"bench":"editorUpdateRow","doc_bytes":1048576,"rows":23831,
+ *    "ops":412345,"ns_per_op":485.2}
+ *
+ * Benchmarks going over the whole document also report "mb_per_s". */
+
+#include "editor.h"
+
+#define BENCH_MIN_TIME 0.2      /* Seconds every benchmark runs at least. */
+#define BENCH_SCREEN_ROWS 48
+#define BENCH_SCREEN_COLS 160
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static unsigned int seed = 1;
+
+static unsigned int benchRandom(void) {
+    seed = seed*1103515245+12345;
+    return seed>>8;
+}
+
+/* A random line of code into 'buf', that must hold 256 bytes. Returns its
+ * length. */
+static size_t makeLine(char *buf) {
+    static const char *words[] = {
+        "int","return","static","editor","row","buffer","the","of","search",
+        "while","for","char","size","render","(void)","0;","/* note */",
+        "\"str\"","\t","{","}","->","E","42"
+    };
+    size_t len = 0;
+    int indent = benchRandom() % 3, nwords = 3 + benchRandom() % 10;
+
+    for (int k = 0; k < indent; k++) {
+        memcpy(buf+len,"    ",4);
+        len += 4;
+    }
+    for (int k = 0; k < nwords; k++) {
+        const char *w = words[benchRandom() % (sizeof(words)/sizeof(words[0]))];
+        if (k) buf[len++] = ' ';
+        memcpy(buf+len,w,strlen(w));
+        len += strlen(w);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static void report(const char *name, editorConfig *E, size_t docbytes,
+                   long long ops, double elapsed, double scanned)
+{
+    printf("{\"bench\":\"%s\",\"doc_bytes\":%zu,\"rows\":%lld,\"ops\":%lld,"
+           "\"ns_per_op\":%.1f",name,docbytes,E->numrows,ops,elapsed/ops*1e9);
+    if (scanned) printf(",\"mb_per_s\":%.1f",scanned/elapsed/1e6);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* Run 'op' with the number of the run until BENCH_MIN_TIME passed, reading
+ * the clock every few runs only, as a run can take less than it. Returns
+ * the runs made, and sets '*elapsed'. */
+template<typename F>
+static long long benchLoop(F op, double *elapsed) {
+    long long ops = 0;
+    int batch = 1;
+    double start = now();
+
+    do {
+        for (int j = 0; j < batch; j++) op(ops++);
+        if (batch < 64) batch *= 2;
+    } while ((*elapsed = now()-start) < BENCH_MIN_TIME);
+    return ops;
+}
+
+static void benchDocument(editorConfig *E, size_t docbytes) {
+    char line[256];
+    double elapsed;
+    long long ops;
+
+    /* Build the document the way editorOpen() does. */
+    size_t total = 0;
+    double start = now();
+    while (total < docbytes) {
+        size_t len = makeLine(line);
+        editorInsertRow(E,E->numrows,line,len);
+        total += len+1;
+    }
+    elapsed = now()-start;
+    report("editorInsertRow/append",E,docbytes,E->numrows,elapsed,total);
+
+    /* Every row or char inserted is deleted right after, keeping the size
+     * of the document: only the insertion is timed, then the deletion. */
+    double inserting = 0, deleting = 0;
+    ops = benchLoop([&](long long) {
+        size_t len = makeLine(line);
+        double t0 = now();
+        editorInsertRow(E,benchRandom() % (E->numrows+1),line,len);
+        double t1 = now();
+        editorDelRow(E,benchRandom() % E->numrows);
+        inserting += t1-t0;
+        deleting += now()-t1;
+    },&elapsed);
+    report("editorInsertRow/random",E,docbytes,ops,inserting,0);
+    report("editorDelRow",E,docbytes,ops,deleting,0);
+
+    inserting = 0;
+    ops = benchLoop([&](long long) {
+        erow *row = &E->row[benchRandom() % E->numrows];
+        long long at = benchRandom() % (row->size+1);
+        double t0 = now();
+        editorRowInsertChar(E,row,at,'x');
+        inserting += now()-t0;
+        editorRowDelChar(E,row,at);
+    },&elapsed);
+    report("editorRowInsertChar",E,docbytes,ops,inserting,0);
+
+    ops = benchLoop([&](long long) {
+        editorUpdateRow(E,&E->row[benchRandom() % E->numrows]);
+    },&elapsed);
+    report("editorUpdateRow",E,docbytes,ops,elapsed,0);
+
+    ops = benchLoop([&](long long) {
+        editorUpdateSyntax(E,&E->row[benchRandom() % E->numrows]);
+    },&elapsed);
+    report("editorUpdateSyntax",E,docbytes,ops,elapsed,0);
+
+    size_t buflen = 0;
+    ops = benchLoop([&](long long) {
+        free(editorRowsToString(E,&buflen));
+    },&elapsed);
+    report("editorRowsToString",E,docbytes,ops,elapsed,(double)buflen*ops);
+
+    /* The scan editorFind() starts as the query is typed, after an edit:
+     * the view of the document is brought up to date, then searched by the
+     * worker threads. A query found nowhere, then one found everywhere. */
+    const char *queries[] = {"benchmark","render"};
+    const char *names[] = {"editorFind/scan-none","editorFind/scan-many"};
+    for (int q = 0; q < 2; q++) {
+        ops = benchLoop([&](long long) {
+            E->version++;
+            int done = searchUpdateMatches(E,queries[q],strlen(queries[q]));
+            while (!done && E->search.job) {
+                sched_yield();
+                done = searchCollect(E,NULL);
+            }
+        },&elapsed);
+        report(names[q],E,docbytes,ops,elapsed,(double)E->search.len*ops);
+    }
+    searchCancel(E);
+
+    /* A frame anywhere in the document, with the cursor in the middle. */
+    size_t framebytes = 0;
+    ops = benchLoop([&](long long) {
+        struct abuf ab = ABUF_INIT;
+        E->rowoff = benchRandom() % E->numrows;
+        E->cy = std::min((long long)E->screenrows/2,E->numrows-E->rowoff-1);
+        E->cx = E->coloff = 0;
+        editorDrawScreen(E,&ab);
+        framebytes = ab.len;
+        abFree(&ab);
+    },&elapsed);
+    report("editorDrawScreen",E,docbytes,ops,elapsed,(double)framebytes*ops);
+}
+
+int main(int argc, char **argv) {
+    size_t maxbytes = (argc > 1 ? atof(argv[1]) : 32)*1024*1024;
+    editorConfig E;
+
+    E.headless = 1;
+    E.mode = EDITOR_MODE_NORMAL;
+    initEditor(&E);
+    E.screenrows = BENCH_SCREEN_ROWS;
+    E.screencols = BENCH_SCREEN_COLS;
+    for (size_t docbytes = 1024; docbytes <= maxbytes; docbytes *= 32) {
+        editorSelectSyntaxHighlight(&E,(char*)"bench.c");
+        benchDocument(&E,docbytes);
+        editorCloseFile(&E);
+    }
+    return 0;
+}
@@ -0,0 +1,367 @@
+/* End-to-end keystroke latency benchmark.
+ *
+ * Usage: bench_keys [-n lines] [-s rowsxcols] [-e texed] [trace file...]
+ *
+ * texed is started on a pseudo terminal of the given size, editing a
+ * generated C file of 'lines' lines, and keystroke traces are replayed
+ * against it one key at a time. The latency of a key is the time from
+ * writing it to the terminal to the end of the frame it causes, that
+ * editorRefreshScreen() closes by showing the cursor again: every key makes
+ * exactly one frame. A paste is written as a single burst, and its latency
+ * is the time to the frame of its last key.
+ *
+ * Without trace files a few built in traces are replayed: typing, scrolling,
+ * find and paste. A trace file holds the bytes a terminal sent, for example
+ * recorded with script(1) -I, and is replayed key by key in insert mode. A
+ * lone ESC in it costs the 100 ms texed waits to tell it from an escape
+ * sequence.
+ *
+ * What texed writes goes through the terminal model of editor_vt.cpp too,
+ * for the bytes and escape sequences every frame takes, and to check that
+ * the screen it draws still shows the status bar at the end.
+ *
+ * Needs no terminal of its own, so it runs from make or a CI job. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pty.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "editor.h"
+
+#define FRAME_END "\x1b[?25h"       /* Last bytes editorRefreshScreen writes. */
+#define FRAME_TIMEOUT 5000          /* Milliseconds to wait for a frame. */
+#define LOAD_TIMEOUT 60000          /* And for the file to be loaded. */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+struct benchTerm {
+    int fd;             /* Master side of the pty. */
+    pid_t pid;          /* texed. */
+    char tail[sizeof(FRAME_END)-1]; /* Last bytes read, for split frame ends. */
+    int tlen;
+    long frames;        /* Frame ends read so far. */
+    vtScreen vt;        /* What the terminal shows. */
+};
+
+/* Read what texed wrote, up to 'timeout' milliseconds if nothing is there.
+ * Returns the number of frame ends in it, or -1 on timeout or if texed
+ * exited. */
+static int termRead(benchTerm *t, int timeout) {
+    struct pollfd pfd = {t->fd, POLLIN, 0};
+    char buf[65536+sizeof(FRAME_END)];
+    const int flen = sizeof(FRAME_END)-1;
+
+    if (poll(&pfd,1,timeout) <= 0) return -1;
+    memcpy(buf,t->tail,t->tlen);
+    ssize_t n = read(t->fd,buf+t->tlen,sizeof(buf)-flen);
+    if (n <= 0) return -1;
+    vtFeed(&t->vt,buf+t->tlen,n);
+    n += t->tlen;
+
+    int frames = 0;
+    for (char *p = buf; (p = (char*)memmem(p,buf+n-p,FRAME_END,flen)) != NULL;
+         p += flen)
+        frames++;
+    /* Keep the bytes that may start a frame end completed by the next read.
+     * Those of one already counted can't: only its first byte is an ESC. */
+    t->tlen = std::min((ssize_t)flen-1,n);
+    memcpy(t->tail,buf+n-t->tlen,t->tlen);
+    t->frames += frames;
+    return frames;
+}
+
+/* Wait for 'frames' frames, each at most 'timeout' ms after the one
+ * before. Returns the time the last one ended, or 0 if they didn't come. */
+static double termWaitFrames(benchTerm *t, int frames, int timeout) {
+    while (frames > 0) {
+        int got = termRead(t,timeout);
+        if (got == -1) return 0;
+        frames -= got;
+    }
+    return now();
+}
+
+/* Read whatever texed is still writing, until it is quiet for 'quiet' ms. */
+static void termDrain(benchTerm *t, int quiet) {
+    while (termRead(t,quiet) != -1);
+}
+
+static void termWrite(benchTerm *t, const char *s, size_t len) {
+    while (len) {
+        ssize_t n = write(t->fd,s,len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return;
+        s += n;
+        len -= n;
+    }
+}
+
+/* Start texed editing 'filename' on a new pty of the given size. Returns
+ * the seconds until the file is shown, or -1 on error. */
+static double termStart(benchTerm *t, const char *texed, const char *filename,
+                        int rows, int cols) {
+    struct winsize ws = {};
+    ws.ws_row = rows;
+    ws.ws_col = cols;
+
+    double start = now();
+    t->tlen = 0;
+    t->frames = 0;
+    vtInit(&t->vt,rows,cols);
+    t->pid = forkpty(&t->fd,NULL,NULL,&ws);
+    if (t->pid == -1) return -1;
+    if (t->pid == 0) {
+        execl(texed,texed,filename,(char*)NULL);
+        perror(texed);
+        _exit(1);
+    }
+    /* One frame before the file is loaded, one after. */
+    double shown = termWaitFrames(t,2,LOAD_TIMEOUT);
+    return shown ? shown-start : -1;
+}
+
+static void termStop(benchTerm *t) {
+    kill(t->pid,SIGKILL);
+    waitpid(t->pid,NULL,0);
+    close(t->fd);
+}
+
+/* Length of the key at 's': an escape sequence or a single byte. texed
+ * reads UTF-8 a byte at a time, so each byte of it is a key too. */
+static size_t keyLen(const char *s, size_t len) {
+    if (s[0] != '\x1b' || len < 2) return 1;
+    if (s[1] == 'O') return len < 3 ? 1 : 3;
+    if (s[1] != '[') return 1;
+    for (size_t i = 2; i < len; i++)
+        if (s[i] >= 0x40 && s[i] <= 0x7e) return i+1;
+    return 1;
+}
+
+struct benchTrace {
+    std::string name;
+    std::string keys;
+    size_t burst;       /* Keys written at once, 1 but for pastes. */
+};
+
+/* Replay 'trace', putting the latency of every write in 'lat'. Returns the
+ * number of writes whose frames never came. */
+static int replay(benchTerm *t, benchTrace *trace, std::vector<double> &lat) {
+    const char *s = trace->keys.data();
+    size_t len = trace->keys.size();
+    int lost = 0;
+
+    while (len) {
+        size_t blen = 0;
+        int keys = 0;
+        while (blen < len && (size_t)keys < trace->burst) {
+            blen += keyLen(s+blen,len-blen);
+            keys++;
+        }
+
+        /* Frames still coming, say refreshes of a find in progress, must
+         * not be taken for the ones of this write. */
+        termDrain(t,1);
+        double start = now();
+        termWrite(t,s,blen);
+        double end = termWaitFrames(t,keys,FRAME_TIMEOUT);
+        if (end)
+            lat.push_back(end-start);
+        else
+            lost++;
+        s += blen;
+        len -= blen;
+    }
+    return lost;
+}
+
+static double percentile(std::vector<double> &v, double p) {
+    size_t i = (size_t)(p*(v.size()-1)+0.5);
+    std::nth_element(v.begin(),v.begin()+i,v.end());
+    return v[i];
+}
+
+/* A C file of 'lines' lines of random words, with a little nesting. */
+static int makeDocument(const char *filename, long lines) {
+    static const char *words[] = {
+        "int","return","static","editor","row","buffer","the","of","search",
+        "while","for","char","size","render","(void)","0;","/* note */","\"str\""
+    };
+    FILE *fp = fopen(filename,"w");
+    unsigned int seed = 1;
+
+    if (fp == NULL) return -1;
+    for (long j = 0; j < lines; j++) {
+        seed = seed*1103515245+12345;
+        int indent = (seed>>8) % 3, nwords = 3 + (seed>>12) % 10;
+        for (int k = 0; k < indent; k++) fputs("    ",fp);
+        for (int k = 0; k < nwords; k++) {
+            seed = seed*1103515245+12345;
+            fprintf(fp,"%s%s",k ? " " : "",
+                    words[(seed>>16) % (sizeof(words)/sizeof(words[0]))]);
+        }
+        fputc('\n',fp);
+    }
+    return fclose(fp);
+}
+
+/* The built in traces, run in this order from the top of the file. */
+static std::vector<benchTrace> builtinTraces(void) {
+    std::vector<benchTrace> traces;
+    std::string keys;
+
+    /* Typing: a few lines of code, with typos fixed by backspace. */
+    const char *text = "static int benchCount(int n) {\r"
+                       "    int total = 0;\r"
+                       "    for (int j = 0; j < n; j++) total += j;\r"
+                       "    retrun\x7f\x7f\x7f\x7furn total;\r}\r";
+    traces.push_back({"typing",text,1});
+
+    /* Scrolling: down a line at a time, then by pages, then back up. */
+    keys.clear();
+    for (int j = 0; j < 200; j++) keys += "\x1b[B";
+    for (int j = 0; j < 50; j++) keys += "\x1b[6~";
+    for (int j = 0; j < 50; j++) keys += "\x1b[5~";
+    for (int j = 0; j < 100; j++) keys += "\x1b[C";
+    traces.push_back({"scrolling",keys,1});
+
+    /* Find: type a query, walk the matches, accept with Enter. */
+    keys = "\x06" "buffer";
+    for (int j = 0; j < 20; j++) keys += "\x1b[B";
+    keys += "\x7f\x7f\x7f\x7f\x7f\x7f" "render of";
+    for (int j = 0; j < 20; j++) keys += "\x1b[A";
+    keys += "\r";
+    traces.push_back({"find",keys,1});
+
+    /* Paste: terminals send it all at once, with CR for newlines. */
+    keys.clear();
+    for (int j = 0; j < 64; j++)
+        keys += "    buffer[j] = render(row, size); /* pasted */\r";
+    traces.push_back({"paste",keys,keys.size()/16});
+    return traces;
+}
+
+int main(int argc, char **argv) {
+    long lines = 100000;
+    int rows = 40, cols = 120;
+    const char *texed = "./texed";
+    std::vector<benchTrace> traces;
+    int opt;
+
+    while ((opt = getopt(argc,argv,"n:s:e:")) != -1) {
+        switch(opt) {
+        case 'n': lines = atol(optarg); break;
+        case 'e': texed = optarg; break;
+        case 's': if (sscanf(optarg,"%dx%d",&rows,&cols) == 2) break;
+                  /* fall through */
+        default:
+            fprintf(stderr,"Usage: bench_keys [-n lines] [-s rowsxcols] "
+                           "[-e texed] [trace file...]\n");
+            exit(1);
+        }
+    }
+    for (int j = optind; j < argc; j++) {
+        FILE *fp = fopen(argv[j],"rb");
+        if (fp == NULL) {
+            perror(argv[j]);
+            exit(1);
+        }
+        std::string keys;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf,1,sizeof(buf),fp)) > 0) keys.append(buf,n);
+        fclose(fp);
+        traces.push_back({argv[j],keys,1});
+    }
+    if (traces.empty()) traces = builtinTraces();
+
+    /* Relative paths of texed still work from the scratch directory. */
+    char texedpath[4096], dir[] = "/tmp/bench_keys.XXXXXX";
+    if (realpath(texed,texedpath) == NULL) {
+        perror(texed);
+        exit(1);
+    }
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    std::string filename = std::string(dir)+"/bench.c";
+    if (makeDocument(filename.c_str(),lines) == -1) {
+        perror(filename.c_str());
+        exit(1);
+    }
+
+    benchTerm t;
+    double load = termStart(&t,texedpath,filename.c_str(),rows,cols);
+    int failed = load == -1;
+    if (!failed) {
+        printf("%ld lines, %dx%d terminal: shown in %.1f ms\n\n",
+               lines,rows,cols,load*1000);
+        printf("%-20s %8s %10s %10s %10s %10s %8s\n","trace","writes",
+               "p50 ms","p99 ms","max ms","B/frame","esc/frame");
+
+        /* Insert mode whatever the mode texed starts in. ESC alone needs
+         * its timeout to pass before the next key. */
+        termWrite(&t,"\x1b",1);
+        termWaitFrames(&t,1,FRAME_TIMEOUT);
+        termWrite(&t,"i",1);
+        termWaitFrames(&t,1,FRAME_TIMEOUT);
+        termDrain(&t,50);
+    }
+    for (size_t j = 0; !failed && j < traces.size(); j++) {
+        std::vector<double> lat;
+        long frames = t.frames;
+        uint64_t bytes = t.vt.bytes, seqs = t.vt.sequences;
+        int lost = replay(&t,&traces[j],lat);
+        frames = std::max(t.frames-frames,1L);
+        if (lat.empty()) {
+            printf("%-20s no frames\n",traces[j].name.c_str());
+            failed = 1;
+            break;
+        }
+        printf("%-20s %8zu %10.3f %10.3f %10.3f %10.0f %8.0f",
+               traces[j].name.c_str(),lat.size(),percentile(lat,0.5)*1000,
+               percentile(lat,0.99)*1000,
+               *std::max_element(lat.begin(),lat.end())*1000,
+               (double)(t.vt.bytes-bytes)/frames,
+               (double)(t.vt.sequences-seqs)/frames);
+        if (lost) printf("  (%d without a frame)",lost);
+        printf("\n");
+        failed = lost != 0;
+    }
+    if (!failed) {
+        /* The status bar is the row before the message one, its file name
+         * cut short, but not the count of lines. */
+        std::string status = vtRowText(&t.vt,rows-2);
+        if (status.find(" lines") == std::string::npos) {
+            fprintf(stderr,"Screen model: no status bar in the last frame: "
+                           "\"%s\"\n",status.c_str());
+            failed = 1;
+        }
+        if (t.vt.unknown)
+            fprintf(stderr,"Screen model: %llu control sequences not "
+                           "understood\n",(unsigned long long)t.vt.unknown);
+    }
+    if (load != -1) termStop(&t);
+    else fprintf(stderr,"%s didn't show %s\n",texed,filename.c_str());
+
+    /* texed leaves its journal and swap file next to the document. */
+    std::string rm = std::string("rm -rf ")+dir;
+    if (system(rm.c_str()) != 0) fprintf(stderr,"Can't remove %s\n",dir);
+    return failed;
+}
@@ -0,0 +1,124 @@
+/* Throughput benchmark for the search engine used by editorFind.
+ *
+ * Usage: bench_search [megabytes]
+ *
+ * A synthetic document made of lines of random words is scanned for a few
+ * needles, counting every occurrence, and the throughput of searchMemmem()
+ * is printed next to glibc's memmem() as a reference. The regex engine is
+ * then compared with std::regex, on the same document and on a pattern that
+ * makes backtracking engines explode. */
+
+#include "editor.h"
+
+#include <regex>
+#include <string>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static char *makeDocument(size_t len) {
+    static const char *words[] = {
+        "int","return","static","editor","row","buffer","the","of","search",
+        "while","for","char","size","render","{","}","(void)","0;","\t","//"
+    };
+    char *doc = (char*)malloc(len+1);
+    size_t i = 0;
+    unsigned int seed = 1;
+
+    while (i < len) {
+        seed = seed*1103515245+12345;
+        const char *w = words[(seed>>16) % (sizeof(words)/sizeof(words[0]))];
+        size_t wl = strlen(w);
+        for (size_t j = 0; j < wl && i < len; j++) doc[i++] = w[j];
+        if (i < len) doc[i++] = ((seed>>8) % 12) ? ' ' : '\n';
+    }
+    doc[len] = '\0';
+    return doc;
+}
+
+typedef const char *(*searchfn)(const char*,size_t,const char*,size_t,int);
+
+static const char *libcMemmem(const char *h, size_t n, const char *nd, size_t m, int icase) {
+    (void)icase;
+    return (const char*)memmem(h,n,nd,m);
+}
+
+static void run(const char *name, searchfn fn, const char *doc, size_t len,
+                const char *needle, int icase)
+{
+    size_t m = strlen(needle), count = 0;
+    const char *p = doc;
+    double start = now();
+
+    while ((p = fn(p,len-(p-doc),needle,m,icase)) != NULL) {
+        count++;
+        p++;
+    }
+    double elapsed = now()-start;
+    printf("%-14s %-24s %-5s %8zu matches %8.2f GB/s\n", name, needle,
+        icase ? "icase" : "", count, len/elapsed/1e9);
+}
+
+/* Run 'pattern' with our engine over doc[0..len) and with std::regex on
+ * the first 'stdlen' bytes, line by line, reporting both throughputs. */
+static void runRegex(const char *doc, size_t len, size_t stdlen, const char *pattern) {
+    const char *err;
+    regexProg *prog = regexCompile(pattern,0,&err);
+    if (!prog) {
+        printf("%s: %s\n", pattern, err);
+        return;
+    }
+    regexMatcher *m = regexMatcherNew(prog);
+    std::vector<size_t> starts, lens;
+    double start = now();
+    regexFindAll(m,doc,len,0,&starts,&lens);
+    double elapsed = now()-start;
+    printf("%-14s %-24s %8zu matches %8.3f GB/s\n", "regexFindAll",
+        pattern, starts.size(), len/elapsed/1e9);
+    regexMatcherFree(m);
+    regexFree(prog);
+
+    std::regex re(pattern);
+    size_t count = 0, off = 0;
+    start = now();
+    while (off < stdlen) {
+        const char *nl = (const char*)memchr(doc+off,'\n',stdlen-off);
+        size_t end = nl ? nl-doc : stdlen;
+        for (std::cregex_iterator it(doc+off,doc+end,re), last; it != last; ++it)
+            count++;
+        off = end+1;
+    }
+    elapsed = now()-start;
+    printf("%-14s %-24s %8zu matches %8.3f GB/s (on %zu KB)\n", "std::regex",
+        pattern, count, stdlen/elapsed/1e9, stdlen>>10);
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? atol(argv[1]) : 256;
+    size_t len = mb<<20;
+    char *doc = makeDocument(len);
+    const char *needles[] = {"editorRefresh","renderx","return static","q",
+                             "a_rather_long_needle_that_is_not_there"};
+
+    printf("document: %zu MB\n", mb);
+    for (auto needle : needles) {
+        run("searchMemmem",searchMemmem,doc,len,needle,0);
+        run("searchMemmem",searchMemmem,doc,len,needle,1);
+        run("memmem",libcMemmem,doc,len,needle,0);
+    }
+
+    const char *patterns[] = {"ret[a-z]+ st", "(int|char) [a-z]+", "\\d+;",
+                              "^\\{.*\\}$"};
+    size_t stdlen = len < (8<<20) ? len : (8<<20);
+    for (auto pattern : patterns) runRegex(doc,len,stdlen,pattern);
+    free(doc);
+
+    /* Lines of 'a' with no 'b': exponential for a backtracking engine. */
+    std::string evil;
+    for (int j = 0; j < 64; j++) evil += std::string(22,'a') + "\n";
+    runRegex(evil.c_str(),evil.size(),evil.size(),"(a|aa)*b");
+    return 0;
+}
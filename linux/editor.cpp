@@ -1,7 +1,18 @@
 #include "editor.h"
 
+#include <algorithm>
+
+/* The highlighter asks this for every char: answered from a table. */
+static struct separatorTable {
+    unsigned char sep[256];
+    separatorTable() {
+        for (int c = 0; c < 256; c++)
+            sep[c] = c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];",c) != NULL;
+    }
+} separators;
+
 int is_separator(int c) {
-    return c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];",c) != NULL;
+    return separators.sep[(unsigned char)c];
 }
 
 /* =========================== Syntax highlights DB =========================
@@ -69,7 +80,11 @@ void disableRawMode(editorConfig *E, int fd) {
 
 /* Called at exit to avoid remaining in raw mode. */
 void editorAtExit(editorConfig *E) {
+    editorSaveReap(E,1);
+    swapClose(E);
     disableRawMode(E, STDIN_FILENO);
+    if (statsDump() == -1) perror("Writing the frame statistics");
+    if (traceDump() == -1) perror("Writing the trace");
 }
 
 /* Raw mode: 1960 magic shit. */
@@ -167,61 +182,198 @@ failed:
     return -1;
 }
 
-/* Update the rendered version and the syntax highlight of a row. */
-void editorUpdateRow(editorConfig *E, erow *row) {
-    unsigned int tabs = 0, nonprint = 0;
-    int j, idx;
+/* Rebuild the rendered version of the row after its content changed. */
+void editorUpdateRender(editorConfig *E, erow *row) {
+    size_t tabs = 0, high = 0;
+    long long j, idx, col;
+
+    free(row->cmap);
+    row->cmap = NULL;
+    row->ncmap = 0;
+    row->ascii = 1;
+
+    /* Long rows are only rendered a window at a time, when shown. */
+    if (row->size >= ROW_LONG_LINE) {
+        longLineUpdate(row);
+        goto done;
+    }
+    if (row->ll) longLineFree(row);
 
    /* Create a version of the row we can directly print on the screen,
      * respecting tabs, substituting non printable characters with '?'. */
     free(row->render);
-    for (j = 0; j < row->size; j++)
+    for (j = 0; j < row->size; j++) {
         if (row->chars[j] == TAB) tabs++;
-
-    unsigned long long allocsize =
-        (unsigned long long) row->size + tabs*8 + nonprint*9 + 1;
-    if (allocsize > UINT32_MAX) {
-        printf("Some line of the edited file is too long for kilo\n");
-        exit(1);
+        high += (row->chars[j] & 0x80) != 0;
+    }
+    row->ascii = high == 0;
+
+    /* A line too big to render in memory is shown empty rather than
+     * taking the editor down: its content is still there, and saved. */
+    row->render = (char*)malloc(row->size + tabs*8 + 1);
+    if (row->render == NULL) {
+        row->render = (char*)malloc(1);
+        row->rsize = row->rlen = 0;
+        row->ascii = 1;
+        row->render[0] = '\0';
+        editorSetStatusMessage(E,"Line %lld is too long to display",
+            (long long)(row-E->row)+1);
+        goto done;
+    }
+    /* Rows of plain ASCII are their own rendering. */
+    if (tabs == 0 && row->ascii) {
+        memcpy(row->render,row->chars,row->size);
+        idx = row->size;
+        goto rendered;
     }
 
-    row->render = (char*)malloc(row->size + tabs*8 + nonprint*9 + 1);
-    idx = 0;
+    /* UTF-8 chars are two bytes or more. */
+    row->cmap = (rowCol*)malloc(sizeof(rowCol)*(tabs+high/2));
+    idx = col = 0;
     for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == TAB) {
-            row->render[idx++] = ' ';
-            while((idx+1) % 8 != 0) row->render[idx++] = ' ';
+        unsigned char c = row->chars[j];
+        rowCol *m = row->cmap+row->ncmap;
+        if (c == TAB) {
+            long long next = (col+1) | 7;
+            while (col < next) {
+                row->render[idx++] = ' ';
+                col++;
+            }
+            m->at = j;
+            m->len = 1;
+        } else if (c < 0x80) {
+            row->render[idx++] = c;
+            col++;
+            continue;
         } else {
-            row->render[idx++] = row->chars[j];
+            uint32_t cp;
+            int len = utf8Decode(row->chars+j,row->size-j,&cp);
+            int width = len > 1 ? utf8Width(cp) : -1;
+            if (width < 0) {
+                /* Not shown as it is: DEL is drawn as '?' like controls. */
+                row->render[idx++] = 0x7f;
+                col++;
+                continue;
+            }
+            memcpy(row->render+idx,row->chars+j,len);
+            idx += len;
+            col += width;
+            m->at = j;
+            m->len = len;
+            j += len-1;
         }
+        m->rx = idx;
+        m->col = col;
+        row->ncmap++;
     }
-    row->rsize = idx;
+rendered:
+    row->rsize = row->rlen = idx;
+    row->roff = 0;
     row->render[idx] = '\0';
+done:
+    E->version++;
+    if (row-E->row < E->saved.lowrow) E->saved.lowrow = row-E->row;
+    trigramUpdateRow(E, row);
+    wrapRowChanged(E, row);
+}
 
-    /* Update the syntax highlighting attributes of the row. */
+/* Update the rendered row and its syntax highlight after a change. */
+void editorUpdateRow(editorConfig *E, erow *row) {
+    TRACE_SPAN("editorUpdateRow");
+    editorUpdateRender(E, row);
     editorUpdateSyntax(E, row);
 }
 
+/* Make sure row->hl is up to date before using it. */
+void editorRowFreshSyntax(editorConfig *E, erow *row) {
+    if (row->hl_stale) editorUpdateSyntax(E, row);
+}
+
+/* True if 's' contains a multi line comment start or end. */
+static int editorHasCommentDelim(editorConfig *E, const char *s, size_t len) {
+    if (E->syntax == NULL) return 0;
+    return memmem(s,len,E->syntax->multiline_comment_start,2) ||
+           memmem(s,len,E->syntax->multiline_comment_end,2);
+}
+
+/* Give up the content of the row: it is freed, unless a save in progress
+ * still has to write it. */
+static void editorRowReleaseChars(editorConfig *E, erow *row) {
+    if (E->save && row->cowgen != E->snapgen)
+        E->save->orphans.push_back(row->chars);
+    else
+        free(row->chars);
+    row->chars = NULL;
+}
+
+/* Called before changing the content of the row in place: if it is shared
+ * with the snapshot of a save in progress, the row gets a copy of its own. */
+void editorRowPrepareWrite(editorConfig *E, erow *row) {
+    if (!E->save || row->cowgen == E->snapgen) return;
+    char *copy = (char*)malloc(row->size+1);
+    memcpy(copy,row->chars,row->size+1);
+    E->save->orphans.push_back(row->chars);
+    row->chars = copy;
+    row->cowgen = E->snapgen;
+}
+
+/* Replace the whole content of the row. This is for edits touching many
+ * rows at once, so highlighting is left for when the row is shown if it
+ * can't affect other rows: that is, if neither the old nor the new content
+ * may open or close a multi line comment. */
+void editorRowSetChars(editorConfig *E, erow *row, const char *s, size_t len) {
+    int lazy = !editorHasCommentDelim(E,row->chars,row->size) &&
+               !editorHasCommentDelim(E,s,len);
+
+    editorRowReleaseChars(E,row);
+    row->chars = (char*)malloc(len+1);
+    row->cowgen = E->snapgen;
+    memcpy(row->chars,s,len);
+    row->chars[len] = '\0';
+    row->size = len;
+    editorUpdateRender(E,row);
+    if (lazy)
+        row->hl_stale = 1;
+    else
+        editorUpdateSyntax(E,row);
+    E->dirty++;
+    swapLog(E,SWAP_OP_SET,row-E->row);
+}
+
 /* Insert a row at the specified position, shifting the other rows on the bottom
  * if required. */
-void editorInsertRow(editorConfig *E, int at, char *s, size_t len) {
+void editorInsertRow(editorConfig *E, long long at, char *s, size_t len) {
     if (at > E->numrows) return;
     E->row = (erow*)realloc(E->row, sizeof(erow)*(E->numrows+1));
     if (at != E->numrows) {
         memmove(E->row+at+1, E->row+at,sizeof(E->row[0])*(E->numrows-at));
-        for (int j = at+1; j <= E->numrows; j++) E->row[j].idx++;
+        for (long long j = at+1; j <= E->numrows; j++) E->row[j].idx++;
     }
     E->row[at].size = len;
     E->row[at].chars = (char*)malloc(len+1);
     memcpy(E->row[at].chars,s,len+1);
+    E->row[at].cowgen = E->snapgen;
     E->row[at].hl = NULL;
     E->row[at].hl_oc = 0;
+    E->row[at].hl_stale = 0;
     E->row[at].render = NULL;
     E->row[at].rsize = 0;
+    E->row[at].roff = 0;
+    E->row[at].rlen = 0;
+    E->row[at].ll = NULL;
+    E->row[at].cmap = NULL;
+    E->row[at].ncmap = 0;
+    E->row[at].ascii = 1;
+    E->row[at].wrap = NULL;
+    E->row[at].wraplines = 0;
+    E->row[at].wrapcols = 0;
     E->row[at].idx = at;
+    E->row[at].lid = UINT32_MAX;
+    E->wrap.valid = 0;
     editorUpdateRow(E, E->row+at);
     E->numrows++;
     E->dirty++;
+    swapLog(E,SWAP_OP_INSERT,at);
 }
 
 /* Free row's heap allocated stuff. */
@@ -229,6 +381,9 @@ void editorFreeRow(erow *row) {
     free(row->render);
     free(row->chars);
     free(row->hl);
+    free(row->cmap);
+    free(row->wrap);
+    longLineFree(row);
 }
 
 
@@ -239,26 +394,31 @@ void editorFreeRow(erow *row) {
 
 /* Remove the row at the specified position, shifting the remainign on the
  * top. */
-void editorDelRow(editorConfig *E, int at) {
+void editorDelRow(editorConfig *E, long long at) {
     erow *row;
 
     if (at >= E->numrows) return;
     row = E->row+at;
+    editorRowReleaseChars(E,row);
     editorFreeRow(row);
     memmove(E->row+at,E->row+at+1,sizeof(E->row[0])*(E->numrows-at-1));
-    for (int j = at; j < E->numrows-1; j++) E->row[j].idx++;
+    for (long long j = at; j < E->numrows-1; j++) E->row[j].idx--;
     E->numrows--;
     E->dirty++;
+    E->version++;
+    E->wrap.valid = 0;
+    if (at < E->saved.lowrow) E->saved.lowrow = at;
+    swapLog(E,SWAP_OP_DELETE,at);
 }
 
 /* Turn the editor rows into a single heap-allocated string.
  * Returns the pointer to the heap-allocated string and populate the
  * integer pointed by 'buflen' with the size of the string, escluding
  * the final nulterm. */
-char *editorRowsToString(editorConfig *E, int *buflen) {
+char *editorRowsToString(editorConfig *E, size_t *buflen) {
     char *buf = NULL, *p;
-    int totlen = 0;
-    int j;
+    size_t totlen = 0;
+    long long j;
 
     /* Compute count of bytes */
     for (j = 0; j < E->numrows; j++)
@@ -279,11 +439,15 @@ char *editorRowsToString(editorConfig *E, int *buflen) {
 
 /* Insert a character at the specified position in a row, moving the remaining
  * chars on the right if needed. */
-void editorRowInsertChar(editorConfig *E, erow *row, int at, int c) {
+void editorRowInsertChar(editorConfig *E, erow *row, long long at, int c) {
+    long long from = std::min(at,row->size);
+
+    editorRowPrepareWrite(E,row);
+    longLineChanged(row,from);
     if (at > row->size) {
         /* Pad the string with spaces if the insert location is outside the
          * current length by more than a single character. */
-        int padlen = at-row->size;
+        long long padlen = at-row->size;
         /* In the next line +2 means: new char and null term. */
         row->chars = (char*)realloc(row->chars,row->size+padlen+2);
         memset(row->chars+row->size, ' ', padlen);
@@ -299,31 +463,45 @@ void editorRowInsertChar(editorConfig *E, erow *row, int at, int c) {
     row->chars[at] = c;
     editorUpdateRow(E, row);
     E->dirty++;
+    swapLogSplice(E,row-E->row,from,0,row->chars+from,at-from+1);
 }
 
-/* Append the string 's' at the end of a row */
-void editorRowAppendString(editorConfig *E, erow *row, char *s, size_t len) {
-    row->chars = (char*)realloc(row->chars,row->size+len+1);
-    memcpy(row->chars+row->size,s,len);
-    row->size += len;
-    row->chars[row->size] = '\0';
+/* Replace the 'del' bytes at offset 'at' of a row with the 'len' bytes at
+ * 's'. */
+void editorRowSplice(editorConfig *E, erow *row, long long at, long long del, const char *s, size_t len) {
+    editorRowPrepareWrite(E,row);
+    longLineChanged(row,at);
+    if ((long long)len > del)
+        row->chars = (char*)realloc(row->chars,row->size-del+len+1);
+    memmove(row->chars+at+len,row->chars+at+del,row->size-at-del+1);
+    memcpy(row->chars+at,s,len);
+    row->size += len-del;
     editorUpdateRow(E, row);
     E->dirty++;
+    swapLogSplice(E,row-E->row,at,del,s,len);
+}
+
+/* Append the string 's' at the end of a row */
+void editorRowAppendString(editorConfig *E, erow *row, char *s, size_t len) {
+    editorRowSplice(E,row,row->size,0,s,len);
 }
 
 /* Delete the character at offset 'at' from the specified row. */
-void editorRowDelChar(editorConfig *E, erow *row, int at) {
+void editorRowDelChar(editorConfig *E, erow *row, long long at) {
     if (row->size <= at) return;
+    editorRowPrepareWrite(E,row);
+    longLineChanged(row,at);
     memmove(row->chars+at,row->chars+at+1,row->size-at);
-    editorUpdateRow(E, row);
     row->size--;
+    editorUpdateRow(E, row);
     E->dirty++;
+    swapLogSplice(E,row-E->row,at,1,NULL,0);
 }
 
 /* Insert the specified char at the current prompt position. */
 void editorInsertChar(editorConfig *E, int c) {
-    int filerow = E->rowoff + E->cy;
-    int filecol = E->coloff + E->cx;
+    long long filerow = E->rowoff + E->cy;
+    long long filecol = E->coloff + E->cx;
     erow *row = (filerow >= E->numrows) ? NULL : &E->row[filerow];
 
     /* If the row where the cursor is currently located does not exist in our
@@ -344,8 +522,8 @@ void editorInsertChar(editorConfig *E, int c) {
 /* Inserting a newline is slightly complex as we have to handle inserting a
  * newline in the middle of a line, splitting the line as needed. */
 void editorInsertNewline(editorConfig *E) {
-    int filerow = E->rowoff + E->cy;
-    int filecol = E->coloff + E->cx;
+    long long filerow = E->rowoff + E->cy;
+    long long filecol = E->coloff + E->cx;
     erow *row = (filerow >= E->numrows) ? NULL : &E->row[filerow];
 
     if (!row) {
@@ -364,9 +542,13 @@ void editorInsertNewline(editorConfig *E) {
         /* We are in the middle of a line. Split it between two rows. */
         editorInsertRow(E, filerow+1,row->chars+filecol,row->size-filecol);
         row = &E->row[filerow];
+        long long moved = row->size-filecol;
+        editorRowPrepareWrite(E,row);
+        longLineChanged(row,filecol);
         row->chars[filecol] = '\0';
         row->size = filecol;
         editorUpdateRow(E, row);
+        swapLogSplice(E,filerow,filecol,moved,NULL,0);
     }
 fixcursor:
     if (E->cy == E->screenrows-1) {
@@ -381,8 +563,8 @@ fixcursor:
 /* Delete the char at the current prompt position.
  * Returns the deleted char.*/
 char editorDelChar(editorConfig *E) {
-    int filerow = E->rowoff+E->cy;
-    int filecol = E->coloff+E->cx;
+    long long filerow = E->rowoff+E->cy;
+    long long filecol = E->coloff+E->cx;
     erow *row = (filerow >= E->numrows) ? NULL : &E->row[filerow];
 
     if (!row || (filecol == 0 && filerow == 0)) return 0;
@@ -397,12 +579,12 @@ char editorDelChar(editorConfig *E) {
             E->rowoff--;
         else
             E->cy--;
-        E->cx = filecol;
-        if (E->cx >= E->screencols) {
-            int shift = (E->screencols-E->cx)+1;
-            E->cx -= shift;
-            E->coloff += shift;
-		}
+        if (filecol >= E->screencols) {
+            E->coloff = filecol-E->screencols+1;
+            E->cx = E->screencols-1;
+        } else {
+            E->cx = filecol;
+        }
 		return '\n';
     }
 	else {
@@ -418,12 +600,30 @@ char editorDelChar(editorConfig *E) {
     E->dirty++;
 }
 
+/* Delete the char before the cursor, all the bytes of it if it is a UTF-8
+ * one, recording them in 'bus' unless it is NULL. */
+void editorDelCharBefore(editorConfig *E, UndoCommandBus *bus) {
+    long long filerow = E->rowoff+E->cy;
+    long long filecol = E->coloff+E->cx;
+    long long n = 1;
+
+    if (filerow < E->numrows && filecol > 0 && filecol <= E->row[filerow].size)
+        n = filecol-editorRowPrevChar(&E->row[filerow],filecol);
+    while (n--) {
+        char deleted_char = editorDelChar(E);
+        if (bus) PushCommand(E,bus,UNDO_CMD_DELETE_LEFT_CHAR,deleted_char);
+    }
+}
+
 /* Load the specified program in the editor memory and returns 0 on success
  * or 1 on error. */
 int editorOpen(editorConfig *E, char *filename) {
+    TRACE_SPAN("editorOpen");
     FILE *fp;
+    struct stat st;
 
     E->dirty = 0;
+    trigramClose(E);
     free(E->filename);
     size_t fnlen = strlen(filename)+1;
     E->filename = (char*)malloc(fnlen);
@@ -432,16 +632,26 @@ int editorOpen(editorConfig *E, char *filename) {
     fp = fopen(filename,"r");
     if (!fp) {
         if (errno != ENOENT) {
+            editorAtExit(E);
             perror("Opening file");
             exit(1);
         }
+        E->file_hash = EDITOR_HASH_INIT;
+        if (!E->headless) swapStart(E);
         return 1;
     }
+    int stamped = fstat(fileno(fp),&st) != -1;
+    if (!stamped) st.st_size = 0;
 
     char *line = NULL;
     size_t linecap = 0;
     ssize_t linelen;
+    uint64_t hash = EDITOR_HASH_INIT, off = 0;
     while((linelen = getline(&line,&linecap,fp)) != -1) {
+        if (E->numrows % SAVE_CHECKPOINT_ROWS == 0)
+            E->saved.ckpt.push_back({off,hash});
+        off += linelen;
+        hash = editorHashBytes(hash,line,linelen);
         if (linelen && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
             line[--linelen] = '\0';
         editorInsertRow(E, E->numrows, line, linelen);
@@ -449,37 +659,398 @@ int editorOpen(editorConfig *E, char *filename) {
     free(line);
     fclose(fp);
     E->dirty = 0;
+    E->file_hash = hash;
+    if (E->numrows == 0) E->saved.ckpt.push_back({0,hash});
+    if (!stamped) E->saved.ckpt.clear();
+    E->saved.lowrow = LLONG_MAX;
+    E->saved.dev = st.st_dev;
+    E->saved.ino = st.st_ino;
+    E->saved.size = st.st_size;
+    E->saved.mtime = st.st_mtim;
+    /* Without a terminal there is nobody to undo, recover or search
+     * interactively: nothing runs in the background. */
+    if (E->headless) return 0;
+    editorUndoJournalLoad(E);
+    trigramStart(E, &st);
+    swapStart(E);
     return 0;
 }
 
-/* Save the current file on disk. Return 0 on success, 1 on error. */
-int editorSave(editorConfig *E) {
-    int len;
-    char *buf = editorRowsToString(E, &len);
-    int fd = open(E->filename,O_RDWR|O_CREAT,0644);
-    if (fd == -1) goto writeerr;
-
-    /* Use truncate + a single write(2) call in order to make saving
-     * a bit safer, under the limits of what we can do in a small editor. */
-    if (ftruncate(fd,len) == -1) goto writeerr;
-    if (write(fd,buf,len) != len) goto writeerr;
-
-    close(fd);
-    free(buf);
+/* Forget the current file and everything attached to it, leaving an empty
+ * buffer ready for editorOpen(). */
+void editorCloseFile(editorConfig *E) {
+    editorSaveReap(E,1);
+    for (long long j = 0; j < E->numrows; j++) editorFreeRow(&E->row[j]);
+    free(E->row);
+    E->row = NULL;
+    E->numrows = 0;
+    E->cx = E->cy = E->rowoff = E->coloff = 0;
+    E->wrap.valid = 0;
+    E->wrap.lineoff = 0;
     E->dirty = 0;
-    editorSetStatusMessage(E, "%d bytes written on disk", len);
+    E->syntax = NULL;
+    editorUndoJournalClose(E);
+    E->m_command_queue.clear();
+    E->m_command_index = 0;
+    searchCancel(E);
+    trigramClose(E);
+    swapClose(E);
+    free(E->filename);
+    E->filename = NULL;
+    E->saved = editorSaveState();
+    E->version++;
+}
+
+/* Write every row of the snapshot followed by a newline to 'fd', a batch of
+ * rows per writev(2) call, so the file is never copied in memory. The
+ * content hash and the checkpoints are computed along the way, carrying on
+ * from job->start. Returns 0 on success, -1 on error with errno set. */
+static int editorWriteRows(editorSaveJob *job, int fd) {
+    const int batch = 1024; /* IOV_MAX on Linux. */
+    struct iovec iov[batch];
+    static char newline = '\n';
+    size_t j = 0, numrows = job->rows.size();
+    uint64_t off = job->start.off;
+
+    job->hash = job->start.hash;
+    while (j < numrows) {
+        int n = 0;
+        for (; j < numrows && n+2 <= batch; j++) {
+            if ((job->firstrow+j) % SAVE_CHECKPOINT_ROWS == 0)
+                job->ckpt.push_back({off,job->hash});
+            iov[n++] = job->rows[j];
+            iov[n].iov_base = &newline;
+            iov[n++].iov_len = 1;
+            job->hash = editorHashBytes(job->hash,
+                (const char*)job->rows[j].iov_base,job->rows[j].iov_len);
+            job->hash = editorHashBytes(job->hash,&newline,1);
+            off += job->rows[j].iov_len+1;
+        }
+
+        /* writev() may stop short: skip what was written and retry. */
+        struct iovec *v = iov;
+        while (n) {
+            ssize_t nw = writev(fd,v,n);
+            if (nw == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            job->written += nw;
+            while (n && (size_t)nw >= v->iov_len) {
+                nw -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n) {
+                v->iov_base = (char*)v->iov_base + nw;
+                v->iov_len -= nw;
+            }
+        }
+    }
+    if (job->ckpt.empty()) job->ckpt.push_back({0,job->hash});
     return 0;
+}
 
-writeerr:
-    free(buf);
+/* Save thread, in place: only the rows from job->start on changed, so they
+ * are written over the old ones and the file is cut where the new content
+ * ends. */
+static void editorSaveInPlace(editorSaveJob *job) {
+    TRACE_SPAN("editorSaveInPlace");
+    /* A crash midway leaves the file torn: the swap must cover that first. */
+    if (job->swap) swapSaveTail(job->swap.get(),job);
+    int fd = open(job->path.c_str(),O_WRONLY);
+
+    if (fd == -1)
+        job->failed = "open";
+    else if (lseek(fd,job->start.off,SEEK_SET) == -1)
+        job->failed = "seek";
+    else if (editorWriteRows(job,fd) == -1)
+        job->failed = "write";
+    else if (ftruncate(fd,job->len) == -1)
+        job->failed = "truncate";
+    else if (fdatasync(fd) == -1)
+        job->failed = "fsync";
+    else if (fstat(fd,&job->st) == -1)
+        job->failed = "stat";
+    if (job->failed) job->err = errno;
     if (fd != -1) close(fd);
-    editorSetStatusMessage(E, "Can't save! I/O error: %s",strerror(errno));
-    return 1;
+    job->done = 1;
 }
 
-/* This function writes the whole screen using VT100 escape characters
- * starting from the logical state of the editor in the global state 'E'. */
-void editorRefreshScreen(editorConfig *E) {
+/* Save thread, whole file. Nothing touches the original file until the new
+ * content is complete and synced in the temp file, so a crash or a full disk
+ * midway leave it intact. The directory is synced as well after the rename,
+ * so the rename survives a crash too. */
+static void editorSaveWrite(editorSaveJob *job) {
+    TRACE_SPAN("editorSaveWrite");
+    struct stat st;
+    int fd = open(job->tmppath.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+
+    if (fd == -1) {
+        job->failed = "open";
+    } else if (stat(job->path.c_str(),&st) == 0 &&
+               fchmod(fd,st.st_mode & 07777) == -1) {
+        /* The new file takes the place of the old one: same permissions,
+         * and the same owner when we are allowed to. */
+        job->failed = "chmod";
+    } else {
+        if (stat(job->path.c_str(),&st) == 0 &&
+            fchown(fd,st.st_uid,st.st_gid) == -1) {}
+        if (editorWriteRows(job,fd) == -1)
+            job->failed = "write";
+        else if (fsync(fd) == -1)
+            job->failed = "fsync";
+        else if (fstat(fd,&job->st) == -1)
+            job->failed = "stat";
+        else if (rename(job->tmppath.c_str(),job->path.c_str()) == -1)
+            job->failed = "rename";
+    }
+    if (job->failed) {
+        job->err = errno;
+        if (fd != -1) unlink(job->tmppath.c_str());
+    } else {
+        std::string dir = job->path;
+        size_t slash = dir.rfind('/');
+        dir = slash == std::string::npos ? "." : dir.substr(0,slash+1);
+        int dfd = open(dir.c_str(),O_RDONLY|O_DIRECTORY);
+        if (dfd != -1) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+    if (fd != -1) close(fd);
+    job->done = 1;
+}
+
+/* Collect the save in progress, if it is over or 'wait' is true, and report
+ * how it went. The buffer is clean only if it was not edited meanwhile, and
+ * so is the undo history written only then: the journal must describe the
+ * content on disk. Returns 1 if a save was collected, -1 if it failed. */
+int editorSaveReap(editorConfig *E, int wait) {
+    editorSaveJob *job = E->save.get();
+    editorSaveState *saved = &E->saved;
+    int retval = 1;
+
+    if (job == NULL || (!wait && !job->done)) return 0;
+    job->thread.join();
+    for (char *p : job->orphans) free(p);
+    if (job->failed) {
+        /* The changes since the last good save are still to be written. A
+         * failed write in place leaves the file in an unknown state: only
+         * a whole save will do next time. */
+        saved->lowrow = std::min(saved->lowrow,job->lowrow);
+        if (job->inplace) saved->ckpt.clear();
+        swapSaveEnd(E,0,0);
+        editorSetStatusMessage(E,"Can't save! %s: %s",job->failed,strerror(job->err));
+        retval = -1;
+    } else {
+        E->file_hash = job->hash;
+        saved->ckpt.swap(job->ckpt);
+        saved->dev = job->st.st_dev;
+        saved->ino = job->st.st_ino;
+        saved->size = job->st.st_size;
+        saved->mtime = job->st.st_mtim;
+        swapSaveEnd(E,1,job->hash);
+
+        char written[64] = "";
+        if (job->inplace) snprintf(written,sizeof(written)," (%zu rewritten)",job->written);
+        if (E->version != job->version) {
+            editorSetStatusMessage(E, "%zu bytes written on disk%s, edited since", job->len, written);
+        } else {
+            E->dirty = 0;
+            if (!E->headless && editorUndoJournalWrite(E) == -1)
+                editorSetStatusMessage(E, "%zu bytes written on disk%s, undo history not saved", job->len, written);
+            else
+                editorSetStatusMessage(E, "%zu bytes written on disk%s", job->len, written);
+        }
+    }
+    E->save.reset();
+    return retval;
+}
+
+/* Save the rows in the background. The snapshot costs a pointer per row, no
+ * content is copied: see editorRowPrepareWrite(). When the rows changed since
+ * the last save are all near the end of a big file that nobody else touched,
+ * only the end of the file is rewritten, and only those rows are in the
+ * snapshot. Returns 0 if the save was started, the outcome is reported by
+ * editorSaveReap(). */
+int editorSave(editorConfig *E) {
+    TRACE_SPAN("editorSave");
+    editorSaveState *saved = &E->saved;
+    char tmppath[PATH_MAX];
+    struct stat st;
+
+    /* The temp file of a save in progress is reused: let it finish. */
+    editorSaveReap(E,1);
+
+    std::unique_ptr<editorSaveJob> job(new editorSaveJob);
+    char *real = realpath(E->filename,NULL);
+    job->path = real ? real : E->filename;
+    free(real);
+    editorSidecarPath(job->path.c_str(),"save",tmppath,sizeof(tmppath));
+    job->tmppath = tmppath;
+
+    /* Can we start from the checkpoint before the first changed row? */
+    size_t c = std::min(saved->lowrow,E->numrows) / SAVE_CHECKPOINT_ROWS;
+    if (c < saved->ckpt.size() && stat(job->path.c_str(),&st) == 0 &&
+        st.st_dev == saved->dev && st.st_ino == saved->ino &&
+        st.st_size == saved->size &&
+        st.st_mtim.tv_sec == saved->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == saved->mtime.tv_nsec)
+    {
+        size_t tail = 0;
+        for (long long j = c*SAVE_CHECKPOINT_ROWS; j < E->numrows; j++)
+            tail += E->row[j].size+1;
+        size_t len = saved->ckpt[c].off + tail;
+        if (len >= SAVE_INPLACE_MIN && tail <= len/4) {
+            job->inplace = 1;
+            job->firstrow = c*SAVE_CHECKPOINT_ROWS;
+            job->start = saved->ckpt[c];
+            job->ckpt.assign(saved->ckpt.begin(),saved->ckpt.begin()+c);
+            job->swap = E->swap;
+        }
+    }
+
+    job->rows.resize(E->numrows-job->firstrow);
+    for (size_t j = 0; j < job->rows.size(); j++) {
+        erow *row = &E->row[job->firstrow+j];
+        job->rows[j].iov_base = row->chars;
+        job->rows[j].iov_len = row->size;
+        job->len += row->size+1;
+    }
+    job->len += job->start.off;
+    job->version = E->version;
+    job->lowrow = saved->lowrow;
+    saved->lowrow = LLONG_MAX;
+    E->snapgen++;
+    swapSaveStart(E);
+
+    job->thread = std::thread(job->inplace ? editorSaveInPlace : editorSaveWrite,job.get());
+    editorSetStatusMessage(E, "Saving %zu bytes...", job->len);
+    E->save = std::move(job);
+    return 0;
+}
+
+/* Screen column of the byte 'at' of the cursor row, counting one column for
+ * every byte past its end. */
+static long long editorScreenCol(editorConfig *E, long long at) {
+    long long filerow = E->rowoff+E->cy;
+    if (filerow < 0 || filerow >= E->numrows) return at;
+    erow *row = &E->row[filerow];
+    if (at > row->size) return editorRowWidth(row)+(at-row->size);
+    return editorRowCxToRx(row,at);
+}
+
+/* Column of the rows the screen starts at without soft wrap. E->coloff counts
+ * bytes of the cursor row, like E->cx: the screen starts at the column of
+ * that byte, the same for every row so that they stay aligned. */
+long long editorScreenLeft(editorConfig *E) {
+    return editorScreenCol(E,E->coloff);
+}
+
+/* TABs and wide chars make the cursor row wider on screen than its bytes:
+ * scroll right until the cursor is on screen. */
+static void editorScrollCols(editorConfig *E) {
+    long long filerow = E->rowoff+E->cy;
+    if (filerow < 0 || filerow >= E->numrows) return;
+    erow *row = &E->row[filerow];
+    long long filecol = E->coloff+E->cx;
+    if (filecol > row->size) return;
+    long long rx = editorRowCxToRx(row,filecol);
+    if (rx-editorScreenLeft(E) < E->screencols) return;
+
+    long long left = rx-E->screencols+1;
+    long long coloff = editorRowRxToCx(row,left);
+    if (editorRowCxToRx(row,coloff) < left) coloff = editorRowNextChar(row,coloff);
+    E->coloff = coloff;
+    E->cx = filecol-coloff;
+}
+
+/* Draw the screen line 'y' showing 'len' screen columns of the row 'r' from
+ * the column 'from' on. With 'r' NULL the line is past the end of the file. */
+void editorDrawRow(editorConfig *E, struct abuf *ab, erow *r, long long from,
+                   long long len, int y)
+{
+    TRACE_SPAN("editorDrawRow");
+    if (r == NULL) {
+        if (E->numrows == 0 && y == E->screenrows/3) {
+            char welcome[80];
+            int welcomelen = snprintf(welcome,sizeof(welcome),
+                "Kilo editor -- verison %s\x1b[0K\r\n", KILO_VERSION);
+            int padding = (E->screencols-welcomelen)/2;
+            if (padding) {
+                abAppend(ab,"~",1);
+                padding--;
+            }
+            while(padding--) abAppend(ab," ",1);
+            abAppend(ab,welcome,welcomelen);
+        } else {
+            abAppend(ab,"~\x1b[0K\r\n",7);
+        }
+        return;
+    }
+
+    editorRowFreshSyntax(E, r);
+    if (r->ll && from < r->rsize)
+        longLineWindow(E, r, from, from+len);
+
+    /* The columns to show as render indexes. A wide char cut by the left
+     * edge leaves a blank, one cut by the right edge is left out. */
+    long long b = from, e = from+len;
+    if (!r->ascii) {
+        b = editorRowRxToRender(r,from);
+        e = editorRowRxToRender(r,from+len);
+        if (b < r->rsize && editorRowRenderToRx(r,b) < from) {
+            abAppend(ab," ",1);
+            b = editorRowRxToRender(r,from+1);
+        }
+    }
+
+    int current_color = -1;
+    if (e > r->roff + r->rlen) e = r->roff + r->rlen;
+    if (e > b) {
+        char *c = r->render + b - r->roff;
+        unsigned char *hl = r->hl + b - r->roff;
+        long long j;
+        for (j = 0; j < e-b; j++) {
+            /* Long rows take a column per byte: UTF-8 is only shown in the
+             * others, where what is not valid was rendered as DEL. */
+            if (hl[j] == HL_NONPRINT || c[j] == 0x7f || (r->ll && (c[j] & 0x80))) {
+                char sym;
+                abAppend(ab,"\x1b[7m",4);
+                if (c[j] >= 0 && c[j] <= 26)
+                    sym = '@'+c[j];
+                else
+                    sym = '?';
+                abAppend(ab,&sym,1);
+                abAppend(ab,"\x1b[0m",4);
+            } else if (hl[j] == HL_NORMAL) {
+                if (current_color != -1) {
+                    abAppend(ab,"\x1b[39m",5);
+                    current_color = -1;
+                }
+                abAppend(ab,c+j,1);
+            } else {
+                int color = editorSyntaxToColor(hl[j]);
+                if (color != current_color) {
+                    char buf[16];
+                    int clen = snprintf(buf,sizeof(buf),"\x1b[%dm",color);
+                    current_color = color;
+                    abAppend(ab,buf,clen);
+                }
+                abAppend(ab,c+j,1);
+            }
+        }
+    }
+    abAppend(ab,"\x1b[39m",5);
+    abAppend(ab,"\x1b[0K",4);
+    abAppend(ab,"\r\n",2);
+}
+
+/* Append to 'ab' the VT100 escape sequences drawing the whole screen from
+ * the logical state of the editor in 'E': the rows, the status and the
+ * cursor. */
+void editorDrawScreen(editorConfig *E, struct abuf *ab) {
 	// Telling the user the editor mode
 	const char* mode_status;
 	if (E->mode == EDITOR_MODE_NORMAL)
@@ -488,120 +1059,89 @@ void editorRefreshScreen(editorConfig *E) {
 		mode_status = "--INSERT--";	
 	//editorSetStatusMessage("%s", status_message);
 
-    int y;
-    erow *r;
     char buf[32];
-    struct abuf ab = ABUF_INIT;
 
-    abAppend(&ab,"\x1b[?25l",6); /* Hide cursor. */
-    abAppend(&ab,"\x1b[H",3); /* Go home. */
-    for (y = 0; y < E->screenrows; y++) {
-        int filerow = E->rowoff+y;
-
-        if (filerow >= E->numrows) {
-            if (E->numrows == 0 && y == E->screenrows/3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome,sizeof(welcome),
-                    "Kilo editor -- verison %s\x1b[0K\r\n", KILO_VERSION);
-                int padding = (E->screencols-welcomelen)/2;
-                if (padding) {
-                    abAppend(&ab,"~",1);
-                    padding--;
-                }
-                while(padding--) abAppend(&ab," ",1);
-                abAppend(&ab,welcome,welcomelen);
-            } else {
-                abAppend(&ab,"~\x1b[0K\r\n",7);
-            }
-            continue;
-        }
-
-        r = &E->row[filerow];
-
-        int len = r->rsize - E->coloff;
-        int current_color = -1;
-        if (len > 0) {
-            if (len > E->screencols) len = E->screencols;
-            char *c = r->render + E->coloff;
-            unsigned char *hl = r->hl+E->coloff;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (hl[j] == HL_NONPRINT) {
-                    char sym;
-                    abAppend(&ab,"\x1b[7m",4);
-                    if (c[j] <= 26)
-                        sym = '@'+c[j];
-                    else
-                        sym = '?';
-                    abAppend(&ab,&sym,1);
-                    abAppend(&ab,"\x1b[0m",4);
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(&ab,"\x1b[39m",5);
-                        current_color = -1;
-                    }
-                    abAppend(&ab,c+j,1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        char buf[16];
-                        int clen = snprintf(buf,sizeof(buf),"\x1b[%dm",color);
-                        current_color = color;
-                        abAppend(&ab,buf,clen);
-                    }
-                    abAppend(&ab,c+j,1);
-                }
-            }
+    abAppend(ab,"\x1b[?25l",6); /* Hide cursor. */
+    abAppend(ab,"\x1b[H",3); /* Go home. */
+    if (E->wrap.on) {
+        wrapScroll(E);
+        wrapDrawRows(E,ab);
+    } else {
+        editorScrollCols(E);
+        long long left = editorScreenLeft(E);
+        for (int y = 0; y < E->screenrows; y++) {
+            long long filerow = E->rowoff+y;
+            editorDrawRow(E,ab,filerow < E->numrows ? &E->row[filerow] : NULL,
+                          left,E->screencols,y);
         }
-        abAppend(&ab,"\x1b[39m",5);
-        abAppend(&ab,"\x1b[0K",4);
-        abAppend(&ab,"\r\n",2);
     }
 
     /* Create a two rows status. First row: */
-    abAppend(&ab,"\x1b[0K",4);
-    abAppend(&ab,"\x1b[7m",4);
+    abAppend(ab,"\x1b[0K",4);
+    abAppend(ab,"\x1b[7m",4);
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), " %s %.20s - %d lines %s",
+    int len = snprintf(status, sizeof(status), " %s %.20s - %lld lines %s",
         mode_status, E->filename, E->numrows, E->dirty ? "(modified)" : "");
     int rlen = snprintf(rstatus, sizeof(rstatus),
-        "%d/%d", E->rowoff + E->cy+1, E->numrows);
+        "%lld/%lld", E->rowoff + E->cy+1, E->numrows);
     if (len > E->screencols) len = E->screencols;
-    abAppend(&ab,status,len);
+    abAppend(ab,status,len);
     while(len < E->screencols) {
         if (E->screencols - len == rlen) {
-            abAppend(&ab,rstatus,rlen);
+            abAppend(ab,rstatus,rlen);
             break;
         } else {
-            abAppend(&ab," ",1);
+            abAppend(ab," ",1);
             len++;
         }
     }
-    abAppend(&ab,"\x1b[0m\r\n",6);
-
-    /* Second row depends on E.statusmsg and the status message update time. */
-    abAppend(&ab,"\x1b[0K",4);
-    int msglen = strlen(E->statusmsg);
-    if (msglen && time(NULL) - E->statusmsg_time < 5)
-        abAppend(&ab, E->statusmsg,msglen <= E->screencols ? msglen : E->screencols);
+    abAppend(ab,"\x1b[0m\r\n",6);
+
+    /* Second row depends on E.statusmsg and the status message update time,
+     * unless it shows the frame statistics. */
+    abAppend(ab,"\x1b[0K",4);
+    char overlay[256];
+    int msglen = statsOverlay(overlay,sizeof(overlay));
+    if (msglen) {
+        abAppend(ab,overlay,msglen <= E->screencols ? msglen : E->screencols);
+    } else {
+        msglen = strlen(E->statusmsg);
+        if (msglen && time(NULL) - E->statusmsg_time < 5)
+            abAppend(ab, E->statusmsg,msglen <= E->screencols ? msglen : E->screencols);
+    }
 
     /* Put cursor at its current position. Note that the horizontal position
      * at which the cursor is displayed may be different compared to 'E.cx'
-     * because of TABs. */
-    int j;
-    int cx = 1;
-    int filerow = E->rowoff + E->cy;
+     * because of TABs: it comes from the column map of the row. */
+    int cx = 1, cy = E->cy;
+    long long filerow = E->rowoff + E->cy;
     erow *row = (filerow >= E->numrows) ? NULL : &E->row[filerow];
-    if (row) {
-        for (j = E->coloff; j < E->cx + E->coloff; j++) {
-            if (j < row->size && row->chars[j] == TAB) cx += 7-((cx)%8);
-            cx++;
-        }
+    if (E->wrap.on) {
+        wrapCursorPos(E,&cy,&cx);
+        cx++;
+    } else if (row) {
+        cx += editorScreenCol(E,E->coloff+E->cx) - editorScreenLeft(E);
     }
-    snprintf(buf, sizeof(buf),"\x1b[%d;%dH", E->cy + 1, cx);
-    abAppend(&ab, buf, strlen(buf));
-    abAppend(&ab,"\x1b[?25h",6); /* Show cursor. */
-    write(STDOUT_FILENO,ab.b,ab.len);
+    snprintf(buf, sizeof(buf),"\x1b[%d;%dH", cy + 1, cx);
+    abAppend(ab, buf, strlen(buf));
+    abAppend(ab,"\x1b[?25h",6); /* Show cursor. */
+}
+
+/* Draw the screen and write it to the terminal with a single write(2), to
+ * avoid flickering. */
+void editorRefreshScreen(editorConfig *E) {
+    if (E->headless) return;
+    TRACE_SPAN("editorRefreshScreen");
+    uint64_t start = statsNow();
+    struct abuf ab = ABUF_INIT;
+
+    editorDrawScreen(E,&ab);
+    uint64_t write_start = statsNow();
+    {
+        TRACE_SPAN("write");
+        write(STDOUT_FILENO,ab.b,ab.len);
+    }
+    statsFrame(start,write_start,ab.len);
     abFree(&ab);
 }
 
@@ -615,24 +1155,166 @@ void editorSetStatusMessage(editorConfig *E, const char *fmt, ...) {
     E->statusmsg_time = time(NULL);
 }
 
+/* Coordinates of a position in a short row, see rowCol. */
+enum { ROWPOS_BYTE, ROWPOS_RENDER, ROWPOS_COL };
+
+static long long rowColEnd(const rowCol *m, int coord) {
+    if (coord == ROWPOS_BYTE) return m->at+m->len;
+    return coord == ROWPOS_RENDER ? m->rx : m->col;
+}
+
+/* Convert the position 'pos' of a short row from the coordinate 'from' to
+ * 'to', with the column map built by editorUpdateRender(). A position inside
+ * a TAB or a UTF-8 char gives where it starts. */
+static long long editorRowMap(erow *row, int from, int to, long long pos) {
+    if (row->ncmap == 0) return pos;
+    if (row->ascii && from != ROWPOS_BYTE && to != ROWPOS_BYTE) return pos;
+
+    /* Between the entry ending after 'pos' and the one before it every
+     * byte is one byte of render and one column. */
+    rowCol *m = std::upper_bound(row->cmap,row->cmap+row->ncmap,pos,
+        [from](long long p, const rowCol &c) { return p < rowColEnd(&c,from); });
+    long long at = 0, bfrom = 0, bto = 0;
+    if (m != row->cmap) {
+        at = m[-1].at+m[-1].len;
+        bfrom = rowColEnd(m-1,from);
+        bto = rowColEnd(m-1,to);
+    }
+    if (m != row->cmap+row->ncmap && pos >= bfrom+(m->at-at))
+        return bto+(m->at-at);
+    return bto+(pos-bfrom);
+}
+
+/* Convert a chars index of the row into the screen column it is shown at,
+ * that for rows of ASCII is also its render index. */
+long long editorRowCxToRx(erow *row, long long cx) {
+    if (row->ll) return longLineCol(row,cx);
+    if (cx > row->size) cx = row->size;
+    return editorRowMap(row,ROWPOS_BYTE,ROWPOS_COL,cx);
+}
+
+/* Convert a screen column of the row into the index of the char shown there:
+ * a column inside a TAB or a wide char gives its first byte. */
+long long editorRowRxToCx(erow *row, long long rx) {
+    if (row->ll) return longLineByte(row,rx);
+    if (rx >= editorRowWidth(row)) return row->size;
+    return editorRowMap(row,ROWPOS_COL,ROWPOS_BYTE,rx);
+}
+
+/* Render index of the char at the index 'cx' of the row. For long rows this
+ * counts from the start of the row, not of the window. */
+long long editorRowCxToRender(erow *row, long long cx) {
+    if (row->ll) return longLineCol(row,cx);
+    if (cx > row->size) cx = row->size;
+    return editorRowMap(row,ROWPOS_BYTE,ROWPOS_RENDER,cx);
+}
+
+/* Render index of the char shown at the screen column 'rx'. */
+long long editorRowRxToRender(erow *row, long long rx) {
+    if (row->ll) return rx;
+    return editorRowMap(row,ROWPOS_COL,ROWPOS_RENDER,rx);
+}
+
+/* Screen column of the char at the render index 'roff'. */
+long long editorRowRenderToRx(erow *row, long long roff) {
+    if (row->ll) return roff;
+    return editorRowMap(row,ROWPOS_RENDER,ROWPOS_COL,roff);
+}
+
+/* Columns the row takes on screen. */
+long long editorRowWidth(erow *row) {
+    if (row->ll || row->ascii) return row->rsize;
+    return editorRowMap(row,ROWPOS_RENDER,ROWPOS_COL,row->rsize);
+}
+
+/* The entry of the column map for the byte 'at', NULL if it has none: it is
+ * then a char of its own. Sets '*col' to the column the entry starts at. */
+static rowCol *editorRowCharMap(erow *row, long long at, long long *col) {
+    if (row->ll || row->ncmap == 0) return NULL;
+    rowCol *m = std::upper_bound(row->cmap,row->cmap+row->ncmap,at,
+        [](long long p, const rowCol &c) { return p < c.at+c.len; });
+    if (m == row->cmap+row->ncmap || at < m->at) return NULL;
+    *col = m == row->cmap ? m->at : m[-1].col+(m->at-m[-1].at-m[-1].len);
+    return m;
+}
+
+/* True if the char at the byte 'at' takes no column, as combining accents,
+ * that go with the char before them. */
+static int editorRowZeroWidth(erow *row, long long at) {
+    long long col;
+    rowCol *m = editorRowCharMap(row,at,&col);
+    return m && m->col == col;
+}
+
+/* Index of the char after the one at 'at', skipping the zero width ones
+ * that go with it: the cursor moves over them as one. */
+long long editorRowNextChar(erow *row, long long at) {
+    long long col;
+    if (at >= row->size) return at+1;
+    do {
+        rowCol *m = editorRowCharMap(row,at,&col);
+        at = m ? m->at+m->len : at+1;
+    } while (at < row->size && editorRowZeroWidth(row,at));
+    return at;
+}
+
+/* Index of the char before the one at 'at', see editorRowNextChar(). */
+long long editorRowPrevChar(erow *row, long long at) {
+    long long col;
+    if (at <= 0 || at > row->size) return at-1;
+    do {
+        rowCol *m = editorRowCharMap(row,at-1,&col);
+        at = m ? m->at : at-1;
+    } while (at > 0 && editorRowZeroWidth(row,at));
+    return at;
+}
+
 void editorFind(editorConfig *E, int fd) {
+    TRACE_SPAN("editorFind");
     char query[KILO_QUERY_LEN+1] = {0};
     int qlen = 0;
-    int last_match = -1; /* Last line where a match was found. -1 for none. */
+    long long last_match = -1; /* View offset of the last match. -1 for none. */
     int find_next = 0; /* if 1 search next, if -1 search prev. */
-    int saved_hl_line = -1;  /* No saved HL */
+    long long saved_hl_line = -1;  /* No saved HL */
     char *saved_hl = NULL;
 
     /* Save the cursor position in order to restore it later. */
-    int saved_cx = E->cx, saved_cy = E->cy;
-    int saved_coloff = E->coloff, saved_rowoff = E->rowoff;
+    long long saved_cx = E->cx, saved_cy = E->cy;
+    long long saved_coloff = E->coloff, saved_rowoff = E->rowoff;
 
     while(1) {
-        editorSetStatusMessage(E,
-            "Search: %s (Use ESC/Arrows/Enter)", query);
+        editorSearch *s = &E->search;
+        size_t count = 0;
+        int complete = qlen ? searchCollect(E,&count) : 0;
+        char mode[32];
+
+        snprintf(mode,sizeof(mode),"%s%s",
+            s->regex ? " [regex]" : "", s->icase ? " [icase]" : "");
+        if (!qlen) {
+            editorSetStatusMessage(E,
+                "Search%s: (ESC/Arrows/Enter, TAB case, Ctrl-R regex)", mode);
+        } else if (s->regex && s->reerr) {
+            editorSetStatusMessage(E, "Search%s: %s (%s)", mode, query, s->reerr);
+        } else if (s->overflow) {
+            editorSetStatusMessage(E, "Search%s: %s (%zu+ matches)",
+                mode, query, count);
+        } else if (complete && count == 0) {
+            editorSetStatusMessage(E, "Search%s: %s (no matches)", mode, query);
+        } else if (complete && last_match != -1) {
+            size_t nth = std::lower_bound(s->matches.begin(),s->matches.end(),
+                (size_t)last_match) - s->matches.begin() + 1;
+            editorSetStatusMessage(E, "Search%s: %s (match %zu of %zu)",
+                mode, query, nth, count);
+        } else {
+            editorSetStatusMessage(E, "Search%s: %s (%zu matches so far...)",
+                mode, query, count);
+        }
         editorRefreshScreen(E);
 
-        int c = editorReadKey(fd);
+        /* While a scan runs in the background don't block on the keyboard,
+         * so that the counts above refresh as results stream in. */
+        int c = KEY_NULL;
+        if (!s->job || editorWaitInput(fd,50)) c = editorReadKey(fd);
         if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
             if (qlen != 0) query[--qlen] = '\0';
             last_match = -1;
@@ -642,12 +1324,19 @@ void editorFind(editorConfig *E, int fd) {
                 E->coloff = saved_coloff; E->rowoff = saved_rowoff;
             }
             FIND_RESTORE_HL;
+            searchCancel(E);
             editorSetStatusMessage(E, "");
             return;
         } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
             find_next = 1;
         } else if (c == ARROW_LEFT || c == ARROW_UP) {
             find_next = -1;
+        } else if (c == TAB) {
+            s->icase = !s->icase;
+            last_match = -1;
+        } else if (c == CTRL_R) {
+            s->regex = !s->regex;
+            last_match = -1;
         } else if (isprint(c)) {
             if (qlen < KILO_QUERY_LEN) {
                 query[qlen++] = c;
@@ -656,46 +1345,76 @@ void editorFind(editorConfig *E, int fd) {
             }
         }
 
-        /* Search occurrence. */
+        /* Search occurrence. The sorted match index gives the next/previous
+         * match with a binary search, wrapping around at the start / end of
+         * the document. While it is being built only the part already
+         * collected can answer: if it can't, the request stays pending and is
+         * retried on the next round. If there are too many matches to index
+         * we scan the view directly instead. */
         if (last_match == -1) find_next = 1;
-        if (find_next) {
-            char *match = NULL;
-            int match_offset = 0;
-            int i, current = last_match;
-
-            for (i = 0; i < E->numrows; i++) {
-                current += find_next;
-                if (current == -1) current = E->numrows-1;
-                else if (current == E->numrows) current = 0;
-                match = strstr(E->row[current].render,query);
-                if (match) {
-                    match_offset = match - E->row[current].render;
-                    break;
+        if (find_next && qlen) {
+            TRACE_SPAN("editorFind next");
+            size_t match = 0, mlen = 0;
+            int found = 0, pending = 0;
+
+            complete = searchUpdateMatches(E,query,qlen);
+            if (complete || s->job) {
+                std::vector<size_t> &m = s->matches;
+                auto it = std::lower_bound(m.begin(),m.end(),
+                    (size_t)(last_match + (find_next == 1)));
+                size_t idx = 0;
+                if (find_next == 1 && it != m.end())
+                    idx = it - m.begin(), found = 1;
+                else if (find_next == -1 && it != m.begin())
+                    idx = it - m.begin() - 1, found = 1;
+                else if (!complete)
+                    pending = 1;
+                else if (!m.empty())
+                    idx = find_next == 1 ? 0 : m.size()-1, found = 1;
+                if (found) {
+                    match = m[idx];
+                    mlen = searchMatchLen(E,idx);
                 }
+            } else {
+                found = searchDirect(E,query,qlen,last_match,find_next,
+                                     &match,&mlen);
             }
-            find_next = 0;
+            if (!pending) find_next = 0;
 
             /* Highlight */
-            FIND_RESTORE_HL;
+            if (!pending) FIND_RESTORE_HL;
 
-            if (match) {
+            if (found) {
+                long long current = searchViewRow(E, match);
+                long long match_offset = match - s->rowstart[current];
                 erow *row = &E->row[current];
-                last_match = current;
-                if (row->hl) {
-                    saved_hl_line = current;
-                    saved_hl = (char*)malloc(row->rsize);
-                    memcpy(saved_hl,row->hl,row->rsize);
-                    memset(row->hl+match_offset,HL_MATCH,qlen);
-                }
+                last_match = match;
                 E->cy = 0;
-                E->cx = match_offset;
                 E->rowoff = current;
+                E->cx = match_offset;
                 E->coloff = 0;
                 /* Scroll horizontally as needed. */
-                if (E->cx > E->screencols) {
-                    int diff = E->cx - E->screencols;
-                    E->cx -= diff;
-                    E->coloff += diff;
+                if (match_offset > E->screencols-1) {
+                    E->cx = E->screencols-1;
+                    E->coloff = match_offset - E->screencols + 1;
+                }
+                editorScrollCols(E);
+
+                /* Highlight the match, in the window of long rows. */
+                editorRowFreshSyntax(E, row);
+                if (row->ll) {
+                    long long left = editorScreenLeft(E);
+                    longLineWindow(E, row, left, left+E->screencols);
+                }
+                long long rx = editorRowCxToRender(row, match_offset) - row->roff;
+                long long rxend = editorRowCxToRender(row, match_offset+mlen) - row->roff;
+                rx = std::max(0LL, std::min(rx, row->rlen));
+                rxend = std::max(rx, std::min(rxend, row->rlen));
+                if (row->hl) {
+                    saved_hl_line = current;
+                    saved_hl = (char*)malloc(row->rlen);
+                    memcpy(saved_hl,row->hl,row->rlen);
+                    memset(row->hl+rx,HL_MATCH,rxend-rx);
                 }
             }
         }
@@ -704,11 +1423,17 @@ void editorFind(editorConfig *E, int fd) {
 
 /* Handle cursor position change because arrow keys were pressed. */
 void editorMoveCursor(editorConfig *E, int key) {
-    int filerow = E->rowoff+E->cy;
-    int filecol = E->coloff+E->cx;
-    int rowlen;
+    long long filerow = E->rowoff+E->cy;
+    long long filecol = E->coloff+E->cx;
+    long long rowlen;
     erow *row = (filerow >= E->numrows) ? NULL : &E->row[filerow];
 
+    /* With soft wrap up and down go to the screen line above or below. */
+    if (E->wrap.on && (key == ARROW_UP || key == ARROW_DOWN)) {
+        wrapMoveCursor(E,key);
+        return;
+    }
+
     switch(key) {
     case ARROW_LEFT:
         if (E->cx == 0) {
@@ -716,10 +1441,11 @@ void editorMoveCursor(editorConfig *E, int key) {
                 E->coloff--;
             } else {
                 if (filerow > 0) {
+                    long long size = E->row[filerow-1].size;
                     E->cy--;
-                    E->cx = E->row[filerow-1].size;
-                    if (E->cx > E->screencols-1) {
-                        E->coloff = E->cx-E->screencols+1;
+                    E->cx = size;
+                    if (size > E->screencols-1) {
+                        E->coloff = size-E->screencols+1;
                         E->cx = E->screencols-1;
                     }
                 }
@@ -762,18 +1488,43 @@ void editorMoveCursor(editorConfig *E, int key) {
         }
         break;
     }
-    /* Fix cx if the current line has not enough chars. */
+    /* Fix cx if the current line has not enough chars, or if going up or
+     * down it fell inside a UTF-8 char. Left and right move by bytes, for
+     * undo: editorMoveCursorChar() is the one moving by chars. */
     filerow = E->rowoff+E->cy;
     filecol = E->coloff+E->cx;
     row = (filerow >= E->numrows) ? NULL : &E->row[filerow];
     rowlen = row ? row->size : 0;
-    if (filecol > rowlen) {
-        E->cx -= filecol-rowlen;
-        if (E->cx < 0) {
-            E->coloff += E->cx;
-            E->cx = 0;
+    long long to = filecol;
+    if (filecol > rowlen)
+        to = rowlen;
+    else if (row && filecol < rowlen && (key == ARROW_UP || key == ARROW_DOWN))
+        to = editorRowPrevChar(row,filecol+1);
+    if (to < filecol) {
+        long long cx = E->cx - (filecol-to);
+        if (cx < 0) {
+            E->coloff += cx;
+            cx = 0;
         }
+        E->cx = cx;
+    }
+}
+
+/* ARROW_LEFT and ARROW_RIGHT as typed: a UTF-8 char, with the zero width
+ * ones that go with it, is stepped over as a whole. */
+void editorMoveCursorChar(editorConfig *E, int key) {
+    long long filerow = E->rowoff+E->cy;
+    long long filecol = E->coloff+E->cx;
+    long long steps = 1;
+
+    if (filerow >= 0 && filerow < E->numrows) {
+        erow *row = &E->row[filerow];
+        if (key == ARROW_RIGHT && filecol < row->size)
+            steps = editorRowNextChar(row,filecol)-filecol;
+        else if (key == ARROW_LEFT && filecol > 0)
+            steps = filecol-editorRowPrevChar(row,filecol);
     }
+    while (steps--) editorMoveCursor(E,key);
 }
 
 int editorFileWasModified(editorConfig *E) {
@@ -793,7 +1544,8 @@ void editorHandleResize(editorConfig *E) {
     updateWindowSize(E);
     if (E->cy > E->screenrows) E->cy = E->screenrows - 1;
     if (E->cx > E->screencols) E->cx = E->screencols - 1;
-    editorRefreshScreen(E);
+    /* No refresh here: the main loop draws the screen right after, and a
+     * second frame per key would double the cost of every keystroke. */
 }
 
 void initEditor(editorConfig *E) {
@@ -806,37 +1558,55 @@ void initEditor(editorConfig *E) {
     E->dirty = 0;
     E->filename = NULL;
     E->syntax = NULL;
+    E->rawmode = 0;
+    E->statusmsg[0] = '\0';
+    E->statusmsg_time = 0;
+    if (E->headless) return; /* Keeps the screen size it was given. */
     updateWindowSize(E);
 	editorRefreshScreen(E);
 }
 
+/* Put the cursor at the file position 'pos' of a command, scrolling only
+ * if it is not on screen. */
+static void undoSetCursor(editorConfig *E, Uint2 pos) {
+	if (pos.y < E->rowoff || pos.y >= E->rowoff+E->screenrows)
+		E->rowoff = pos.y;
+	if (pos.x < E->coloff || pos.x >= E->coloff+E->screencols)
+		E->coloff = pos.x > E->screencols-1 ? pos.x-E->screencols+1 : 0;
+	E->cy = pos.y-E->rowoff;
+	E->cx = pos.x-E->coloff;
+}
+
 void editorUndo(editorConfig *E) {
 	if (E->m_command_index) {
-		UndoCommandBus bus = E->m_command_queue[E->m_command_index - 1];
+		UndoCommandBus bus;
+		editorUndoGetBus(E, E->m_command_index - 1, &bus);
 		E->m_command_index--;
 		for (int i = bus.size() - 1; i >= 0; i--) {
 			switch (bus[i].ID) {
 			case UNDO_CMD_INSERT:
-				E->cx = bus[i].pos.x;
-				E->cy = bus[i].pos.y;
+				undoSetCursor(E, bus[i].pos);
 				editorDelChar(E);
 				break;
 			case UNDO_CMD_DELETE_LEFT_CHAR:
-				E->cx = bus[i].pos.x;
-				E->cy = bus[i].pos.y;
+				undoSetCursor(E, bus[i].pos);
 				if (bus[i].c == '\n')
 					editorInsertNewline(E);
 				else
 					editorInsertChar(E, bus[i].c);
 				break;
 			case UNDO_CMD_DELETE_RIGHT_CHAR:
-				E->cx = bus[i].pos.x;
-				E->cy = bus[i].pos.y;
+				undoSetCursor(E, bus[i].pos);
 				if (bus[i].c == '\n')
 					editorInsertNewline(E);
 				else
 					editorInsertChar(E, bus[i].c);
 				break;
+			case UNDO_CMD_REPLACE_ROW:
+				if (bus[i].pos.y < E->numrows)
+					editorRowSetChars(E, &E->row[bus[i].pos.y],
+						bus[i].text->before.data(), bus[i].text->before.size());
+				break;
 			default:
 				break;
 			}
@@ -845,14 +1615,14 @@ void editorUndo(editorConfig *E) {
 }
 
 void editorRedo(editorConfig *E) {
-	if (E->m_command_index < E->m_command_queue.size()) {
-		UndoCommandBus bus = E->m_command_queue[E->m_command_index++];
+	if (E->m_command_index < editorUndoHistorySize(E)) {
+		UndoCommandBus bus;
+		editorUndoGetBus(E, E->m_command_index++, &bus);
 		for(int i = 0; i < bus.size(); i++) {
 			switch (bus[i].ID)
 			{
 			case UNDO_CMD_INSERT:
-				E->cx = bus[i].pos.x;
-				E->cy = bus[i].pos.y;
+				undoSetCursor(E, bus[i].pos);
 				if (bus[i].c == '\n')
 					editorInsertNewline(E);
 				else {
@@ -861,15 +1631,18 @@ void editorRedo(editorConfig *E) {
 				}
 				break;
 			case UNDO_CMD_DELETE_LEFT_CHAR:
-				E->cx = bus[i].pos.x;
-				E->cy = bus[i].pos.y;
+				undoSetCursor(E, bus[i].pos);
 				editorDelChar(E);
 				break;
 			case UNDO_CMD_DELETE_RIGHT_CHAR:
-				E->cx = bus[i].pos.x;
-				E->cy = bus[i].pos.y;
+				undoSetCursor(E, bus[i].pos);
 				editorDelChar(E);
 				break;
+			case UNDO_CMD_REPLACE_ROW:
+				if (bus[i].pos.y < E->numrows)
+					editorRowSetChars(E, &E->row[bus[i].pos.y],
+						bus[i].text->after.data(), bus[i].text->after.size());
+				break;
 			default:
 				break;
 			}
@@ -878,21 +1651,25 @@ void editorRedo(editorConfig *E) {
 }
 
 void DeleteRedoQueue(editorConfig *E) {
-	if ((E->m_command_queue.size() - E->m_command_index)) {
-		E->m_command_queue.erase(E->m_command_queue.begin() + E->m_command_index, E->m_command_queue.end());
+	if (E->m_command_index < E->m_journal.nbuses) {
+		/* Redoable buses in the mapped journal are simply forgotten. */
+		E->m_journal.nbuses = E->m_command_index;
+		E->m_command_queue.clear();
+	} else if ((editorUndoHistorySize(E) - E->m_command_index)) {
+		E->m_command_queue.erase(E->m_command_queue.begin() + (E->m_command_index - E->m_journal.nbuses), E->m_command_queue.end());
 	}
 }
 void PushCommand(editorConfig *E, UndoCommandBus* bus, char ID, char c) {
 	UndoCommand cmd;
 	cmd.c = c;
 	cmd.ID = ID;
-	cmd.pos = {E->cx, E->cy};
+	cmd.pos = {E->coloff+E->cx, E->rowoff+E->cy};
 	bus->push_back(cmd);
 }
 void PushCommandBus(editorConfig *E, UndoCommandBus bus) {
-	E->m_command_queue.insert(E->m_command_queue.begin() + E->m_command_index, bus);
-	E->m_command_index++;
 	DeleteRedoQueue(E);
+	E->m_command_queue.push_back(std::move(bus));
+	E->m_command_index++;
 }
 
 
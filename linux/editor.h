@@ -22,9 +22,23 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 // C++
 #include <vector>
+#include <string>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
 
 /* Syntax highlight types */
 #define HL_NORMAL 0
@@ -42,7 +56,7 @@
 
 // @TODO: rename to Int2 goddamnit
 struct Uint2 {
-	int x = 0, y = 0;
+	long long x = 0, y = 0;
 };
 
 // Undo system
@@ -50,15 +64,60 @@ enum {
 	UNDO_CMD_INSERT,
 	UNDO_CMD_DELETE_LEFT_CHAR,
 	UNDO_CMD_DELETE_RIGHT_CHAR,
+	UNDO_CMD_REPLACE_ROW,   /* pos.y is the row in the file, not on screen. */
+};
+
+struct UndoRowText {
+	std::string before, after;
 };
 
 struct UndoCommand {
 	char ID = 0;
-	Uint2 pos;
+	Uint2 pos;      /* Cursor after the command: byte x of the file row y. */
 	char c;
+	std::shared_ptr<const UndoRowText> text; /* UNDO_CMD_REPLACE_ROW only. */
 };
 typedef std::vector<UndoCommand> UndoCommandBus;
 
+/* Undo journal persisted next to the edited file (see editor_undofile.cpp).
+ * The file is memory mapped on open and its buses are decoded only when undo
+ * or redo actually reaches them, so a long history costs nothing at startup.
+ * On disk: header, (nbuses+1) uint64 offsets into the command array, (ntexts+1)
+ * uint64 offsets into the text blob, the fixed size commands, then the blob.
+ * Positions are in the file, not on screen. An UNDO_CMD_REPLACE_ROW command
+ * stores in 'x' the index of its text before, the text after is the next
+ * one. */
+#define UNDO_JOURNAL_MAGIC "TXUNDO4"
+#define EDITOR_HASH_INIT 14695981039346656037ULL /* FNV-1a offset basis. */
+
+struct UndoJournalHeader {
+	char magic[8];
+	uint64_t content_hash;  /* Hash of the file content the history ends at. */
+	uint64_t nbuses;
+	uint64_t index;         /* m_command_index at the time of saving. */
+	uint64_t ncmds;
+	uint64_t ntexts;
+	uint64_t textbytes;
+};
+
+struct UndoDiskCommand {
+	int64_t x, y;
+	uint8_t ID;
+	uint8_t c;
+	uint8_t pad[6];
+};
+
+struct UndoJournal {
+	void *map = NULL;
+	size_t maplen = 0;
+	uint64_t nbuses = 0;        /* Buses of the mapping still part of history. */
+	const uint64_t *offsets = NULL;
+	const UndoDiskCommand *cmds = NULL;
+	uint64_t ntexts = 0;
+	const uint64_t *textoffs = NULL;
+	const char *texts = NULL;
+};
+
 struct editorSyntax {
     char **filematch;
     char **keywords;
@@ -68,34 +127,315 @@ struct editorSyntax {
     int flags;
 };
 
+/* Syntax highlighter state between two chars of a row. */
+struct editorHlState {
+    unsigned char in_string;    /* Quote of the open string, or 0. */
+    unsigned char in_comment;   /* Inside a multi line comment. */
+    unsigned char in_lcomment;  /* Inside a single line comment. */
+    unsigned char prev_sep;     /* Last char was a separator. */
+    unsigned char number;       /* Last char was part of a number. */
+};
+
+/* Long rows are never rendered or highlighted whole: only a window of them
+ * around the columns on screen is (editor_longline.cpp). Checkpoints every
+ * ROW_COLIDX_STEP bytes of the row give the render column and highlighter
+ * state there, so that any column is found with a binary search and any
+ * window highlighted from the checkpoint before it. */
+#define ROW_LONG_LINE (64<<10)      /* Rows this long are windowed. */
+#define ROW_COLIDX_STEP 4096        /* Bytes between checkpoints. */
+#define ROW_WINDOW_MARGIN 4096      /* Columns rendered each side of the screen. */
+#define ROW_HL_LOOKAHEAD 64         /* Bytes a token may span past a checkpoint. */
+
+struct longLineState {
+    editorHlState st;
+    unsigned char over;         /* Render columns past the checkpoint the state
+                                   is at, when a token crossed it. */
+};
+
+struct editorLongLine {
+    std::vector<long long> col;         /* Render column of every checkpoint. */
+    std::vector<longLineState> st;      /* Highlighter state of the first
+                                           'stvalid' checkpoints. */
+    size_t stvalid = 0;
+    long long from = 0;         /* First byte changed since the last update. */
+    int wvalid = 0;             /* render and hl hold a valid window. */
+};
+
+/* Column map of short rows: the TABs and UTF-8 chars of the row, each with
+ * where it ends in render and on screen. Any other byte is one byte of render
+ * and one column, so byte offsets, render offsets and screen columns map to
+ * each other with a binary search. Rows of ASCII without TABs need none, and
+ * long rows have their checkpoints instead. */
+struct rowCol {
+    int at;             /* Byte offset of the TAB or char. */
+    int len;            /* Its size in bytes. */
+    int rx;             /* Render offset after it. */
+    int col;            /* Screen column after it. */
+};
+
 /* This structure represents a single line of the file we are editing. */
 struct erow {
-    int idx;            /* Row index in the file, zero-based. */
-    int size;           /* Size of the row, excluding the null term. */
-    int rsize;          /* Size of the rendered row. */
+    long long idx;      /* Row index in the file, zero-based. */
+    long long size;     /* Size of the row, excluding the null term. */
+    long long rsize;    /* Size of the rendered row. */
     char *chars;        /* Row content. */
     char *render;       /* Row content "rendered" for screen (for TABs). */
     unsigned char *hl;  /* Syntax highlight type for each character in render.*/
+    long long roff;     /* Render column of render[0]: 0 unless windowed. */
+    long long rlen;     /* Bytes in render and hl: rsize unless windowed. */
+    editorLongLine *ll; /* Checkpoints of long rows, NULL for the others. */
+    rowCol *cmap;       /* Column map of short rows, NULL if they need none. */
+    int ncmap;
+    int ascii;          /* Render offsets are screen columns: the row is
+                           ASCII only, or long. */
+    long long *wrap;    /* Screen column every soft wrapped line but the first
+                           starts at, NULL if none or not laid out. */
+    long long wraplines; /* Screen lines the row takes in the wrap tree. */
+    int wrapcols;       /* Screen width 'wrap' was laid out for, 0 if stale. */
     int hl_oc;          /* Row had open comment at end in last syntax highlight check. */
+    unsigned int lid;   /* Line id for the trigram index, new on a change. */
+    int hl_stale;       /* 'hl' is out of date, redone before it is used. */
+    unsigned int cowgen; /* E->snapgen when 'chars' was made, see
+                            editorRowPrepareWrite(). */
+};
+
+// Find mode
+#define KILO_QUERY_LEN 256
+#define SEARCH_MAX_MATCHES (1<<24) /* Above this matches are not kept. */
+
+/* Thread pool shared by the background jobs (editor_pool.cpp). Every worker
+ * has its own queue and steals from the others when it runs dry. */
+struct editorPoolQueue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+};
+
+struct editorPool {
+    std::vector<std::thread> workers;
+    std::unique_ptr<editorPoolQueue[]> queues; /* One per worker. */
+    std::atomic<int> queued{0};     /* Tasks in all the queues. */
+    std::atomic<unsigned int> next{0}; /* Round robin for outside tasks. */
+    std::mutex mutex;               /* Only to sleep on 'cond'. */
+    std::condition_variable cond;
+    int nworkers = 0;
+};
+
+/* Search state. editorFind scans a contiguous copy of the document (rows
+ * joined by '\n') that is rebuilt only when the document version changed.
+ * Full scans run as a searchJob on the thread pool, one chunk of the view per
+ * task, and their results are appended to 'matches' in view order as soon as
+ * all the chunks before them are done. */
+#define SEARCH_CHUNK_SIZE (1<<20)
+struct searchJob;
+struct regexProg;
+struct regexMatcher;
+
+struct editorSearch {
+    char *view = NULL;          /* Rows chars joined by newlines. */
+    std::shared_ptr<char> viewref; /* Owns 'view', shared with running jobs. */
+    size_t len = 0;             /* View length, excluding the null term. */
+    std::vector<size_t> rowstart; /* Offset of every row in the view. */
+    unsigned long long version = ~0ULL; /* E->version the view was built at. */
+    int icase = 0;              /* Case insensitive search. */
+    int regex = 0;              /* Query is a regular expression. */
+
+    /* Compiled query in regex mode, and the matcher the main thread uses. */
+    std::shared_ptr<regexProg> re;
+    regexMatcher *rm = NULL;
+    char repattern[KILO_QUERY_LEN+1] = {0};
+    int reicase = 0;
+    const char *reerr = NULL;   /* Why the query does not compile, or NULL. */
+
+    /* Every occurrence of 'query' in the view, sorted. When the query grows
+     * the new matches are a subset of these, so only they are re-verified. */
+    std::vector<size_t> matches;
+    std::vector<size_t> matchlen; /* Length of each match, regex mode only. */
+    char query[KILO_QUERY_LEN+1] = {0};
+    int qlen = -1;              /* -1 when 'matches' is not valid. */
+    int qicase = 0;
+    int qregex = 0;
+    unsigned long long qversion = ~0ULL;
+
+    std::shared_ptr<searchJob> job; /* Scan in progress, or NULL. */
+    size_t covered = 0;         /* View bytes whose matches are in 'matches'. */
+    int overflow = 0;           /* Last scan found more than we keep. */
+};
+
+/* Trigram index of big files (editor_trigram.cpp). For every trigram of the
+ * document, lower cased, the blocks of lines containing it. Lines are named
+ * by line ids that survive insertions and deletions of other lines: the
+ * lines of the file as loaded are ids 0..base-1 and grouped by file offset,
+ * TRIGRAM_BLOCK bytes per block; a changed row gets a fresh id, indexed at
+ * the next search, and fresh ids are grouped TRIGRAM_EDIT_BLOCK per block
+ * after the file blocks. */
+#define TRIGRAM_MIN_FILE_SIZE (64<<20) /* Smaller files are just scanned. */
+#define TRIGRAM_BLOCK (1<<18)
+#define TRIGRAM_EDIT_BLOCK 64
+#define TRIGRAM_CACHE_MAGIC "TXTRIG1"
+
+struct trigramPosting {
+    uint32_t last = 0;          /* Last block appended. */
+    std::vector<uint8_t> data;  /* Block numbers, delta encoded varints. */
+};
+typedef std::unordered_map<uint32_t,trigramPosting> trigramMap;
+struct trigramBuild;
+
+struct editorTrigram {
+    trigramMap postings;
+    std::vector<uint32_t> blockline; /* First line id of every file block, plus the end. */
+    uint32_t base = 0;          /* Line ids of the file as loaded are below this. */
+    uint32_t nextlid = 0;       /* Next fresh line id. */
+    uint32_t indexed = 0;       /* Fresh ids from this one are not indexed. */
+    int ready = 0;              /* Index built and usable. */
+    std::shared_ptr<trigramBuild> build; /* Build in progress, or NULL. */
+    std::vector<long long> lidrow; /* Row of every line id, -1 if gone. */
+    unsigned long long lidversion = ~0ULL; /* E->version lidrow was built at. */
+};
+
+/* Crash recovery (editor_swap.cpp): the changes to the rows are logged to a
+ * swap file along the edited one, committed in batches by a writer thread. */
+#define SWAP_MAGIC "TXSWAP3"
+#define SWAP_WHOLE UINT64_MAX       /* Ops apply to the whole file. */
+#define SWAP_COMMIT_MS 200          /* A batch waits this much at most. */
+#define SWAP_BATCH_MAX (1<<20)      /* Bigger batches are committed at once. */
+
+enum {
+    SWAP_OP_SET,            /* Row content replaced. */
+    SWAP_OP_INSERT,         /* Row inserted. */
+    SWAP_OP_DELETE,         /* Row deleted. */
+    SWAP_OP_TRUNCATE,       /* Rows deleted from this one to the end. */
+    SWAP_OP_SPLICE          /* Bytes of a long row replaced: uint64 col,
+                               uint64 bytes deleted, the bytes inserted. */
+};
+struct swapWriter;
+
+/* Project wide grep (editor_grep.cpp). Files are searched in parallel, the
+ * hits stream into the results list that editorGrep() shows. */
+#define GREP_MAX_FILE_SIZE (32<<20) /* Bigger files are skipped. */
+#define GREP_BINARY_PROBE 8192      /* A NUL in this many bytes: binary. */
+#define GREP_MAX_HITS 100000
+
+struct grepHit {
+    std::string path;
+    int line, col;          /* Zero based. */
+    std::string text;       /* The line, truncated. */
+};
+struct grepJob;
+
+/* What we know of the file as last saved or loaded, for incremental saves:
+ * every SAVE_CHECKPOINT_ROWS rows, the offset of the row in the file and the
+ * hash of the content before it. Rows below 'lowrow' did not change since,
+ * so a save may rewrite the file in place from the checkpoint before
+ * 'lowrow', as long as the file on disk is still the one we know. */
+#define SAVE_CHECKPOINT_ROWS 4096
+#define SAVE_INPLACE_MIN (1<<20)   /* Smaller files are always saved whole. */
+
+struct saveCheckpoint {
+    uint64_t off;           /* Offset of the row in the file. */
+    uint64_t hash;          /* Hash of the content before it. */
+};
+
+struct editorSaveState {
+    std::vector<saveCheckpoint> ckpt; /* Empty if unknown. */
+    long long lowrow = LLONG_MAX; /* First row changed since, LLONG_MAX
+                                     if none. */
+    dev_t dev;              /* Identity of the file when last seen by us. */
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+/* Saving writes a hidden temp file next to the original, then fsync(2)s it
+ * and renames it over the original. All of it runs on a thread of its own,
+ * from a snapshot of the rows, so the buffer can be edited meanwhile.
+ *
+ * The snapshot shares the 'chars' of the rows: taking it bumps E->snapgen,
+ * and a row whose 'cowgen' is older is copied before it is first changed,
+ * its old content going to 'orphans' until the save is over. */
+struct editorSaveJob {
+    std::thread thread;
+    std::atomic<int> done{0};
+    std::vector<struct iovec> rows; /* The snapshot: content of the rows
+                                       from 'firstrow' on. */
+    size_t firstrow = 0;    /* Row written first, at checkpoint 'start'. */
+    saveCheckpoint start = {0,EDITOR_HASH_INIT};
+    int inplace = 0;        /* Rewrite 'path' from 'start', no temp file. */
+    long long lowrow;       /* E->saved.lowrow before the save. */
+    std::vector<saveCheckpoint> ckpt; /* Checkpoints of the file written. */
+    struct stat st;         /* The file written. */
+    std::vector<char*> orphans; /* Row contents only the snapshot uses. */
+    unsigned long long version; /* E->version of the snapshot. */
+    int err = 0;            /* errno of the step that failed, or 0. */
+    const char *failed = NULL; /* Name of that step. */
+    std::string tmppath;    /* Where the rows are written. */
+    std::string path;       /* File replaced, symlinks resolved. */
+    size_t len = 0;         /* Length of the file. */
+    size_t written = 0;     /* Bytes actually written. */
+    std::shared_ptr<swapWriter> swap; /* Swap to update before a save in
+                                         place writes, or NULL. */
+    uint64_t hash;          /* Of the content of the file. */
 };
 
 struct hlcolor {
     int r,g,b;
 };
 
+/* Soft wrap state (editor_wrap.cpp). */
+struct editorWrap {
+    int on = 0;
+    int cols = 0;               /* Screen width the tree counts lines for. */
+    int valid = 0;              /* tree matches the rows. */
+    std::vector<long long> tree; /* Fenwick tree of the lines of every row. */
+    long long lineoff = 0;      /* Line of the row rowoff at the screen top. */
+    long long linerow = 0;      /* rowoff lineoff was set for. */
+};
+
+/* Model of the terminal the editor draws on (editor_vt.cpp). */
+#define VT_BOLD 1
+#define VT_UNDERLINE 2
+#define VT_INVERSE 4
+
+struct vtCell {
+    uint32_t ch;        /* Code point, 0 for the right half of a wide char. */
+    short fg, bg;       /* 256 color palette index, -1 for the default. */
+    unsigned char attr; /* VT_BOLD | VT_UNDERLINE | VT_INVERSE */
+};
+
+struct vtScreen {
+    int rows, cols;
+    std::vector<vtCell> cells;  /* rows*cols, by row. */
+    int x, y;                   /* Cursor, zero based. */
+    int wrapnext;               /* Past the last column: wrap on next char. */
+    int top, bottom;            /* Scroll region, rows included. */
+    int autowrap, cursor;       /* Modes ?7 and ?25. */
+    vtCell pen;                 /* Colors and attributes of new chars. */
+    int savedx, savedy;         /* ESC 7 */
+    vtCell savedpen;
+    int state;                  /* Of the parser. */
+    std::string seq;            /* Escape sequence read so far. */
+    char utf8[4];               /* UTF-8 char read so far. */
+    int ulen;
+    /* Totals since vtInit(), for the caller to take differences of. */
+    uint64_t bytes;             /* Fed. */
+    uint64_t sequences;         /* Escape sequences. */
+    uint64_t unknown;           /* Sequences and controls ignored. */
+    uint64_t printed;           /* Chars put on the grid. */
+};
+
 enum {
 	EDITOR_MODE_NORMAL,
 	EDITOR_MODE_INSERT
 };
 
 struct editorConfig {
-    int cx,cy;      /* Cursor x and y position in characters */
-    int rowoff;     /* Offset of row displayed. */
-    int coloff;     /* Offset of column displayed. */
+    long long cx,cy; /* Cursor x and y position in characters */
+    long long rowoff; /* Offset of row displayed. */
+    long long coloff; /* Offset of column displayed. */
     int screenrows; /* Number of rows that we can show */
     int screencols; /* Number of cols that we can show */
-    int numrows;    /* Number of rows */
+    long long numrows; /* Number of rows */
     int rawmode;    /* Is terminal raw mode enabled? */
+    int headless = 0; /* No terminal: see editor_batch.cpp. */
     erow *row;      /* Rows */
     int dirty;      /* File modified but not saved. */
     char *filename; /* Currently open filename */
@@ -103,11 +443,24 @@ struct editorConfig {
     time_t statusmsg_time;
     struct editorSyntax *syntax;    /* Current syntax highlight, or NULL. */
 
-	// Undo system
+	// Undo system. History is m_journal's buses followed by m_command_queue,
+	// m_command_index indexes the whole of it.
+	UndoJournal m_journal;
 	std::vector<UndoCommandBus> m_command_queue;
-	unsigned int m_command_index = 0;
+	uint64_t m_command_index = 0;
+	uint64_t file_hash = 0; /* Hash of the file content as last opened/saved. */
 
 	int mode;
+
+	unsigned long long version = 0; /* Bumped on every document change. */
+	editorSearch search;
+	editorTrigram trigram;
+	std::shared_ptr<grepJob> grep; /* Last grep, to get back to its results. */
+	std::unique_ptr<editorSaveJob> save; /* Save in progress, or NULL. */
+	std::shared_ptr<swapWriter> swap; /* Logs changes for crash recovery. */
+	unsigned int snapgen = 0; /* Bumped by every save snapshot. */
+	editorSaveState saved;  /* The file as last saved or loaded. */
+	editorWrap wrap;
 };
 
 
@@ -121,6 +474,7 @@ enum KEY_ACTION {
         CTRL_L = 12,        /* Ctrl+l */
         ENTER = 13,         /* Enter */
         CTRL_Q = 17,        /* Ctrl-q */
+        CTRL_R = 18,        /* Ctrl-r */
         CTRL_S = 19,        /* Ctrl-s */
         CTRL_U = 21,        /* Ctrl-u */
         ESC = 27,           /* Escape */
@@ -165,17 +519,24 @@ struct abuf {
 void abAppend(struct abuf *ab, const char *s, int len);
 void abFree(struct abuf *ab);
 
-// Find mode
-#define KILO_QUERY_LEN 256
 #define FIND_RESTORE_HL do { \
     if (saved_hl) { \
-        memcpy(E->row[saved_hl_line].hl, saved_hl, E->row[saved_hl_line].rsize); \
+        if (E->row[saved_hl_line].ll) \
+            E->row[saved_hl_line].ll->wvalid = 0; \
+        else \
+            memcpy(E->row[saved_hl_line].hl, saved_hl, E->row[saved_hl_line].rlen); \
         free(saved_hl); \
         saved_hl = NULL; \
     } \
 } while (0)
 #define EDITOR_QUIT_TIMES 1
 
+/* Phases of a frame timed by editor_stats.cpp. */
+enum {
+    STATS_READ, STATS_KEY, STATS_HL, STATS_BUILD, STATS_WRITE, STATS_FRAME,
+    STATS_PHASES
+};
+
 int is_separator(int c);
 void disableRawMode(editorConfig *E, int fd);
 void editorAtExit(editorConfig *E);
@@ -185,24 +546,132 @@ int getCursorPosition(int ifd, int ofd, int *rows, int *cols);
 int getWindowSize(int ifd, int ofd, int *rows, int *cols);
 int editorRowHasOpenComment(erow *row);
 void editorUpdateSyntax(editorConfig *E, erow *row);
+long long editorHighlight(editorConfig *E, const char *p, long long end,
+                          long long stop, unsigned char *hl, editorHlState *st);
+void editorHlStart(editorConfig *E, erow *row, editorHlState *st);
 int editorSyntaxToColor(int hl);
 void editorSelectSyntaxHighlight(editorConfig *E, char *filename);
+void editorUpdateRender(editorConfig *E, erow *row);
 void editorUpdateRow(editorConfig *E, erow *row);
-void editorInsertRow(editorConfig *E, int at, char *s, size_t len);
+void editorRowFreshSyntax(editorConfig *E, erow *row);
+void editorRowPrepareWrite(editorConfig *E, erow *row);
+void editorRowSetChars(editorConfig *E, erow *row, const char *s, size_t len);
+void editorInsertRow(editorConfig *E, long long at, char *s, size_t len);
 void editorFreeRow(erow *row);
-void editorDelRow(editorConfig *E, int at);
-char *editorRowsToString(editorConfig *E, int *buflen);
-void editorRowInsertChar(editorConfig *E, erow *row, int at, int c);
+void editorDelRow(editorConfig *E, long long at);
+char *editorRowsToString(editorConfig *E, size_t *buflen);
+void editorRowInsertChar(editorConfig *E, erow *row, long long at, int c);
 void editorRowAppendString(editorConfig *E, erow *row, char *s, size_t len);
-void editorRowDelChar(editorConfig *E, erow *row, int at);
+void editorRowSplice(editorConfig *E, erow *row, long long at, long long del, const char *s, size_t len);
+void editorRowDelChar(editorConfig *E, erow *row, long long at);
 void editorInsertChar(editorConfig *E, int c);
 void editorInsertNewline(editorConfig *E);
 char editorDelChar(editorConfig *E);
+void editorDelCharBefore(editorConfig *E, UndoCommandBus *bus);
 int editorOpen(editorConfig *E, char *filename);
+void editorCloseFile(editorConfig *E);
 int editorSave(editorConfig *E);
+int editorSaveReap(editorConfig *E, int wait);
 void editorRefreshScreen(editorConfig *E);
+void editorDrawScreen(editorConfig *E, struct abuf *ab);
 void editorSetStatusMessage(editorConfig *E, const char *fmt, ...);
 void editorFind(editorConfig *E, int fd);
+char *editorPrompt(editorConfig *E, int fd, const char *prompt);
+void editorCommand(editorConfig *E, int fd);
+int editorIsSubstitute(const char *cmd);
+long long editorSubstitute(editorConfig *E, const char *cmd);
+void editorGrep(editorConfig *E, int fd, const char *args);
+int batchMain(int argc, char **argv);
+void swapStart(editorConfig *E);
+void swapClose(editorConfig *E);
+void swapLog(editorConfig *E, int op, long long at);
+void swapLogSplice(editorConfig *E, long long at, long long col, long long del, const char *s, size_t len);
+void swapSaveStart(editorConfig *E);
+void swapSaveEnd(editorConfig *E, int ok, uint64_t hash);
+void swapSaveTail(swapWriter *w, editorSaveJob *job);
+long long editorReplaceAll(editorConfig *E, const char *pattern, const char *rep, int regex, int icase);
+long long editorRowCxToRx(erow *row, long long cx);
+long long editorRowRxToCx(erow *row, long long rx);
+long long editorRowCxToRender(erow *row, long long cx);
+long long editorRowRxToRender(erow *row, long long rx);
+long long editorRowRenderToRx(erow *row, long long roff);
+long long editorRowWidth(erow *row);
+long long editorRowNextChar(erow *row, long long at);
+long long editorRowPrevChar(erow *row, long long at);
+void editorMoveCursorChar(editorConfig *E, int key);
+long long editorScreenLeft(editorConfig *E);
+void editorDrawRow(editorConfig *E, struct abuf *ab, erow *r, long long from, long long len, int y);
+void longLineUpdate(erow *row);
+void longLineUpdateSyntax(editorConfig *E, erow *row);
+void longLineWindow(editorConfig *E, erow *row, long long from, long long to);
+long long longLineCol(erow *row, long long at);
+long long longLineByte(erow *row, long long rx);
+void longLineChanged(erow *row, long long at);
+void longLineFree(erow *row);
+void wrapScroll(editorConfig *E);
+void wrapMoveCursor(editorConfig *E, int key);
+void wrapPage(editorConfig *E, int key);
+void wrapDrawRows(editorConfig *E, struct abuf *ab);
+void wrapCursorPos(editorConfig *E, int *y, int *x);
+void wrapRowChanged(editorConfig *E, erow *row);
+void wrapToggle(editorConfig *E);
+int utf8Decode(const char *s, size_t len, uint32_t *cp);
+int utf8Width(uint32_t cp);
+uint64_t statsNow(void);
+void statsKeyRead(uint64_t first);
+void statsHighlighted(uint64_t start);
+void statsFrame(uint64_t start, uint64_t write, size_t bytes);
+void statsToggleOverlay(editorConfig *E);
+int statsOverlay(char *buf, size_t len);
+void statsDumpTo(const char *filename);
+int statsDump(void);
+void traceStart(const char *filename);
+void traceEnd(const char *name, uint64_t start);
+int traceDump(void);
+void vtInit(vtScreen *vt, int rows, int cols);
+void vtFeed(vtScreen *vt, const char *s, size_t len);
+vtCell *vtAt(vtScreen *vt, int y, int x);
+std::string vtRowText(vtScreen *vt, int y);
+int memWrite(editorConfig *E, FILE *fp);
+void memCommand(editorConfig *E, const char *arg);
+
+/* A span of the trace, from where it is declared to the end of the scope,
+ * recorded only with tracing on: see editor_trace.cpp. */
+extern int traceOn;
+struct traceSpan {
+    const char *name;
+    uint64_t start = 0;
+    traceSpan(const char *n) : name(n) {
+        if (__builtin_expect(traceOn,0)) start = statsNow();
+    }
+    ~traceSpan() {
+        if (__builtin_expect(start != 0,0)) traceEnd(name,start);
+    }
+};
+#define TRACE_SPAN(name) traceSpan trace_span(name)
+const char *searchMemmem(const char *hay, size_t n, const char *needle, size_t m, int icase);
+const char *searchMemmemLast(const char *hay, size_t n, const char *needle, size_t m, int icase);
+void searchViewUpdate(editorConfig *E);
+long long searchViewRow(editorConfig *E, size_t off);
+int searchUpdateMatches(editorConfig *E, const char *query, int qlen);
+int searchCollect(editorConfig *E, size_t *count);
+void searchCancel(editorConfig *E);
+size_t searchMatchLen(editorConfig *E, size_t idx);
+int searchDirect(editorConfig *E, const char *query, int qlen, long long from, int dir, size_t *ms, size_t *mlen);
+regexProg *regexCompile(const char *pattern, int icase, const char **err);
+void regexFree(regexProg *prog);
+regexMatcher *regexMatcherNew(const regexProg *prog);
+void regexMatcherFree(regexMatcher *m);
+int regexFind(regexMatcher *m, const char *text, size_t len, size_t from, size_t *ms, size_t *me);
+void regexFindAll(regexMatcher *m, const char *text, size_t len, size_t base, std::vector<size_t> *starts, std::vector<size_t> *lens);
+const char *regexPrefix(const regexProg *prog, size_t *len);
+void trigramStart(editorConfig *E, struct stat *st);
+void trigramClose(editorConfig *E);
+void trigramUpdateRow(editorConfig *E, erow *row);
+int trigramSearch(editorConfig *E, const char *query, int qlen);
+editorPool *poolGet(void);
+void poolSubmit(editorPool *pool, std::function<void()> task);
+int editorWaitInput(int fd, int timeout_ms);
 void editorMoveCursor(editorConfig *E, int key);
 void editorProcessKeypress(editorConfig *E, int fd);
 int editorFileWasModified(editorConfig *E);
@@ -216,3 +685,10 @@ void editorPaste();
 void DeleteRedoQueue(editorConfig *E);
 void PushCommand(editorConfig *E, UndoCommandBus* bus, char ID, char c);
 void PushCommandBus(editorConfig *E, UndoCommandBus bus);
+uint64_t editorHashBytes(uint64_t h, const void *p, size_t len);
+void editorSidecarPath(const char *filename, const char *ext, char *buf, size_t buflen);
+size_t editorUndoHistorySize(editorConfig *E);
+void editorUndoGetBus(editorConfig *E, size_t i, UndoCommandBus *bus);
+void editorUndoJournalLoad(editorConfig *E);
+int editorUndoJournalWrite(editorConfig *E);
+void editorUndoJournalClose(editorConfig *E);
@@ -0,0 +1,353 @@
+#include "editor.h"
+
+#include <algorithm>
+
+/* ================================ Batch mode ================================
+ *
+ * texed --batch SCRIPT FILE... applies the commands of SCRIPT ('-' reads it
+ * from stdin) to every FILE in turn, without a terminal and drawing nothing.
+ * One command per line, lines starting with '#' are comments:
+ *
+ *   goto ROW [COL]          Go to the line ROW ('$' is the last one), at the
+ *                           byte COL of it. Both count from 1.
+ *   up|down|left|right [N]  Move as the arrow keys do, N times.
+ *   home|end                Go to the start or the end of the line.
+ *   insert TEXT             Insert TEXT, leaving the cursor after it. \n
+ *                           breaks the line, \t is a TAB, \\ a backslash.
+ *   delete [N]              Delete N chars at the cursor, as DEL.
+ *   backspace [N]           Delete N chars before the cursor.
+ *   deleteline [N]          Delete N lines from the cursor on.
+ *   find TEXT               Go to the next occurrence of the literal TEXT,
+ *                           wrapping around at the end. Escapes as insert.
+ *   s/pattern/rep/[flags]   Replace everywhere, as the :s command.
+ *   save                    Write the file, waiting for it to be on disk.
+ *   print                   Write the content to stdout.
+ *   screen                  Draw the screen as the editor would, 24 rows of
+ *                           80 columns plus the two status rows, and write
+ *                           what a terminal shows, after a line with the
+ *                           bytes and escape sequences it took (see
+ *                           editor_vt.cpp).
+ *   mem                     Write where the memory goes, as ":mem file".
+ *
+ * The script is parsed whole before any file is opened. A command that fails
+ * (find without a match, a bad pattern, a save that can't be written) stops
+ * the script for that file, left as it was last saved, and the exit status
+ * is 1; the other files still run.
+ *
+ * There is no swap file, undo journal or trigram index, so nothing runs in
+ * the background: the same script on the same files does the same work
+ * every time, which makes it the driver of the editing core in benchmarks. */
+
+enum {
+    BATCH_GOTO, BATCH_UP, BATCH_DOWN, BATCH_LEFT, BATCH_RIGHT, BATCH_HOME,
+    BATCH_END, BATCH_INSERT, BATCH_DELETE, BATCH_BACKSPACE, BATCH_DELETELINE,
+    BATCH_FIND, BATCH_SUBSTITUTE, BATCH_SAVE, BATCH_PRINT, BATCH_SCREEN,
+    BATCH_MEM
+};
+
+/* Screen size the cursor logic works with. */
+#define BATCH_SCREEN_ROWS 24
+#define BATCH_SCREEN_COLS 80
+
+struct batchCmd {
+    int op;
+    long long n;        /* Count, or the row for goto (-1 is the last). */
+    long long col;      /* Column for goto. */
+    std::string text;   /* Of insert and find, unescaped, or the :s line. */
+    int line;           /* Line of the script, for errors. */
+};
+
+static const struct {
+    const char *name;
+    int op;
+    int args;           /* 0 none, 1 optional count, 2 text. */
+} batchOps[] = {
+    {"goto",BATCH_GOTO,0}, {"up",BATCH_UP,1}, {"down",BATCH_DOWN,1},
+    {"left",BATCH_LEFT,1}, {"right",BATCH_RIGHT,1}, {"home",BATCH_HOME,0},
+    {"end",BATCH_END,0}, {"insert",BATCH_INSERT,2}, {"delete",BATCH_DELETE,1},
+    {"backspace",BATCH_BACKSPACE,1}, {"deleteline",BATCH_DELETELINE,1},
+    {"find",BATCH_FIND,2}, {"save",BATCH_SAVE,0}, {"print",BATCH_PRINT,0},
+    {"screen",BATCH_SCREEN,0}, {"mem",BATCH_MEM,0},
+};
+
+/* Resolve \n, \t and \\ in the text argument 's'. */
+static std::string batchUnescape(const char *s) {
+    std::string out;
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+            out += *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+        } else {
+            out += *s;
+        }
+    }
+    return out;
+}
+
+/* Parse a count of at least 1 at 's'. Returns 0 if it is not one. */
+static int batchCount(const char *s, long long *n) {
+    char *end;
+    if (*s == '\0') {
+        *n = 1;
+        return 1;
+    }
+    errno = 0;
+    *n = strtoll(s,&end,10);
+    return errno == 0 && *end == '\0' && *n > 0;
+}
+
+/* Parse the script line 'line', that has no trailing newline. Returns 0 and
+ * prints why if it is not valid. */
+static int batchParse(const char *path, int lineno, const char *line, batchCmd *cmd) {
+    const char *sp = strchr(line,' ');
+    size_t namelen = sp ? (size_t)(sp-line) : strlen(line);
+    const char *args = sp ? sp+1 : "";
+
+    cmd->line = lineno;
+    cmd->n = 1;
+    cmd->col = 1;
+    if (editorIsSubstitute(line)) {
+        cmd->op = BATCH_SUBSTITUTE;
+        cmd->text = line;
+        return 1;
+    }
+    for (auto &o : batchOps) {
+        if (strlen(o.name) != namelen || strncmp(line,o.name,namelen)) continue;
+        cmd->op = o.op;
+        if (o.op == BATCH_GOTO) {
+            char row[32];
+            int fields = sscanf(args,"%31s %lld",row,&cmd->col);
+            if (fields < 1 || cmd->col < 1 ||
+                (strcmp(row,"$") && !batchCount(row,&cmd->n))) break;
+            if (!strcmp(row,"$")) cmd->n = -1;
+            return 1;
+        }
+        if (o.args == 0 && *args == '\0') return 1;
+        if (o.args == 1 && batchCount(args,&cmd->n)) return 1;
+        if (o.args == 2 && *args) {
+            cmd->text = batchUnescape(args);
+            return 1;
+        }
+        break;
+    }
+    fprintf(stderr,"%s:%d: invalid command: %s\n",path,lineno,line);
+    return 0;
+}
+
+/* Read and parse the script at 'path'. Returns 0 if it has errors. */
+static int batchLoad(const char *path, std::vector<batchCmd> *cmds) {
+    FILE *fp = strcmp(path,"-") ? fopen(path,"r") : stdin;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    int lineno = 0, ok = 1;
+
+    if (fp == NULL) {
+        fprintf(stderr,"%s: %s\n",path,strerror(errno));
+        return 0;
+    }
+    while ((linelen = getline(&line,&linecap,fp)) != -1) {
+        lineno++;
+        while (linelen && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
+            line[--linelen] = '\0';
+        if (linelen == 0 || line[0] == '#') continue;
+        batchCmd cmd;
+        if (batchParse(path,lineno,line,&cmd)) cmds->push_back(cmd);
+        else ok = 0;
+    }
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return ok;
+}
+
+/* Put the cursor on the row 'filerow' at the byte 'filecol', keeping the
+ * invariants of cx and coloff the rest of the editor relies on. */
+static void batchSetCursor(editorConfig *E, long long filerow, long long filecol) {
+    E->rowoff = filerow;
+    E->cy = 0;
+    if (filecol > E->screencols-1) {
+        E->coloff = filecol-E->screencols+1;
+        E->cx = E->screencols-1;
+    } else {
+        E->coloff = 0;
+        E->cx = filecol;
+    }
+}
+
+/* Insert 'text' at the cursor, a line at a time. */
+static void batchInsert(editorConfig *E, const std::string &text) {
+    size_t pos = 0;
+
+    while (pos <= text.size()) {
+        size_t nl = text.find('\n',pos);
+        size_t end = nl == std::string::npos ? text.size() : nl;
+        long long filerow = E->rowoff+E->cy;
+
+        if (end > pos) {
+            while (E->numrows <= filerow) editorInsertRow(E,E->numrows,(char*)"",0);
+            erow *row = &E->row[filerow];
+            long long filecol = std::min(E->coloff+E->cx,row->size);
+            std::string s(row->chars,filecol);
+            s.append(text,pos,end-pos);
+            s.append(row->chars+filecol,row->size-filecol);
+            editorRowSetChars(E,row,s.data(),s.size());
+            batchSetCursor(E,filerow,filecol+(end-pos));
+        }
+        if (nl == std::string::npos) break;
+        editorInsertNewline(E);
+        pos = nl+1;
+    }
+}
+
+/* Go to the next occurrence of 'text' after the cursor. Returns 0 if there
+ * is none. */
+static int batchFind(editorConfig *E, const std::string &text) {
+    long long filerow = E->rowoff+E->cy;
+    long long from = E->coloff+E->cx+1;
+
+    if (E->numrows == 0) return 0;
+    if (filerow >= E->numrows) {
+        filerow = 0;
+        from = 0;
+    }
+    /* The cursor row is looked at twice: after the cursor, and at the end
+     * of the wrap around before it. */
+    for (long long k = 0; k <= E->numrows; k++) {
+        long long j = (filerow+k) % E->numrows;
+        erow *row = &E->row[j];
+        long long start = k == 0 ? std::min(from,row->size) : 0;
+        const char *p = searchMemmem(row->chars+start,row->size-start,
+                                     text.data(),text.size(),0);
+        if (p) {
+            batchSetCursor(E,j,p-row->chars);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Run 'cmd' on the open file. Returns 0 if it failed, with the reason in
+ * the status message. */
+static int batchExec(editorConfig *E, vtScreen *vt, const batchCmd &cmd) {
+    long long filerow = E->rowoff+E->cy;
+    erow *row = filerow < E->numrows ? &E->row[filerow] : NULL;
+
+    switch (cmd.op) {
+    case BATCH_GOTO: {
+        long long r = cmd.n == -1 ? E->numrows-1 : cmd.n-1;
+        r = std::max(0LL,std::min(r,E->numrows));
+        long long size = r < E->numrows ? E->row[r].size : 0;
+        batchSetCursor(E,r,std::min(cmd.col-1,size));
+        break;
+    }
+    case BATCH_UP:
+    case BATCH_DOWN:
+        for (long long j = 0; j < cmd.n; j++)
+            editorMoveCursor(E,cmd.op == BATCH_UP ? ARROW_UP : ARROW_DOWN);
+        break;
+    case BATCH_LEFT:
+    case BATCH_RIGHT:
+        for (long long j = 0; j < cmd.n; j++)
+            editorMoveCursorChar(E,cmd.op == BATCH_LEFT ? ARROW_LEFT : ARROW_RIGHT);
+        break;
+    case BATCH_HOME:
+    case BATCH_END:
+        batchSetCursor(E,filerow,cmd.op == BATCH_END && row ? row->size : 0);
+        break;
+    case BATCH_INSERT:
+        batchInsert(E,cmd.text);
+        break;
+    case BATCH_DELETE:
+        for (long long j = 0; j < cmd.n; j++) {
+            filerow = E->rowoff+E->cy;
+            if (filerow >= E->numrows ||
+                (filerow == E->numrows-1 && E->coloff+E->cx >= E->row[filerow].size))
+                break;
+            editorMoveCursorChar(E,ARROW_RIGHT);
+            editorDelCharBefore(E,NULL);
+        }
+        break;
+    case BATCH_BACKSPACE:
+        for (long long j = 0; j < cmd.n; j++) editorDelCharBefore(E,NULL);
+        break;
+    case BATCH_DELETELINE: {
+        long long filecol = E->coloff+E->cx;
+        for (long long j = 0; j < cmd.n && filerow < E->numrows; j++)
+            editorDelRow(E,filerow);
+        long long size = filerow < E->numrows ? E->row[filerow].size : 0;
+        batchSetCursor(E,filerow,std::min(filecol,size));
+        break;
+    }
+    case BATCH_FIND:
+        if (!batchFind(E,cmd.text)) {
+            editorSetStatusMessage(E,"Not found: %s",cmd.text.c_str());
+            return 0;
+        }
+        break;
+    case BATCH_SUBSTITUTE:
+        if (editorSubstitute(E,cmd.text.c_str()) == -1) return 0;
+        break;
+    case BATCH_SAVE:
+        editorSave(E);
+        if (editorSaveReap(E,1) == -1) return 0;
+        break;
+    case BATCH_PRINT:
+        for (long long j = 0; j < E->numrows; j++) {
+            fwrite(E->row[j].chars,1,E->row[j].size,stdout);
+            fputc('\n',stdout);
+        }
+        fflush(stdout);
+        break;
+    case BATCH_SCREEN: {
+        /* The terminal keeps what the frames before drew, as a real one. */
+        struct abuf ab = ABUF_INIT;
+        uint64_t seqs = vt->sequences;
+        editorDrawScreen(E,&ab);
+        vtFeed(vt,ab.b,ab.len);
+        printf("screen: %d bytes, %llu escape sequences, cursor at %d,%d\n",
+               ab.len,(unsigned long long)(vt->sequences-seqs),vt->y+1,vt->x+1);
+        for (int y = 0; y < vt->rows; y++)
+            printf("|%s\n",vtRowText(vt,y).c_str());
+        fflush(stdout);
+        abFree(&ab);
+        break;
+    }
+    case BATCH_MEM:
+        memWrite(E,stdout);
+        fflush(stdout);
+        break;
+    }
+    return 1;
+}
+
+/* Entry point of 'texed --batch SCRIPT FILE...', with 'argv' starting at
+ * SCRIPT. Returns the exit status. */
+int batchMain(int argc, char **argv) {
+    std::vector<batchCmd> cmds;
+    editorConfig E;
+    int status = 0;
+
+    if (argc < 2) {
+        fprintf(stderr,"Usage: texed --batch <script> <filename>...\n");
+        return 1;
+    }
+    if (!batchLoad(argv[0],&cmds)) return 1;
+
+    E.headless = 1;
+    E.screenrows = BATCH_SCREEN_ROWS;
+    E.screencols = BATCH_SCREEN_COLS;
+    initEditor(&E);
+    for (int f = 1; f < argc; f++) {
+        vtScreen vt;
+        vtInit(&vt,E.screenrows+2,E.screencols);
+        editorOpen(&E,argv[f]);
+        for (const batchCmd &cmd : cmds) {
+            if (batchExec(&E,&vt,cmd)) continue;
+            fprintf(stderr,"%s: %s:%d: %s\n",argv[f],argv[0],cmd.line,E.statusmsg);
+            status = 1;
+            break;
+        }
+        editorCloseFile(&E);
+    }
+    return status;
+}
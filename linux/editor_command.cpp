@@ -0,0 +1,119 @@
+#include "editor.h"
+
+/* ================================ Commands ==================================
+ *
+ * Pressing ':' in normal mode reads a command in the status bar:
+ *
+ *   :s/pattern/replacement/[flags]   Replace every occurrence in the file.
+ *                                    Flags: r = regex, i = ignore case,
+ *                                    g is accepted and means nothing more.
+ *   :grep [-r] [-i] pattern [dir]    Search the files under 'dir', see
+ *                                    editor_grep.cpp.
+ *   :mem [file]                      Where the memory goes, in the message
+ *                                    row or to 'file': see editor_mem.cpp.
+ *
+ * '%s' is accepted for 's', and any punctuation can be the delimiter. A
+ * backslash escapes the delimiter; in literal patterns and replacements it
+ * escapes any character. */
+
+/* Read a line in the status bar after 'prompt'. Returns a heap allocated
+ * string, or NULL if the user pressed ESC. */
+char *editorPrompt(editorConfig *E, int fd, const char *prompt) {
+    char buf[KILO_QUERY_LEN+1] = {0};
+    int len = 0;
+
+    while(1) {
+        editorSetStatusMessage(E,"%s%s",prompt,buf);
+        editorRefreshScreen(E);
+
+        int c = editorReadKey(fd);
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
+            if (len != 0) buf[--len] = '\0';
+        } else if (c == ESC || c == ENTER) {
+            editorSetStatusMessage(E,"");
+            return c == ENTER ? strdup(buf) : NULL;
+        } else if (isprint(c) && len < KILO_QUERY_LEN) {
+            buf[len++] = c;
+            buf[len] = '\0';
+        }
+    }
+}
+
+/* Copy into 'out' the field at '*p' up to the delimiter, leaving '*p' after
+ * it. Escaped delimiters lose their backslash, other escapes are kept.
+ * Returns 0 if the field is not terminated. */
+static int commandField(const char **p, char delim, std::string *out) {
+    const char *s = *p;
+    for (; *s && *s != delim; s++) {
+        if (*s == '\\' && s[1]) {
+            if (s[1] != delim) *out += *s;
+            s++;
+        }
+        *out += *s;
+    }
+    if (*s != delim) return 0;
+    *p = s+1;
+    return 1;
+}
+
+/* Remove the escapes of a literal field. */
+static std::string commandUnescape(const std::string &s) {
+    std::string out;
+    for (size_t j = 0; j < s.size(); j++) {
+        if (s[j] == '\\' && j+1 < s.size()) j++;
+        out += s[j];
+    }
+    return out;
+}
+
+/* True if 'cmd' is a :s command, without the ':'. */
+int editorIsSubstitute(const char *cmd) {
+    if (*cmd == '%') cmd++;
+    return cmd[0] == 's' && ispunct(cmd[1]);
+}
+
+/* Run the :s command 'cmd'. Returns the number of replacements, or -1 if
+ * the command is not valid, as told in the status message. */
+long long editorSubstitute(editorConfig *E, const char *cmd) {
+    std::string pattern, rep;
+    int regex = 0, icase = 0;
+    const char *args = cmd + (*cmd == '%' ? 2 : 1);
+    char delim = *args++;
+
+    if (!commandField(&args,delim,&pattern)) {
+        editorSetStatusMessage(E,"Usage: :s/pattern/replacement/[flags]");
+        return -1;
+    }
+    /* The closing delimiter is optional, as in :s/a/b */
+    if (!commandField(&args,delim,&rep)) args += strlen(args);
+    for (; *args; args++) {
+        if (*args == 'r') regex = 1;
+        else if (*args == 'i') icase = 1;
+        else if (*args != 'g') {
+            editorSetStatusMessage(E,"Unknown flag '%c'",*args);
+            return -1;
+        }
+    }
+    if (!regex) pattern = commandUnescape(pattern);
+    return editorReplaceAll(E,pattern.c_str(),commandUnescape(rep).c_str(),regex,icase);
+}
+
+/* Read a command after ':' and run it. */
+void editorCommand(editorConfig *E, int fd) {
+    char *cmd = editorPrompt(E,fd,":");
+    const char *p = cmd;
+
+    if (cmd == NULL) return;
+    if (!strncmp(p,"grep",4) && (p[4] == ' ' || p[4] == '\0')) {
+        editorGrep(E,fd,p+4);
+    } else if (editorIsSubstitute(p)) {
+        editorSubstitute(E,p);
+    } else if (!strncmp(p,"mem",3) && (p[3] == ' ' || p[3] == '\0')) {
+        memCommand(E,p+3);
+    } else if (!strcmp(p,"stats")) {
+        statsToggleOverlay(E);
+    } else if (*cmd) {
+        editorSetStatusMessage(E,"Unknown command: %s",cmd);
+    }
+    free(cmd);
+}
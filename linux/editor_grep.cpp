@@ -0,0 +1,357 @@
+#include "editor.h"
+
+#include <dirent.h>
+#include <algorithm>
+
+/* ================================ Grep mode =================================
+ *
+ * :grep [-r] [-i] pattern [dir]  searches every file under 'dir' (default
+ * the current directory) and lists the matching lines. -r makes the pattern
+ * a regex, -i ignores case, a backslash escapes a space in the pattern.
+ *
+ * The walk and the search run on the thread pool: every directory is a task
+ * that submits a task per file and per subdirectory, so the work spreads
+ * over the workers as the tree is discovered. Each file is mmap()ed and
+ * searched with the same engines used by editorFind. Hidden entries and
+ * symlinks are not followed, files bigger than GREP_MAX_FILE_SIZE are
+ * skipped, and so are files with a NUL byte in the first GREP_BINARY_PROBE
+ * bytes: that's how grep tells binary files, and it costs a single memchr().
+ *
+ * Hits stream into the results list while the search runs. Enter opens the
+ * selected hit, ESC goes back to the file, and :grep without arguments
+ * shows the last results again. */
+
+struct grepJob {
+    std::string pattern, root;
+    int icase = 0;
+    std::shared_ptr<regexProg> re;  /* Set for regex searches. */
+    std::atomic<int> cancel{0};
+    std::atomic<int> pending{0};    /* Tasks submitted and not done. */
+    std::atomic<int> files{0};      /* Files searched. */
+    std::atomic<int> skipped{0};    /* Files too big or binary. */
+    std::atomic<int> nhits{0};
+    std::mutex mutex;
+    std::vector<grepHit> incoming;  /* Found, not yet moved to 'hits'. */
+
+    /* Used by the main thread only. */
+    std::vector<grepHit> hits;
+    int sel = 0, top = 0;
+    int sorted = 0;
+};
+
+static void grepSubmit(std::shared_ptr<grepJob> job, std::function<void()> task) {
+    job->pending++;
+    poolSubmit(poolGet(),[job,task] {
+        if (!job->cancel) task();
+        job->pending--;
+    });
+}
+
+/* Search one file, adding a hit for every line with a match. */
+static void grepFile(grepJob *job, const std::string &path) {
+    struct stat st;
+    std::vector<grepHit> hits;
+
+    int fd = open(path.c_str(),O_RDONLY);
+    if (fd == -1) return;
+    if (fstat(fd,&st) == -1) {
+        close(fd);
+        return;
+    }
+    if (st.st_size == 0 || st.st_size > GREP_MAX_FILE_SIZE) {
+        if (st.st_size > GREP_MAX_FILE_SIZE) job->skipped++;
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const char *text = (const char*)map;
+    if (memchr(text,'\0',std::min(size,(size_t)GREP_BINARY_PROBE))) {
+        job->skipped++;
+        munmap(map,size);
+        return;
+    }
+    job->files++;
+
+    regexMatcher *m = job->re ? regexMatcherNew(job->re.get()) : NULL;
+    size_t pos = 0, linestart = 0, ms, me;
+    int line = 0;
+    while (pos < size) {
+        if (m) {
+            if (!regexFind(m,text,size,pos,&ms,&me)) break;
+        } else {
+            const char *p = searchMemmem(text+pos,size-pos,job->pattern.c_str(),
+                                         job->pattern.size(),job->icase);
+            if (p == NULL) break;
+            ms = p - text;
+        }
+        const char *nl = text+pos;
+        while ((nl = (const char*)memchr(nl,'\n',text+ms-nl)) != NULL) {
+            line++;
+            linestart = ++nl - text;
+        }
+        nl = (const char*)memchr(text+ms,'\n',size-ms);
+        size_t le = nl ? nl - text : size;
+
+        grepHit hit;
+        hit.path = path;
+        hit.line = line;
+        hit.col = ms - linestart;
+        hit.text.assign(text+linestart,std::min(le-linestart,(size_t)256));
+        for (auto &c : hit.text) if (!isprint((unsigned char)c)) c = ' ';
+        hits.push_back(hit);
+        if (job->nhits + hits.size() >= GREP_MAX_HITS) {
+            job->cancel = 1;
+            break;
+        }
+
+        /* One hit per line: go on from the next one. */
+        pos = linestart = le+1;
+        line++;
+    }
+    if (m) regexMatcherFree(m);
+    munmap(map,size);
+
+    if (!hits.empty()) {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->nhits += hits.size();
+        for (auto &h : hits) job->incoming.push_back(std::move(h));
+    }
+}
+
+static void grepWalk(std::shared_ptr<grepJob> job, std::string dir) {
+    DIR *d = opendir(dir.c_str());
+    struct dirent *de;
+
+    if (d == NULL) return;
+    while ((de = readdir(d)) != NULL && !job->cancel) {
+        if (de->d_name[0] == '.') continue;
+        std::string path = dir == "." ? de->d_name : dir + "/" + de->d_name;
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path.c_str(),&st) == -1) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR :
+                   S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR)
+            grepSubmit(job,[job,path] { grepWalk(job,path); });
+        else if (type == DT_REG)
+            grepSubmit(job,[job,path] { grepFile(job.get(),path); });
+    }
+    closedir(d);
+}
+
+/* Parse the arguments of :grep. Returns 0 if there is no pattern. */
+static int grepParse(const char *args, std::string *pattern, std::string *dir,
+                     int *regex, int *icase)
+{
+    std::vector<std::string> words;
+    std::string w;
+    int inword = 0;
+
+    for (const char *p = args; ; p++) {
+        if (*p == '\0' || *p == ' ') {
+            if (inword) words.push_back(w);
+            if (*p == '\0') break;
+            w.clear();
+            inword = 0;
+            continue;
+        }
+        if (*p == '\\' && p[1] == ' ') p++;
+        w += *p;
+        inword = 1;
+    }
+    *regex = *icase = 0;
+    size_t j = 0;
+    for (; j < words.size() && words[j][0] == '-' && words[j].size() > 1; j++) {
+        for (size_t k = 1; k < words[j].size(); k++) {
+            if (words[j][k] == 'r') *regex = 1;
+            else if (words[j][k] == 'i') *icase = 1;
+            else return 0;
+        }
+    }
+    if (j == words.size()) return 0;
+    *pattern = words[j++];
+    *dir = j < words.size() ? words[j] : ".";
+    return 1;
+}
+
+/* Move the hits found since last time to the results list. When the search
+ * is over the list is sorted, keeping the same hit selected. */
+static int grepCollect(grepJob *job) {
+    int done = job->pending == 0;
+    {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        for (auto &h : job->incoming) job->hits.push_back(std::move(h));
+        job->incoming.clear();
+    }
+    if (done && !job->sorted) {
+        auto less = [](const grepHit &a, const grepHit &b) {
+            int cmp = a.path.compare(b.path);
+            return cmp < 0 || (cmp == 0 && a.line < b.line);
+        };
+        grepHit sel;
+        if (!job->hits.empty()) sel = job->hits[job->sel];
+        std::sort(job->hits.begin(),job->hits.end(),less);
+        if (!job->hits.empty())
+            job->sel = std::lower_bound(job->hits.begin(),job->hits.end(),
+                                        sel,less) - job->hits.begin();
+        job->sorted = 1;
+    }
+    return done;
+}
+
+static void grepDraw(editorConfig *E, grepJob *job, int done) {
+    struct abuf ab = ABUF_INIT;
+    char buf[64];
+
+    if (job->sel < job->top) job->top = job->sel;
+    if (job->sel >= job->top + E->screenrows)
+        job->top = job->sel - E->screenrows + 1;
+
+    abAppend(&ab,"\x1b[?25l",6); /* Hide cursor. */
+    abAppend(&ab,"\x1b[H",3); /* Go home. */
+    for (int y = 0; y < E->screenrows; y++) {
+        int idx = job->top + y;
+        if (idx < (int)job->hits.size()) {
+            grepHit *h = &job->hits[idx];
+            int len = snprintf(buf,sizeof(buf),":%d: ",h->line+1);
+            int avail = E->screencols;
+            if (idx == job->sel) abAppend(&ab,"\x1b[7m",4);
+            abAppend(&ab,"\x1b[36m",5);
+            int plen = std::min((int)h->path.size(),avail);
+            abAppend(&ab,h->path.c_str(),plen);
+            avail -= plen;
+            len = std::min(len,avail);
+            abAppend(&ab,buf,len);
+            avail -= len;
+            abAppend(&ab,"\x1b[39m",5);
+            abAppend(&ab,h->text.c_str(),std::min((int)h->text.size(),avail));
+            abAppend(&ab,"\x1b[0m",4);
+        } else {
+            abAppend(&ab,"~",1);
+        }
+        abAppend(&ab,"\x1b[0K\r\n",6);
+    }
+
+    /* Status rows, as in editorRefreshScreen(). */
+    char status[80], rstatus[32];
+    abAppend(&ab,"\x1b[0K",4);
+    abAppend(&ab,"\x1b[7m",4);
+    int len = snprintf(status,sizeof(status)," GREP %.20s - %d hits in %d files%s",
+        job->pattern.c_str(),(int)job->hits.size(),(int)job->files,
+        job->skipped ? " (some skipped)" : "");
+    int rlen = snprintf(rstatus,sizeof(rstatus),"%s",
+        !done ? "searching..." : job->nhits >= GREP_MAX_HITS ? "truncated" : "done");
+    if (len > E->screencols) len = E->screencols;
+    abAppend(&ab,status,len);
+    while(len < E->screencols) {
+        if (E->screencols - len == rlen) {
+            abAppend(&ab,rstatus,rlen);
+            break;
+        } else {
+            abAppend(&ab," ",1);
+            len++;
+        }
+    }
+    abAppend(&ab,"\x1b[0m\r\n",6);
+    abAppend(&ab,"\x1b[0K",4);
+    int msglen = strlen(E->statusmsg);
+    abAppend(&ab,E->statusmsg,msglen <= E->screencols ? msglen : E->screencols);
+    write(STDOUT_FILENO,ab.b,ab.len);
+    abFree(&ab);
+}
+
+/* Open the file of 'hit' unless it is the current one, and go there. */
+static int grepOpenHit(editorConfig *E, grepHit *hit) {
+    char a[PATH_MAX], b[PATH_MAX];
+    int same = E->filename && realpath(E->filename,a) &&
+               realpath(hit->path.c_str(),b) && !strcmp(a,b);
+
+    if (!same) {
+        if (E->dirty) {
+            editorSetStatusMessage(E,"Unsaved changes: save before opening %.40s",
+                hit->path.c_str());
+            return 0;
+        }
+        editorCloseFile(E);
+        editorSelectSyntaxHighlight(E,(char*)hit->path.c_str());
+        editorOpen(E,(char*)hit->path.c_str());
+    }
+    long long line = std::min((long long)hit->line,E->numrows ? E->numrows-1 : 0);
+    E->rowoff = std::max(0LL,line - E->screenrows/2);
+    E->cy = line - E->rowoff;
+    E->coloff = 0;
+    E->cx = hit->col;
+    if (E->cx > E->screencols-1) {
+        E->coloff = E->cx-E->screencols+1;
+        E->cx = E->screencols-1;
+    }
+    editorSetStatusMessage(E,"%s:%d",hit->path.c_str(),hit->line+1);
+    return 1;
+}
+
+/* Run :grep with 'args', or show the last results if there are none. */
+void editorGrep(editorConfig *E, int fd, const char *args) {
+    std::string pattern, dir;
+    int regex, icase;
+
+    while (*args == ' ') args++;
+    if (*args) {
+        if (!grepParse(args,&pattern,&dir,&regex,&icase)) {
+            editorSetStatusMessage(E,"Usage: :grep [-r] [-i] pattern [dir]");
+            return;
+        }
+        std::shared_ptr<grepJob> job = std::make_shared<grepJob>();
+        job->pattern = pattern;
+        job->root = dir;
+        job->icase = icase;
+        if (regex) {
+            const char *err;
+            regexProg *prog = regexCompile(pattern.c_str(),icase,&err);
+            if (prog == NULL) {
+                editorSetStatusMessage(E,"Bad pattern: %s",err);
+                return;
+            }
+            job->re.reset(prog,regexFree);
+        }
+        if (E->grep) E->grep->cancel = 1;
+        E->grep = job;
+        grepSubmit(job,[job,dir] { grepWalk(job,dir); });
+    } else if (!E->grep) {
+        editorSetStatusMessage(E,"Usage: :grep [-r] [-i] pattern [dir]");
+        return;
+    }
+
+    grepJob *job = E->grep.get();
+    editorSetStatusMessage(E,"Arrows/PgUp/PgDn move, Enter opens, ESC goes back");
+    while(1) {
+        int done = grepCollect(job);
+        grepDraw(E,job,done);
+
+        /* Keep redrawing while the results stream in. */
+        int c = KEY_NULL;
+        if (done || editorWaitInput(fd,100)) c = editorReadKey(fd);
+        int n = job->hits.size();
+        switch(c) {
+        case ARROW_UP: job->sel--; break;
+        case ARROW_DOWN: job->sel++; break;
+        case PAGE_UP: job->sel -= E->screenrows; break;
+        case PAGE_DOWN: job->sel += E->screenrows; break;
+        case HOME_KEY: job->sel = 0; break;
+        case END_KEY: job->sel = n-1; break;
+        case ESC:
+            editorSetStatusMessage(E,"");
+            return;
+        case ENTER:
+            if (n && grepOpenHit(E,&job->hits[job->sel])) return;
+            break;
+        }
+        if (job->sel >= n) job->sel = n-1;
+        if (job->sel < 0) job->sel = 0;
+    }
+}
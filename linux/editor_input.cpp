@@ -1,10 +1,9 @@
 #include "editor.h"
 
-int editorReadKey(int fd) {
-    int nread;
-    char c, seq[5];
-    while ((nread = read(fd,&c,1)) != 1);
-    if (nread == -1) exit(1);
+/* Turn the byte 'c' and the ones of an escape sequence it may start into
+ * a key. */
+static int editorDecodeKey(int fd, char c) {
+    char seq[5];
 
     while(1) {
         switch(c) {
@@ -67,6 +66,36 @@ int editorReadKey(int fd) {
     }
 }
 
+int editorReadKey(int fd) {
+    int nread;
+    char c;
+    while ((nread = read(fd,&c,1)) != 1);
+    if (nread == -1) exit(1);
+
+    uint64_t first = statsNow();
+    int key = editorDecodeKey(fd,c);
+    statsKeyRead(first);
+    return key;
+}
+
+/* Copy and paste in normal mode, still to be done (see main.cpp). */
+void editorCopy() {
+
+}
+
+void editorPaste() {
+
+}
+
+/* Wait up to 'timeout_ms' milliseconds for input on 'fd'. Returns 1 if
+ * a key can be read without blocking, 0 on timeout. */
+int editorWaitInput(int fd, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd,1,timeout_ms) > 0;
+}
+
 /* Process events arriving from the standard input, which is, the user
  * is typing stuff on the terminal. */
 void editorProcessKeypress(editorConfig *E, int fd) {
@@ -83,9 +112,11 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 			break;
 		case ARROW_UP:
 		case ARROW_DOWN:
+			editorMoveCursor(E, c);
+			break;
 		case ARROW_LEFT:
 		case ARROW_RIGHT:
-			editorMoveCursor(E, c);
+			editorMoveCursorChar(E, c);
 			break;
 		case ARROW_CTRL_UP:
 			// Maybe move to previous paragraph?
@@ -110,6 +141,8 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 					editorMoveCursor(E, ARROW_RIGHT);
 			break;
 		case 'k':
+			/* A save still syncing may yet fail and leave changes unsaved. */
+			editorSaveReap(E, 1);
 			if (E->dirty) {
 				editorSetStatusMessage(E, "Unsaved changes in the current file. Save before exiting.");
 				break;
@@ -123,8 +156,8 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 			exit(0);
 			break;
 		case 'x':
-			editorMoveCursor(E, ARROW_RIGHT);
-			editorDelChar(E);
+			editorMoveCursorChar(E, ARROW_RIGHT);
+			editorDelCharBefore(E, NULL);
 			break;
 		case 'd':
 			if (!E->numrows) break;
@@ -133,9 +166,7 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 				delete_line_key_pressed_times--;
 				return;
 			}
-			for (int i = E->cy; i < E->numrows - 1; i++)
-				E->row[i] = E->row[i + 1];
-			E->numrows--;
+			editorDelRow(E, E->rowoff + E->cy);
 			break;
 		case 'f':
 			editorFind(E, fd);
@@ -144,7 +175,7 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 			E->mode = EDITOR_MODE_INSERT;
 			break;
 		case ':':
-			// Let the user insert a command (?)
+			editorCommand(E, fd);
 			break;
 		case 'u':
 			editorUndo(E);
@@ -158,6 +189,9 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 		case 'p':
 			editorPaste();
 			break;
+		case 'w':
+			wrapToggle(E);
+			break;
 		default:
 			break;
 		}
@@ -178,22 +212,24 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 			editorFind(E, fd);
 			break;
 		case BACKSPACE: {     /* Backspace */
-			char deleted_char = editorDelChar(E);
 			UndoCommandBus bus;
-			PushCommand(E, &bus, UNDO_CMD_DELETE_LEFT_CHAR, deleted_char);
+			editorDelCharBefore(E, &bus);
 			PushCommandBus(E, bus);
 		} break;
 		case DEL_KEY:
 			if (E->cy != E->numrows && E->cx != E->row[E->cy].size) {
-				editorMoveCursor(E, ARROW_RIGHT);
-				char deleted_char = editorDelChar(E);
+				editorMoveCursorChar(E, ARROW_RIGHT);
 				UndoCommandBus bus;
-				PushCommand(E, &bus, UNDO_CMD_DELETE_LEFT_CHAR, deleted_char);
+				editorDelCharBefore(E, &bus);
 				PushCommandBus(E, bus);
 			}
 			break;
 		case PAGE_UP:
 		case PAGE_DOWN: {
+			if (E->wrap.on) {
+				wrapPage(E, c);
+				break;
+			}
 			if (c == PAGE_UP && E->cy != 0)
 				E->cy = 0;
 			else if (c == PAGE_DOWN && E->cy != E->screenrows-1)
@@ -205,9 +241,11 @@ void editorProcessKeypress(editorConfig *E, int fd) {
 		} break;
 		case ARROW_UP:
 		case ARROW_DOWN:
+			editorMoveCursor(E, c);
+			break;
 		case ARROW_LEFT:
 		case ARROW_RIGHT:
-			editorMoveCursor(E, c);
+			editorMoveCursorChar(E, c);
 			break;
 		case ARROW_CTRL_UP:
 			// Maybe move to previous paragraph?
@@ -0,0 +1,209 @@
+#include "editor.h"
+#include <algorithm>
+
+/* ================================ Long rows =================================
+ *
+ * A row of hundreds of megabytes, such as minified JSON, can't be rendered
+ * and highlighted whole on every change. Rows of ROW_LONG_LINE bytes or more
+ * only keep in render and hl a window of the columns around the screen: it
+ * starts at render column row->roff and is row->rlen bytes long.
+ *
+ * What is needed to build any window is kept every ROW_COLIDX_STEP bytes of
+ * the row: the render column of that byte, and the highlighter state there.
+ * After a change the columns are scanned again from the checkpoint before
+ * it, a scan that only stops at TABs. The highlighter states are computed
+ * lazily, as far as a window or the open comment state at the end of the
+ * row needs them, and stay valid before the change. */
+
+/* Render column after the bytes 's' of 'len', starting at column 'col'.
+ * TABs expand as in editorUpdateRender(). */
+static long long longLineScanCols(const char *s, long long len, long long col) {
+    const char *end = s+len, *t;
+    while ((t = (const char*)memchr(s,TAB,end-s)) != NULL) {
+        col = (col+(t-s)+1) | 7;
+        s = t+1;
+    }
+    return col+(end-s);
+}
+
+/* Render the bytes 's' of 'len', starting at column 'col', into 'out'. */
+static void longLineRender(const char *s, long long len, long long col, char *out) {
+    char *p = out;
+    for (long long j = 0; j < len; j++) {
+        if (s[j] == TAB) {
+            long long next = (col+(p-out)+1) | 7;
+            while (col+(p-out) < next) *p++ = ' ';
+        } else {
+            *p++ = s[j];
+        }
+    }
+}
+
+/* The bytes of the row from 'b' to 'e', at column 'col', rendered: they are
+ * the same as in the row unless there are TABs. Sets '*len' to their size. */
+static const char *longLineRendered(erow *row, long long b, long long e,
+                                    long long col, std::string *buf, long long *len)
+{
+    if (memchr(row->chars+b,TAB,e-b) == NULL) {
+        *len = e-b;
+        return row->chars+b;
+    }
+    buf->resize(longLineScanCols(row->chars+b,e-b,col)-col);
+    longLineRender(row->chars+b,e-b,col,&(*buf)[0]);
+    *len = buf->size();
+    return buf->data();
+}
+
+/* Make the highlighter states valid up to the checkpoint 'k'. Each chunk
+ * is taken with a few bytes after it, for the tokens that cross its end. */
+static void longLineSyncState(editorConfig *E, erow *row, size_t k) {
+    editorLongLine *ll = row->ll;
+    std::string buf;
+
+    while (ll->stvalid <= k) {
+        size_t j = ll->stvalid-1;
+        long long b = j*ROW_COLIDX_STEP;
+        long long e = std::min(row->size,b+ROW_COLIDX_STEP);
+        long long le = std::min(row->size,e+ROW_HL_LOOKAHEAD);
+        long long stop = ll->col[j+1]-ll->col[j], len;
+
+        const char *p = longLineRendered(row,b,le,ll->col[j],&buf,&len);
+        longLineState s = ll->st[j];
+        long long at = s.over + editorHighlight(E,p+s.over,
+            len-s.over,stop-s.over,NULL,&s.st);
+        s.over = at-stop;
+        ll->st[j+1] = s;
+        ll->stvalid++;
+    }
+}
+
+/* The content of a long row changed: called by editorUpdateRender(). The
+ * change starts at ll->from, see longLineChanged(). */
+void longLineUpdate(erow *row) {
+    editorLongLine *ll = row->ll;
+
+    if (ll == NULL) ll = row->ll = new editorLongLine();
+    size_t n = row->size/ROW_COLIDX_STEP + 1;
+    size_t k = ll->from/ROW_COLIDX_STEP;
+    if (k >= ll->col.size()) k = ll->col.empty() ? 0 : ll->col.size()-1;
+    if (k >= n) k = n-1;
+    ll->col.resize(n);
+    ll->st.resize(n);
+    if (k == 0) ll->col[0] = 0;
+    for (; k+1 < n; k++)
+        ll->col[k+1] = longLineScanCols(row->chars+k*ROW_COLIDX_STEP,
+            ROW_COLIDX_STEP,ll->col[k]);
+    row->rsize = longLineScanCols(row->chars+k*ROW_COLIDX_STEP,
+        row->size-k*ROW_COLIDX_STEP,ll->col[k]);
+
+    /* States after the change, or with a token reaching into it, are gone.
+     * The first one only depends on the row before. */
+    size_t keep = ll->from < ROW_HL_LOOKAHEAD ? 1 :
+                  (ll->from-ROW_HL_LOOKAHEAD)/ROW_COLIDX_STEP + 1;
+    ll->stvalid = std::min(ll->stvalid,std::min(keep,n));
+    ll->from = 0;
+    ll->wvalid = 0;
+    row->roff = row->rlen = 0;
+}
+
+/* Called before changing the content of 'row' from the byte 'at' on, so that
+ * the update that follows keeps what is before. */
+void longLineChanged(erow *row, long long at) {
+    if (row->ll) row->ll->from = at;
+}
+
+/* The highlight of a long row may have changed: the window is highlighted
+ * again when shown, but the open comment state at the end of the row is
+ * needed now to know if the rows after have to be highlighted again. */
+void longLineUpdateSyntax(editorConfig *E, erow *row) {
+    editorLongLine *ll = row->ll;
+    editorHlState start;
+
+    ll->wvalid = 0;
+    if (E->syntax == NULL) return;
+    editorHlStart(E,row,&start);
+    if (ll->stvalid == 0 || memcmp(&start,&ll->st[0].st,sizeof(start))) {
+        ll->st[0].st = start;
+        ll->st[0].over = 0;
+        ll->stvalid = 1;
+    }
+
+    size_t last = ll->col.size()-1;
+    std::string buf;
+    long long len;
+    longLineSyncState(E,row,last);
+    const char *p = longLineRendered(row,last*ROW_COLIDX_STEP,row->size,
+                                     ll->col[last],&buf,&len);
+    longLineState s = ll->st[last];
+    if (s.over < len)
+        editorHighlight(E,p+s.over,len-s.over,len-s.over,NULL,&s.st);
+
+    int oc = s.st.in_comment;
+    if (row->hl_oc != oc && row->idx+1 < E->numrows)
+        editorUpdateSyntax(E, &E->row[row->idx+1]);
+    row->hl_oc = oc;
+}
+
+/* Make render and hl of a long row cover the render columns from 'from' to
+ * 'to'. The window goes ROW_WINDOW_MARGIN columns further on each side, so
+ * that scrolling a little doesn't build it again, and starts at a checkpoint
+ * so that it is highlighted from the state there. */
+void longLineWindow(editorConfig *E, erow *row, long long from, long long to) {
+    editorLongLine *ll = row->ll;
+    std::vector<long long> &col = ll->col;
+
+    if (E->syntax && ll->stvalid == 0) longLineUpdateSyntax(E,row);
+    if (to > row->rsize) to = row->rsize;
+    if (ll->wvalid && from >= row->roff && to <= row->roff+row->rlen) return;
+
+    size_t k0 = std::upper_bound(col.begin(),col.end(),
+        std::max(0LL,from-ROW_WINDOW_MARGIN)) - col.begin() - 1;
+    size_t k1 = std::lower_bound(col.begin(),col.end(),
+        to+ROW_WINDOW_MARGIN) - col.begin();
+    long long b = k0*ROW_COLIDX_STEP;
+    long long e = k1 < col.size() ? k1*ROW_COLIDX_STEP : row->size;
+    long long len = (k1 < col.size() ? col[k1] : row->rsize) - col[k0];
+
+    row->render = (char*)realloc(row->render,len+1);
+    row->hl = (unsigned char*)realloc(row->hl,len+1);
+    longLineRender(row->chars+b,e-b,col[k0],row->render);
+    row->render[len] = '\0';
+    memset(row->hl,HL_NORMAL,len);
+    row->roff = col[k0];
+    row->rlen = len;
+    ll->wvalid = 1;
+    if (E->syntax == NULL) return;
+
+    longLineSyncState(E,row,k0);
+    longLineState s = ll->st[k0];
+    long long i = s.over;
+    /* Like editorUpdateSyntax(), leading spaces are left alone. */
+    if (k0 == 0) while (i < len && isspace(row->render[i])) i++;
+    if (i < len) editorHighlight(E,row->render+i,len-i,len-i,row->hl+i,&s.st);
+}
+
+/* Render column of the byte 'at' of a long row. */
+long long longLineCol(erow *row, long long at) {
+    if (at >= row->size) return row->rsize;
+    size_t k = at/ROW_COLIDX_STEP;
+    return longLineScanCols(row->chars+k*ROW_COLIDX_STEP,
+        at-k*ROW_COLIDX_STEP,row->ll->col[k]);
+}
+
+/* Byte of a long row shown at the render column 'rx'. */
+long long longLineByte(erow *row, long long rx) {
+    std::vector<long long> &col = row->ll->col;
+    if (rx >= row->rsize) return row->size;
+    size_t k = std::upper_bound(col.begin(),col.end(),rx) - col.begin() - 1;
+    long long cur = col[k], j = k*ROW_COLIDX_STEP;
+    for (; j < row->size; j++) {
+        cur = row->chars[j] == TAB ? (cur+1) | 7 : cur+1;
+        if (cur > rx) break;
+    }
+    return j;
+}
+
+void longLineFree(erow *row) {
+    delete row->ll;
+    row->ll = NULL;
+}
@@ -0,0 +1,254 @@
+#include "editor.h"
+
+#include <algorithm>
+#include <malloc.h>
+
+/* ============================= Memory accounting ============================
+ *
+ * ":mem" tells where the memory of the process goes: the message row gets
+ * the resident size and the biggest structures, each as bytes per byte of
+ * text, and ":mem <file>" writes the whole report to the file ("mem" does it
+ * on stdout in batch mode). For every structure:
+ *
+ *  used      bytes holding data: the rows' content and null terms, the
+ *            elements of vectors
+ *  alloc     bytes malloc handed out for it: the usable size of the blocks,
+ *            the capacity of vectors, plus a chunk header for each
+ *  overhead  alloc minus used: slack at the end of blocks and headers
+ *
+ * then what malloc holds overall, free chunks included, and the resident
+ * size of the process. The rest of the resident size is code, stacks, the
+ * parts of the undo journal mapping read so far, and structures not
+ * accounted for, as those of grep.
+ *
+ * Nothing is counted as the editor runs: the report walks the structures
+ * when asked, a few calls to malloc_usable_size() per row, so it costs
+ * nothing until then, and a second or so for a file of tens of millions of
+ * rows. Blocks of containers are assumed to come from malloc, as they do with
+ * libstdc++. */
+
+#define MEM_CHUNK_HEADER 8      /* Per malloc chunk, as glibc on 64 bit. */
+
+enum {
+    MEM_ROWS, MEM_CHARS, MEM_RENDER, MEM_HL, MEM_ROWMAPS, MEM_UNDO,
+    MEM_SEARCH, MEM_TRIGRAM, MEM_WRAP, MEM_SAVE, MEM_JOURNAL, MEM_ITEMS
+};
+
+static const char *memNames[MEM_ITEMS] = {
+    "rows","chars","render","hl","rowmaps","undo","search","trigram","wrap",
+    "save","journal"
+};
+
+struct memItem {
+    uint64_t blocks, used, alloc;
+};
+
+struct memReport {
+    memItem item[MEM_ITEMS];
+    uint64_t text;              /* Bytes of the file, newlines included. */
+    uint64_t accounted;         /* Sum of alloc of the malloc'ed items. */
+    uint64_t overhead;          /* And of their overhead. */
+    struct mallinfo2 mi;
+    uint64_t rss;
+};
+
+/* A block from malloc, or NULL, of which 'used' bytes hold data. */
+static void memBlock(memItem *m, const void *p, size_t used) {
+    if (p == NULL) return;
+    m->blocks++;
+    m->used += used;
+    m->alloc += malloc_usable_size((void*)p) + MEM_CHUNK_HEADER;
+}
+
+/* The block of a vector. */
+template<typename T>
+static void memVector(memItem *m, const std::vector<T> &v) {
+    if (v.capacity() == 0) return;
+    m->blocks++;
+    m->used += v.size()*sizeof(T);
+    m->alloc += v.capacity()*sizeof(T) + MEM_CHUNK_HEADER;
+}
+
+/* A block of 'size' bytes from operator new. */
+static void memObject(memItem *m, size_t size) {
+    m->blocks++;
+    m->used += size;
+    m->alloc += size + MEM_CHUNK_HEADER;
+}
+
+static void memString(memItem *m, const std::string &s) {
+    /* Short strings live in the object itself. */
+    if (s.data() >= (const char*)&s && s.data() < (const char*)(&s+1)) return;
+    m->blocks++;
+    m->used += s.size()+1;
+    m->alloc += s.capacity()+1 + MEM_CHUNK_HEADER;
+}
+
+static uint64_t memResident(void) {
+    unsigned long long size, resident = 0;
+    FILE *fp = fopen("/proc/self/statm","r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp,"%llu %llu",&size,&resident) != 2) resident = 0;
+    fclose(fp);
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+static void memAccount(editorConfig *E, memReport *r) {
+    memset(r,0,sizeof(*r));
+
+    memBlock(&r->item[MEM_ROWS],E->row,sizeof(erow)*E->numrows);
+    for (long long j = 0; j < E->numrows; j++) {
+        erow *row = &E->row[j];
+        r->text += row->size+1;
+        memBlock(&r->item[MEM_CHARS],row->chars,row->size+1);
+        memBlock(&r->item[MEM_RENDER],row->render,row->rlen+1);
+        memBlock(&r->item[MEM_HL],row->hl,row->rlen);
+        memBlock(&r->item[MEM_ROWMAPS],row->cmap,sizeof(rowCol)*row->ncmap);
+        memBlock(&r->item[MEM_ROWMAPS],row->wrap,
+                 sizeof(long long)*std::max(row->wraplines-1,0LL));
+        if (row->ll) {
+            memObject(&r->item[MEM_ROWMAPS],sizeof(editorLongLine));
+            memVector(&r->item[MEM_ROWMAPS],row->ll->col);
+            memVector(&r->item[MEM_ROWMAPS],row->ll->st);
+        }
+    }
+
+    memItem *m = &r->item[MEM_UNDO];
+    memVector(m,E->m_command_queue);
+    for (const UndoCommandBus &bus : E->m_command_queue) {
+        memVector(m,bus);
+        for (const UndoCommand &cmd : bus) {
+            if (!cmd.text) continue;
+            /* The control block of make_shared holds the text too. */
+            memObject(m,sizeof(UndoRowText)+2*sizeof(long));
+            memString(m,cmd.text->before);
+            memString(m,cmd.text->after);
+        }
+    }
+
+    editorSearch *s = &E->search;
+    m = &r->item[MEM_SEARCH];
+    memBlock(m,s->view,s->view ? s->len+1 : 0);
+    memVector(m,s->rowstart);
+    memVector(m,s->matches);
+    memVector(m,s->matchlen);
+
+    editorTrigram *t = &E->trigram;
+    m = &r->item[MEM_TRIGRAM];
+    if (t->postings.bucket_count() > 1) {
+        memObject(m,t->postings.bucket_count()*sizeof(void*));
+        for (const auto &p : t->postings) {
+            /* A node: the next pointer and the pair. */
+            memObject(m,sizeof(void*)+sizeof(p));
+            memVector(m,p.second.data);
+        }
+    }
+    memVector(m,t->blockline);
+    memVector(m,t->lidrow);
+
+    memVector(&r->item[MEM_WRAP],E->wrap.tree);
+
+    if (E->save) {
+        m = &r->item[MEM_SAVE];
+        /* Not its checkpoints: the thread of the save writes them. */
+        memVector(m,E->save->rows);
+        for (char *p : E->save->orphans) memBlock(m,p,strlen(p)+1);
+    }
+    memVector(&r->item[MEM_SAVE],E->saved.ckpt);
+
+    /* Mapped from the file, not from malloc: its pages are read as undo
+     * reaches them, and can be dropped by the kernel. */
+    m = &r->item[MEM_JOURNAL];
+    if (E->m_journal.map) {
+        m->blocks = 1;
+        m->used = m->alloc = E->m_journal.maplen;
+    }
+
+    for (int j = 0; j < MEM_ITEMS; j++)
+        if (j != MEM_JOURNAL) {
+            r->accounted += r->item[j].alloc;
+            r->overhead += r->item[j].alloc-r->item[j].used;
+        }
+    r->mi = mallinfo2();
+    r->rss = memResident();
+}
+
+/* Write the report on 'fp'. Returns -1 on errors. */
+int memWrite(editorConfig *E, FILE *fp) {
+    memReport r;
+    double text;
+
+    memAccount(E,&r);
+    text = r.text ? r.text : 1;
+    fprintf(fp,"# %llu bytes of text in %lld rows, bytes per byte of text "
+               "in brackets\n",(unsigned long long)r.text,E->numrows);
+    fprintf(fp,"%-10s %12s %14s %14s %14s\n","structure","blocks","used",
+               "alloc","overhead");
+    for (int j = 0; j < MEM_ITEMS; j++) {
+        memItem *m = &r.item[j];
+        fprintf(fp,"%-10s %12llu %14llu %14llu %14llu  [%.3f]\n",memNames[j],
+                (unsigned long long)m->blocks,(unsigned long long)m->used,
+                (unsigned long long)m->alloc,
+                (unsigned long long)(m->alloc-m->used),m->alloc/text);
+    }
+    fprintf(fp,"\n%-28s %14llu  [%.3f]\n","accounted (journal aside)",
+            (unsigned long long)r.accounted,r.accounted/text);
+    fprintf(fp,"%-28s %14llu  [%.3f]\n","of it, overhead",
+            (unsigned long long)r.overhead,r.overhead/text);
+    fprintf(fp,"%-28s %14zu  [%.3f]\n","malloc in use",
+            r.mi.uordblks+r.mi.hblkhd,(r.mi.uordblks+r.mi.hblkhd)/text);
+    fprintf(fp,"%-28s %14zu  [%.3f]\n","malloc free, kept",
+            r.mi.fordblks,r.mi.fordblks/text);
+    fprintf(fp,"%-28s %14llu  [%.3f]\n","resident",
+            (unsigned long long)r.rss,r.rss/text);
+    return ferror(fp) ? -1 : 0;
+}
+
+/* Bytes as a short human readable string. */
+static const char *memHuman(uint64_t bytes, char *buf, size_t len) {
+    const char *units = "BKMGT";
+    double v = bytes;
+    while (v >= 1024 && units[1]) {
+        v /= 1024;
+        units++;
+    }
+    snprintf(buf,len,"%.*f%c",*units == 'B' ? 0 : 1,v,*units);
+    return buf;
+}
+
+/* The :mem command: the summary in the message row, or the report written
+ * to the file 'arg' if not empty. */
+void memCommand(editorConfig *E, const char *arg) {
+    while (*arg == ' ') arg++;
+    if (*arg) {
+        FILE *fp = fopen(arg,"w");
+        int err = fp == NULL || memWrite(E,fp) == -1;
+        if (fp && fclose(fp) == EOF) err = 1;
+        if (err) editorSetStatusMessage(E,"Can't write %s: %s",arg,strerror(errno));
+        else editorSetStatusMessage(E,"Memory report written to %s",arg);
+        return;
+    }
+
+    memReport r;
+    char a[16], b[16], msg[sizeof(E->statusmsg)];
+    int order[MEM_ITEMS], used;
+
+    memAccount(E,&r);
+    double text = r.text ? r.text : 1;
+    used = snprintf(msg,sizeof(msg),"rss %s, text %s:",
+                    memHuman(r.rss,a,sizeof(a)),memHuman(r.text,b,sizeof(b)));
+    /* The biggest first, as many as fit. */
+    for (int j = 0; j < MEM_ITEMS; j++) order[j] = j;
+    std::sort(order,order+MEM_ITEMS,[&](int x, int y) {
+        return r.item[x].alloc > r.item[y].alloc;
+    });
+    for (int j = 0; j < MEM_ITEMS && r.item[order[j]].alloc; j++) {
+        char item[32];
+        int len = snprintf(item,sizeof(item)," %s %.2fx",memNames[order[j]],
+                           r.item[order[j]].alloc/text);
+        if (used+len >= (int)sizeof(msg)) break;
+        memcpy(msg+used,item,len+1);
+        used += len;
+    }
+    editorSetStatusMessage(E,"%s",msg);
+}
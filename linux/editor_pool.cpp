@@ -0,0 +1,78 @@
+#include "editor.h"
+
+/* ================================ Thread pool ===============================
+ *
+ * A fixed set of workers, one per CPU, shared by every background job of the
+ * editor. Tasks are plain closures: jobs that need cancellation or progress
+ * reporting keep that state in the objects the closures capture.
+ *
+ * Every worker has its own queue. Tasks submitted by a worker, like the
+ * subdirectories found while walking a tree, go to the back of its own
+ * queue; tasks submitted from outside are dealt to the queues in turn. A
+ * worker takes tasks from the front of its queue, and when it is empty
+ * steals from the back of the others, so that a job that fans out from a
+ * single task still spreads over every CPU.
+ *
+ * The pool is created on first use and never destroyed, the workers just go
+ * away with the process. */
+
+static thread_local int poolWorkerId = -1;
+
+/* Take a task, from our queue or stolen. Returns 0 if there is none. */
+static int poolTake(editorPool *pool, int id, std::function<void()> *task) {
+    for (int k = 0; k < pool->nworkers; k++) {
+        editorPoolQueue *q = &pool->queues[(id+k) % pool->nworkers];
+        std::lock_guard<std::mutex> lock(q->mutex);
+        if (q->tasks.empty()) continue;
+        if (k == 0) {
+            *task = std::move(q->tasks.front());
+            q->tasks.pop_front();
+        } else {
+            *task = std::move(q->tasks.back());
+            q->tasks.pop_back();
+        }
+        pool->queued--;
+        return 1;
+    }
+    return 0;
+}
+
+static void poolWorker(editorPool *pool, int id) {
+    poolWorkerId = id;
+    while (1) {
+        std::function<void()> task;
+        if (poolTake(pool,id,&task)) {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->cond.wait(lock, [pool] { return pool->queued > 0; });
+    }
+}
+
+editorPool *poolGet(void) {
+    static editorPool *pool = NULL;
+    if (pool == NULL) {
+        int n = std::thread::hardware_concurrency();
+        if (n <= 0) n = 2;
+        pool = new editorPool;
+        pool->nworkers = n;
+        pool->queues.reset(new editorPoolQueue[n]);
+        for (int j = 0; j < n; j++)
+            pool->workers.emplace_back(poolWorker,pool,j);
+    }
+    return pool;
+}
+
+void poolSubmit(editorPool *pool, std::function<void()> task) {
+    int id = poolWorkerId != -1 ? poolWorkerId : pool->next++ % pool->nworkers;
+    {
+        std::lock_guard<std::mutex> lock(pool->queues[id].mutex);
+        pool->queues[id].tasks.push_back(std::move(task));
+    }
+    pool->queued++;
+    /* Taking the mutex orders us with a worker about to sleep: it either
+     * sees 'queued' changed or is already waiting for the notify. */
+    { std::lock_guard<std::mutex> lock(pool->mutex); }
+    pool->cond.notify_one();
+}
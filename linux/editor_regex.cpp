@@ -0,0 +1,722 @@
+#include "editor.h"
+
+#include <map>
+#include <bitset>
+#include <algorithm>
+#include <string>
+
+/* ============================ Regular expressions ===========================
+ *
+ * A small regex engine that runs in time linear in the text, whatever the
+ * pattern. The pattern is parsed into a tree, compiled to a Thompson NFA
+ * (one for the pattern and one for the pattern reversed), and matched by
+ * lazily built DFAs whose states are sets of NFA instructions, created only
+ * when the text actually reaches them and kept in a bounded cache.
+ *
+ * Matches never cross a newline and, as POSIX says, are the leftmost ones
+ * and the longest of those. Each line is searched like this:
+ *
+ * 1. The forward DFA, unanchored, keeps its threads grouped by where they
+ *    started. Once a group matches, the later ones are dropped, and the scan
+ *    goes on until no group that started before it is left: that group has
+ *    the leftmost start, and the position where it matched is one end of a
+ *    match from there.
+ * 2. The reverse DFA, anchored at that end, runs backward to the leftmost
+ *    start, never going past the point where step 1 started.
+ * 3. A forward DFA anchored at that start runs to the longest end.
+ *
+ * The next search starts where the match ended. Bytes are scanned up to
+ * three times, more only where a match could still grow: steps 1 and 3
+ * read on until the DFA tells it can't.
+ *
+ * Supported syntax: literals, '.', [classes] with ranges and negation,
+ * \d \w \s \D \W \S and escaped metacharacters, grouping, '|', '*', '+',
+ * '?', and '^' / '$' anchors. Patterns that can match the empty
+ * string are rejected, since such matches are useless to a search. */
+
+#define RE_MAX_DFA_STATES 2048
+
+enum {
+    RE_NODE_SET,    /* One byte from a set. */
+    RE_NODE_CAT,
+    RE_NODE_ALT,
+    RE_NODE_STAR,
+    RE_NODE_PLUS,
+    RE_NODE_QUEST,
+    RE_NODE_BOL,
+    RE_NODE_EOL
+};
+
+struct reNode {
+    int type;
+    int set;                    /* RE_NODE_SET: index in regexProg.sets. */
+    std::vector<int> kids;
+};
+
+enum {
+    RE_OP_SET,      /* Consume a byte in sets[x], go to pc+1. */
+    RE_OP_SPLIT,    /* Go to x and y. */
+    RE_OP_JMP,      /* Go to x. */
+    RE_OP_BOL,      /* Continue at pc+1 only at the start of a line. */
+    RE_OP_EOL,      /* Continue at pc+1 only at the end of a line. */
+    RE_OP_MATCH
+};
+
+struct reInst {
+    int op, x, y;
+};
+
+struct regexProg {
+    std::vector<std::bitset<256>> sets;
+    std::vector<reNode> nodes;
+    std::vector<reInst> fwd, rev;   /* Forward and reversed programs. */
+    std::string prefix;             /* Literal every match starts with. */
+    int prefix_icase;
+};
+
+/* ------------------------------ Parser ------------------------------------ */
+
+struct reParser {
+    const char *p;
+    int icase;
+    const char *err;
+    regexProg *prog;
+};
+
+static int reNewNode(reParser *ps, int type) {
+    reNode n;
+    n.type = type;
+    n.set = -1;
+    ps->prog->nodes.push_back(n);
+    return ps->prog->nodes.size()-1;
+}
+
+/* Make both cases of every letter in the set match, in icase mode. */
+static void reFold(reParser *ps, std::bitset<256> &set) {
+    if (!ps->icase) return;
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (set[c] || set[toupper(c)]) {
+            set[c] = 1;
+            set[toupper(c)] = 1;
+        }
+    }
+}
+
+static int reNewSet(reParser *ps, std::bitset<256> set) {
+    reFold(ps,set);
+    set['\n'] = 0;
+    int n = reNewNode(ps,RE_NODE_SET);
+    ps->prog->sets.push_back(set);
+    ps->prog->nodes[n].set = ps->prog->sets.size()-1;
+    return n;
+}
+
+/* Set of bytes matched by the escape \c, for the class escapes. Returns 0
+ * if 'c' is not a class escape. */
+static int reClassEscape(int c, std::bitset<256> *set) {
+    int neg = isupper(c);
+    set->reset();
+    switch(tolower(c)) {
+    case 'd': for (int j = '0'; j <= '9'; j++) set->set(j); break;
+    case 'w': for (int j = 0; j < 256; j++) if (isalnum(j) || j == '_') set->set(j); break;
+    case 's': for (int j = 0; j < 256; j++) if (isspace(j)) set->set(j); break;
+    default: return 0;
+    }
+    if (neg) set->flip();
+    return 1;
+}
+
+static int reParseAlt(reParser *ps);
+
+static int reParseClass(reParser *ps) {
+    std::bitset<256> set;
+    int neg = 0;
+
+    if (*ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        int lo = (unsigned char)*ps->p++;
+        first = 0;
+        if (lo == '\\' && *ps->p) {
+            std::bitset<256> esc;
+            if (reClassEscape(*ps->p,&esc)) {
+                set |= esc;
+                ps->p++;
+                continue;
+            }
+            lo = (unsigned char)*ps->p++;
+        }
+        if (*ps->p == '-' && ps->p[1] && ps->p[1] != ']') {
+            int hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p) hi = (unsigned char)*ps->p++;
+            if (hi < lo) {
+                ps->err = "bad class range";
+                return -1;
+            }
+            for (int c = lo; c <= hi; c++) set.set(c);
+        } else {
+            set.set(lo);
+        }
+    }
+    if (*ps->p != ']') {
+        ps->err = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    if (neg) {
+        reFold(ps,set); /* So that [^a] excludes 'A' too. */
+        set.flip();
+    }
+    return reNewSet(ps,set);
+}
+
+static int reParseAtom(reParser *ps) {
+    std::bitset<256> set;
+    int c = (unsigned char)*ps->p++;
+
+    switch(c) {
+    case '(': {
+        int n = reParseAlt(ps);
+        if (n == -1) return -1;
+        if (*ps->p != ')') {
+            ps->err = "missing )";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    }
+    case '[':
+        return reParseClass(ps);
+    case '.':
+        set.set();
+        return reNewSet(ps,set);
+    case '^':
+        return reNewNode(ps,RE_NODE_BOL);
+    case '$':
+        return reNewNode(ps,RE_NODE_EOL);
+    case '\\':
+        if (*ps->p == '\0') {
+            ps->err = "trailing \\";
+            return -1;
+        }
+        c = (unsigned char)*ps->p++;
+        if (reClassEscape(c,&set)) return reNewSet(ps,set);
+        if (c == 't') c = '\t';
+        set.set(c);
+        return reNewSet(ps,set);
+    case '*': case '+': case '?':
+        ps->err = "nothing to repeat";
+        return -1;
+    default:
+        set.set(c);
+        return reNewSet(ps,set);
+    }
+}
+
+static int reParseRepeat(reParser *ps) {
+    int n = reParseAtom(ps);
+    if (n == -1) return -1;
+    while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+        int type = *ps->p == '*' ? RE_NODE_STAR :
+                   *ps->p == '+' ? RE_NODE_PLUS : RE_NODE_QUEST;
+        int r = reNewNode(ps,type);
+        ps->prog->nodes[r].kids.push_back(n);
+        n = r;
+        ps->p++;
+    }
+    return n;
+}
+
+static int reParseConcat(reParser *ps) {
+    int n = reNewNode(ps,RE_NODE_CAT);
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int k = reParseRepeat(ps);
+        if (k == -1) return -1;
+        ps->prog->nodes[n].kids.push_back(k);
+    }
+    return n;
+}
+
+static int reParseAlt(reParser *ps) {
+    int n = reParseConcat(ps);
+    if (n == -1 || *ps->p != '|') return n;
+
+    int alt = reNewNode(ps,RE_NODE_ALT);
+    ps->prog->nodes[alt].kids.push_back(n);
+    while (*ps->p == '|') {
+        ps->p++;
+        n = reParseConcat(ps);
+        if (n == -1) return -1;
+        ps->prog->nodes[alt].kids.push_back(n);
+    }
+    return alt;
+}
+
+/* Can the subtree match the empty string? */
+static int reNullable(regexProg *prog, int n) {
+    reNode &node = prog->nodes[n];
+    switch(node.type) {
+    case RE_NODE_SET: return 0;
+    case RE_NODE_CAT:
+        for (int k : node.kids) if (!reNullable(prog,k)) return 0;
+        return 1;
+    case RE_NODE_ALT:
+        for (int k : node.kids) if (reNullable(prog,k)) return 1;
+        return 0;
+    case RE_NODE_PLUS: return reNullable(prog,node.kids[0]);
+    default: return 1; /* STAR, QUEST, BOL, EOL */
+    }
+}
+
+/* ----------------------------- Compiler ----------------------------------- */
+
+/* Append the code for node 'n' to 'code'. With 'reverse' set, the program
+ * matches the reversed language: concatenations are emitted backward and
+ * the anchors swap role. */
+static void reEmit(regexProg *prog, std::vector<reInst> &code, int n, int reverse) {
+    reNode &node = prog->nodes[n];
+    size_t l1, l2;
+
+    switch(node.type) {
+    case RE_NODE_SET:
+        code.push_back({RE_OP_SET,node.set,0});
+        break;
+    case RE_NODE_BOL:
+        code.push_back({reverse ? RE_OP_EOL : RE_OP_BOL,0,0});
+        break;
+    case RE_NODE_EOL:
+        code.push_back({reverse ? RE_OP_BOL : RE_OP_EOL,0,0});
+        break;
+    case RE_NODE_CAT:
+        if (reverse) {
+            for (size_t k = node.kids.size(); k > 0; k--)
+                reEmit(prog,code,node.kids[k-1],reverse);
+        } else {
+            for (size_t k = 0; k < node.kids.size(); k++)
+                reEmit(prog,code,node.kids[k],reverse);
+        }
+        break;
+    case RE_NODE_ALT: {
+        /* SPLIT a, next; a: ...; JMP end; next: SPLIT b, ... */
+        std::vector<size_t> jumps;
+        for (size_t k = 0; k < node.kids.size(); k++) {
+            size_t split = code.size();
+            if (k+1 < node.kids.size()) code.push_back({RE_OP_SPLIT,0,0});
+            reEmit(prog,code,node.kids[k],reverse);
+            if (k+1 < node.kids.size()) {
+                jumps.push_back(code.size());
+                code.push_back({RE_OP_JMP,0,0});
+                code[split].x = split+1;
+                code[split].y = code.size();
+            }
+        }
+        for (size_t j : jumps) code[j].x = code.size();
+        break;
+    }
+    case RE_NODE_STAR:
+        l1 = code.size();
+        code.push_back({RE_OP_SPLIT,0,0});
+        reEmit(prog,code,node.kids[0],reverse);
+        code.push_back({RE_OP_JMP,(int)l1,0});
+        code[l1].x = l1+1;
+        code[l1].y = code.size();
+        break;
+    case RE_NODE_PLUS:
+        l1 = code.size();
+        reEmit(prog,code,node.kids[0],reverse);
+        code.push_back({RE_OP_SPLIT,(int)l1,0});
+        code.back().y = code.size();
+        break;
+    case RE_NODE_QUEST:
+        l2 = code.size();
+        code.push_back({RE_OP_SPLIT,0,0});
+        reEmit(prog,code,node.kids[0],reverse);
+        code[l2].x = l2+1;
+        code[l2].y = code.size();
+        break;
+    }
+}
+
+/* Compile 'pattern'. Returns NULL on error, storing a static description
+ * of the problem in '*err'. */
+regexProg *regexCompile(const char *pattern, int icase, const char **err) {
+    regexProg *prog = new regexProg;
+    reParser ps = {pattern,icase,NULL,prog};
+
+    int root = reParseAlt(&ps);
+    if (root != -1 && *ps.p) ps.err = "unmatched )";
+    if (!ps.err && reNullable(prog,root)) ps.err = "pattern matches empty text";
+    if (ps.err) {
+        if (err) *err = ps.err;
+        delete prog;
+        return NULL;
+    }
+    reEmit(prog,prog->fwd,root,0);
+    prog->fwd.push_back({RE_OP_MATCH,0,0});
+    reEmit(prog,prog->rev,root,1);
+    prog->rev.push_back({RE_OP_MATCH,0,0});
+    prog->nodes.clear();
+
+    /* The single byte sets the forward program starts with, if any, are a
+     * literal that regexFind() can skip to with searchMemmem(). Not done
+     * with '^' in the pattern, since line starts would then matter. */
+    int hasbol = 0;
+    for (auto &in : prog->fwd) if (in.op == RE_OP_BOL) hasbol = 1;
+    prog->prefix_icase = 0;
+    for (size_t pc = 0; !hasbol && pc < prog->fwd.size(); pc++) {
+        if (prog->fwd[pc].op != RE_OP_SET) break;
+        std::bitset<256> &set = prog->sets[prog->fwd[pc].x];
+        int c = 0;
+        while (!set[c]) c++;
+        if (set.count() == 2 && isupper(c) && set[tolower(c)])
+            prog->prefix_icase = 1;
+        else if (set.count() != 1)
+            break;
+        prog->prefix += (char)c;
+    }
+    return prog;
+}
+
+void regexFree(regexProg *prog) {
+    delete prog;
+}
+
+/* ----------------------------- Lazy DFA ----------------------------------- */
+
+/* A state is a list of groups of NFA instructions, each sorted and closed by
+ * RE_GROUP_END. Anchored DFAs have one group. The unanchored one starts a
+ * new group at every byte, so that a group holds the threads of one start,
+ * earliest first, a thread being only in the earliest group reaching it. The
+ * first group to reach MATCH drops the ones after it and no group is started
+ * anymore: the state then ends with RE_MATCHED, and its last group is the
+ * one that matched, kept even when its threads died. */
+#define RE_GROUP_END -1
+#define RE_MATCHED -2
+
+struct reDFA {
+    const regexProg *prog;
+    const std::vector<reInst> *code;
+    int unanchored;                 /* Start a group at every byte. */
+    std::map<std::vector<int>,int> cache;
+    std::vector<std::vector<int>> sets;   /* Groups of each state. */
+    std::vector<int> next;          /* 256 transitions per state, see below. */
+    std::vector<char> accept;       /* The last group reached MATCH. */
+    std::vector<char> accept_eol;   /* Some group reaches MATCH if the line
+                                       ends here. */
+    std::vector<char> decided;      /* Matched, and no group left before
+                                       the one that did. */
+    int start[2];                   /* Start state, not at / at line start. */
+    std::vector<int> mark;          /* Closure visit marks. */
+    int stamp;
+};
+
+/* Transitions are stored premultiplied (target*256) so that the hot loop is
+ * a single load per byte, and bitwise negated when the target accepts or is
+ * decided, so that a single sign test catches those and unknown transitions.
+ * Newline transitions are never stored: they always take the slow path. */
+#define RE_UNKNOWN INT_MIN
+
+static inline int reEncode(reDFA *d, int s) {
+    return d->accept[s] || d->decided[s] ? ~(s*256) : s*256;
+}
+
+static inline int reDecode(int n) {
+    return (n < 0 ? ~n : n) >> 8;
+}
+
+/* Regex matcher: the DFAs for a compiled program. Not thread safe, each
+ * thread searching with the same program needs its own matcher. */
+struct regexMatcher {
+    reDFA fwd, rev, longest;
+};
+
+static void reAddClosure(reDFA *d, std::vector<int> &out, int pc, int bol, int eol) {
+    if (d->mark[pc] == d->stamp) return;
+    d->mark[pc] = d->stamp;
+
+    const reInst &in = (*d->code)[pc];
+    switch(in.op) {
+    case RE_OP_JMP: reAddClosure(d,out,in.x,bol,eol); break;
+    case RE_OP_SPLIT:
+        reAddClosure(d,out,in.x,bol,eol);
+        reAddClosure(d,out,in.y,bol,eol);
+        break;
+    case RE_OP_BOL:
+        if (bol) reAddClosure(d,out,pc+1,bol,eol);
+        break;
+    case RE_OP_EOL:
+        /* Kept in the state so that the end of the line can resume it. */
+        out.push_back(pc);
+        if (eol) reAddClosure(d,out,pc+1,bol,eol);
+        break;
+    default:
+        out.push_back(pc);
+        break;
+    }
+}
+
+static void reReset(reDFA *d) {
+    d->cache.clear();
+    d->sets.clear();
+    d->next.clear();
+    d->accept.clear();
+    d->accept_eol.clear();
+    d->decided.clear();
+    d->start[0] = d->start[1] = -1;
+}
+
+/* Does the group set[from..to) hold MATCH, or reach it at the end of the
+ * line? Returns 2 or 1, or 0 for neither. */
+static int reGroupMatch(reDFA *d, const std::vector<int> &set, size_t from, size_t to) {
+    std::vector<int> eolset;
+    d->stamp++;
+    for (size_t j = from; j < to; j++) {
+        int op = (*d->code)[set[j]].op;
+        if (op == RE_OP_MATCH) return 2;
+        if (op == RE_OP_EOL) reAddClosure(d,eolset,set[j]+1,0,1);
+    }
+    for (int pc : eolset) if ((*d->code)[pc].op == RE_OP_MATCH) return 1;
+    return 0;
+}
+
+/* Return the state for the groups 'set', creating it if needed. */
+static int reIntern(reDFA *d, std::vector<int> &set) {
+    auto it = d->cache.find(set);
+    if (it != d->cache.end()) return it->second;
+
+    int s = d->sets.size();
+    int acc = 0, acc_eol = 0, groups = 0;
+    size_t from = 0;
+    for (size_t j = 0; j < set.size(); j++) {
+        if (set[j] != RE_GROUP_END) continue;
+        int match = reGroupMatch(d,set,from,j);
+        acc = match == 2;
+        acc_eol |= match != 0;
+        groups++;
+        from = j+1;
+    }
+
+    d->cache[set] = s;
+    d->sets.push_back(set);
+    d->next.resize(d->next.size()+256,RE_UNKNOWN);
+    d->accept.push_back(acc);
+    d->accept_eol.push_back(acc_eol);
+    d->decided.push_back(!set.empty() && set.back() == RE_MATCHED && groups == 1);
+    return s;
+}
+
+/* Close the group that starts at set[from], if it is not empty. */
+static int reCloseGroup(std::vector<int> &set, size_t from) {
+    if (set.size() == from) return 0;
+    std::sort(set.begin()+from,set.end());
+    set.push_back(RE_GROUP_END);
+    return 1;
+}
+
+static int reStart(reDFA *d, int bol) {
+    if (d->start[bol] == -1) {
+        std::vector<int> set;
+        d->stamp++;
+        reAddClosure(d,set,0,bol,0);
+        reCloseGroup(set,0);
+        d->start[bol] = reIntern(d,set);
+    }
+    return d->start[bol];
+}
+
+/* Compute the transition of state 's' on byte 'c'. The cache may be flushed
+ * in the process: only the returned state is valid afterwards. */
+static int reStepSlow(reDFA *d, int s, int c) {
+    const std::vector<int> cur = d->sets[s];
+    int matched = !cur.empty() && cur.back() == RE_MATCHED;
+    std::vector<int> set;
+    size_t from = 0;
+
+    /* A single stamp for all the groups: what an earlier group reached is
+     * not added again. */
+    d->stamp++;
+    for (size_t j = 0; j < cur.size() && cur[j] != RE_MATCHED; j++) {
+        int pc = cur[j];
+        if (pc != RE_GROUP_END) {
+            const reInst &in = (*d->code)[pc];
+            if (in.op == RE_OP_SET && d->prog->sets[in.x][c])
+                reAddClosure(d,set,pc+1,0,0);
+            continue;
+        }
+        int last = j+1 == cur.size() || cur[j+1] == RE_MATCHED;
+        int hasmatch = 0;
+        for (size_t k = from; k < set.size(); k++)
+            if ((*d->code)[set[k]].op == RE_OP_MATCH) hasmatch = 1;
+        if (!reCloseGroup(set,from)) {
+            /* Gone, but for the group that matched. */
+            if (matched && last) set.push_back(RE_GROUP_END);
+            continue;
+        }
+        from = set.size();
+        if (hasmatch && d->unanchored) {
+            matched = 1;
+            break;
+        }
+    }
+    if (d->unanchored && !matched) {
+        reAddClosure(d,set,0,0,0);
+        reCloseGroup(set,from);
+    }
+    if (matched) set.push_back(RE_MATCHED);
+
+    if (d->sets.size() >= RE_MAX_DFA_STATES) {
+        reReset(d);
+        return reIntern(d,set);
+    }
+    int n = reIntern(d,set);
+    if (c != '\n') d->next[s*256+c] = reEncode(d,n);
+    return n;
+}
+
+static inline int reStep(reDFA *d, int s, unsigned char c) {
+    int n = d->next[s*256+c];
+    return n != RE_UNKNOWN ? reDecode(n) : reStepSlow(d,s,c);
+}
+
+static int reIsDead(reDFA *d, int s) {
+    return d->sets[s].empty();
+}
+
+static void reInit(reDFA *d, const regexProg *prog, const std::vector<reInst> *code, int unanchored) {
+    d->prog = prog;
+    d->code = code;
+    d->unanchored = unanchored;
+    d->mark.assign(code->size(),0);
+    d->stamp = 0;
+    reReset(d);
+}
+
+regexMatcher *regexMatcherNew(const regexProg *prog) {
+    regexMatcher *m = new regexMatcher;
+    reInit(&m->fwd,prog,&prog->fwd,1);
+    reInit(&m->rev,prog,&prog->rev,0);
+    reInit(&m->longest,prog,&prog->fwd,0);
+    return m;
+}
+
+void regexMatcherFree(regexMatcher *m) {
+    delete m;
+}
+
+/* Find the first match in text[0..len) starting at or after 'from': the
+ * leftmost, and the longest of those. The text may contain many lines,
+ * matches never span a newline. Returns 1 and sets '*ms' / '*me' to the
+ * match bounds, or returns 0.
+ *
+ * The forward DFA runs over the whole text in a single loop: a newline just
+ * restarts it in its line start state, so there is no per line setup. */
+int regexFind(regexMatcher *m, const char *text, size_t len, size_t from,
+              size_t *ms, size_t *me)
+{
+    reDFA *f = &m->fwd, *r = &m->rev, *l = &m->longest;
+    const unsigned char *t = (const unsigned char*)text;
+    size_t ls = from, lo = from, i, end = 0;
+    int s, n, matched = 0;
+
+    while (ls > 0 && t[ls-1] != '\n') ls--;
+    s = reStart(f,from == ls);
+    const int *next = f->next.data();
+
+    /* Forward: where the leftmost match ends. The hot loop keeps the state
+     * premultiplied, as stored in the table. */
+    const std::string &prefix = f->prog->prefix;
+    for (i = from; i < len; i++) {
+        /* No match in progress: jump to the next occurrence of the prefix. */
+        if (!prefix.empty() && (s == f->start[0] || s == f->start[1])) {
+            const char *p = searchMemmem(text+i,len-i,prefix.c_str(),
+                prefix.size(),f->prog->prefix_icase);
+            size_t to = p ? (size_t)(p - text) : len;
+            const char *nl = (const char*)memrchr(text+i,'\n',to-i);
+            if (nl) ls = lo = nl - text + 1;
+            i = to;
+            s = reStart(f,i == ls);
+            next = f->next.data();
+            if (i == len) break;
+        }
+        int ps = s*256;
+        while ((n = next[ps+t[i]]) >= 0) {
+            ps = n;
+            if (++i == len) break;
+        }
+        s = ps >> 8;
+        if (i == len) break;
+        if (t[i] == '\n') {
+            if (f->accept_eol[s]) {
+                end = i;
+                goto found;
+            }
+            if (matched) goto found;
+            ls = lo = i+1;
+            s = reStart(f,1);
+            next = f->next.data();
+            continue;
+        }
+        if (n == RE_UNKNOWN) {
+            s = reStepSlow(f,s,t[i]);
+            next = f->next.data();
+        } else {
+            s = reDecode(n);
+        }
+        /* The group of the leftmost start so far matched, and when no group
+         * that started before it is left, that start is the leftmost. */
+        if (f->accept[s]) {
+            end = i+1;
+            matched = 1;
+        }
+        if (f->decided[s]) goto found;
+    }
+    if (f->accept_eol[s]) end = len;
+    else if (!matched) return 0;
+
+found:
+    /* Backward from the end, anchored: the leftmost start not before the
+     * point the forward scan started from in this line. */
+    size_t start = end;
+    s = reStart(r,end == len || t[end] == '\n');
+    for (i = end; i > lo; i--) {
+        s = reStep(r,s,t[i-1]);
+        if (reIsDead(r,s)) break;
+        if (r->accept[s] || (i-1 == ls && r->accept_eol[s])) start = i-1;
+    }
+    if (start == end) return 0; /* Can't happen: matches are never empty. */
+
+    /* Forward again from the start, anchored, to the longest end. */
+    s = reStart(l,start == ls);
+    for (i = start; i < len && t[i] != '\n'; i++) {
+        s = reStep(l,s,t[i]);
+        if (reIsDead(l,s)) break;
+        if (l->accept[s]) end = i+1;
+    }
+    if ((i == len || t[i] == '\n') && l->accept_eol[s]) end = i;
+    *ms = start;
+    *me = end;
+    return 1;
+}
+
+/* Append the bounds of every match in text[0..len), which must start at the
+ * beginning of a line, with offsets shifted by 'base'. */
+void regexFindAll(regexMatcher *m, const char *text, size_t len, size_t base,
+                  std::vector<size_t> *starts, std::vector<size_t> *lens)
+{
+    size_t from = 0, ms, me;
+    while (from <= len && regexFind(m,text,len,from,&ms,&me)) {
+        starts->push_back(base+ms);
+        lens->push_back(me-ms);
+        from = me;
+    }
+}
+
+/* The literal every match of 'prog' starts with. May be empty. */
+const char *regexPrefix(const regexProg *prog, size_t *len) {
+    *len = prog->prefix.size();
+    return prog->prefix.data();
+}
@@ -0,0 +1,113 @@
+#include "editor.h"
+
+/* ============================ Search and replace ============================
+ *
+ * editorReplaceAll() rewrites the document in a single pass: the search view
+ * is scanned once for matches, and every row containing some gets its new
+ * content built in one go, instead of deleting and inserting characters one
+ * at a time. The content of each changed row before and after goes in one
+ * undo bus, so a single undo reverts the whole replace. */
+
+static double replaceNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Replace every occurrence of 'pattern' with 'rep'. Returns the number of
+ * occurrences replaced, or -1 if 'pattern' is not valid. */
+long long editorReplaceAll(editorConfig *E, const char *pattern, const char *rep, int regex, int icase) {
+    editorSearch *s = &E->search;
+    regexMatcher *m = NULL;
+    regexProg *prog = NULL;
+    const char *err;
+    size_t plen = strlen(pattern), rlen = strlen(rep);
+
+    if (regex) {
+        if ((prog = regexCompile(pattern,icase,&err)) == NULL) {
+            editorSetStatusMessage(E,"Bad pattern: %s",err);
+            return -1;
+        }
+        m = regexMatcherNew(prog);
+    } else if (plen == 0) {
+        editorSetStatusMessage(E,"Empty pattern");
+        return -1;
+    }
+
+    /* The view is a snapshot of the rows: it stays valid, and the offsets of
+     * rowstart with it, while the rows are rewritten. */
+    searchViewUpdate(E);
+    std::shared_ptr<char> viewref = s->viewref;
+    std::vector<size_t> &rowstart = s->rowstart;
+    const char *view = s->view;
+    size_t len = s->len, pos = 0, copied = 0, ms, me;
+    long long count = 0, rows = 0;
+    long long row = -1;
+    UndoCommandBus bus;
+    std::string buf;
+    double last = replaceNow();
+
+    auto rowEnd = [&](long long r) {
+        return r+1 < (long long)rowstart.size() ? rowstart[r+1]-1 : len-1;
+    };
+    auto flush = [&]() {
+        if (row == -1) return;
+        buf.append(view+copied,rowEnd(row)-copied);
+        std::shared_ptr<UndoRowText> text = std::make_shared<UndoRowText>();
+        text->before.assign(view+rowstart[row],rowEnd(row)-rowstart[row]);
+        text->after.swap(buf);
+        editorRowSetChars(E,&E->row[row],text->after.data(),text->after.size());
+        UndoCommand cmd;
+        cmd.ID = UNDO_CMD_REPLACE_ROW;
+        cmd.pos = {0,row};
+        cmd.text = text;
+        bus.push_back(cmd);
+        buf.clear();
+        rows++;
+    };
+
+    while (pos < len) {
+        if (regex) {
+            if (!regexFind(m,view,len,pos,&ms,&me)) break;
+        } else {
+            const char *p = searchMemmem(view+pos,len-pos,pattern,plen,icase);
+            if (p == NULL) break;
+            ms = p - view;
+            me = ms + plen;
+        }
+        if (row == -1 || ms > rowEnd(row)) {
+            flush();
+            row = searchViewRow(E,ms);
+            copied = rowstart[row];
+        }
+        buf.append(view+copied,ms-copied);
+        buf.append(rep,rlen);
+        copied = pos = me;
+
+        if ((++count & 1023) == 0 && replaceNow()-last > 0.1) {
+            editorSetStatusMessage(E,"Replacing... %d%% (%lld so far)",
+                (int)(ms*100/len),count);
+            editorRefreshScreen(E);
+            last = replaceNow();
+        }
+    }
+    flush();
+
+    if (m) regexMatcherFree(m);
+    if (prog) regexFree(prog);
+    if (count) PushCommandBus(E,std::move(bus));
+
+    /* Keep the cursor inside the row it is on, that may have shrunk. */
+    long long filerow = E->rowoff+E->cy;
+    if (filerow < E->numrows && E->coloff+E->cx > E->row[filerow].size) {
+        long long size = E->row[filerow].size;
+        E->coloff = 0;
+        E->cx = size;
+        if (size > E->screencols-1) {
+            E->coloff = size-E->screencols+1;
+            E->cx = E->screencols-1;
+        }
+    }
+    editorSetStatusMessage(E,"Replaced %lld occurrences in %lld lines",count,rows);
+    return count;
+}
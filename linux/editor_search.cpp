@@ -0,0 +1,461 @@
+#include "editor.h"
+
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SEARCH_HAVE_AVX2
+#endif
+
+/* ============================= Substring search =============================
+ *
+ * searchMemmem() is a SIMD first/last byte filter: for 16 candidate positions
+ * at a time we compare the first needle byte with hay[i..i+15] and the last
+ * needle byte with hay[i+m-1..i+m+14], and only positions where both match
+ * are verified with a full compare. On text this rejects almost everything
+ * with two loads and two compares per 16 bytes.
+ *
+ * In case insensitive mode the filter compares against both the lower and
+ * the upper case version of the two bytes. When the CPU supports AVX2 the
+ * same filter runs 32 positions at a time. */
+
+static int searchEqual(const char *a, const char *b, size_t len, int icase) {
+    if (!icase) return memcmp(a,b,len) == 0;
+    for (size_t j = 0; j < len; j++)
+        if (tolower((unsigned char)a[j]) != tolower((unsigned char)b[j]))
+            return 0;
+    return 1;
+}
+
+#ifdef SEARCH_HAVE_AVX2
+/* AVX2 version of the filter. Returns the first match among the positions
+ * it covers, or NULL storing in '*scanned' where the caller must continue. */
+__attribute__((target("avx2")))
+static const char *searchFilterAvx2(const char *hay, size_t n, const char *needle, size_t m, int icase, size_t *scanned) {
+    unsigned char f = needle[0], l = needle[m-1];
+    const __m256i flo = _mm256_set1_epi8(icase ? tolower(f) : f);
+    const __m256i fup = _mm256_set1_epi8(icase ? toupper(f) : f);
+    const __m256i llo = _mm256_set1_epi8(icase ? tolower(l) : l);
+    const __m256i lup = _mm256_set1_epi8(icase ? toupper(l) : l);
+    size_t i = 0;
+
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i first = _mm256_loadu_si256((const __m256i*)(hay+i));
+        __m256i last = _mm256_loadu_si256((const __m256i*)(hay+i+m-1));
+        __m256i eqf = _mm256_or_si256(_mm256_cmpeq_epi8(first,flo),_mm256_cmpeq_epi8(first,fup));
+        __m256i eql = _mm256_or_si256(_mm256_cmpeq_epi8(last,llo),_mm256_cmpeq_epi8(last,lup));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(eqf,eql));
+        while (mask) {
+            unsigned int bit = __builtin_ctz(mask);
+            if (m <= 2 || searchEqual(hay+i+bit+1,needle+1,m-2,icase))
+                return hay+i+bit;
+            mask &= mask-1;
+        }
+    }
+    *scanned = i;
+    return NULL;
+}
+#endif
+
+/* Return a pointer to the first occurrence of 'needle' in 'hay', or NULL. */
+const char *searchMemmem(const char *hay, size_t n, const char *needle, size_t m, int icase) {
+    size_t i = 0;
+
+    if (m == 0) return hay;
+    if (m > n) return NULL;
+    if (m == 1 && !icase) return (const char*)memchr(hay,needle[0],n);
+
+#ifdef SEARCH_HAVE_AVX2
+    static int avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        const char *p = searchFilterAvx2(hay,n,needle,m,icase,&i);
+        if (p) return p;
+    }
+#endif
+
+#ifdef __SSE2__
+    unsigned char f = needle[0], l = needle[m-1];
+    const __m128i flo = _mm_set1_epi8(tolower(f)), fup = _mm_set1_epi8(toupper(f));
+    const __m128i llo = _mm_set1_epi8(tolower(l)), lup = _mm_set1_epi8(toupper(l));
+    const __m128i fcs = _mm_set1_epi8(f), lcs = _mm_set1_epi8(l);
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i first = _mm_loadu_si128((const __m128i*)(hay+i));
+        __m128i last = _mm_loadu_si128((const __m128i*)(hay+i+m-1));
+        __m128i eqf, eql;
+        if (icase) {
+            eqf = _mm_or_si128(_mm_cmpeq_epi8(first,flo),_mm_cmpeq_epi8(first,fup));
+            eql = _mm_or_si128(_mm_cmpeq_epi8(last,llo),_mm_cmpeq_epi8(last,lup));
+        } else {
+            eqf = _mm_cmpeq_epi8(first,fcs);
+            eql = _mm_cmpeq_epi8(last,lcs);
+        }
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(eqf,eql));
+        while (mask) {
+            unsigned int bit = __builtin_ctz(mask);
+            if (m <= 2 || searchEqual(hay+i+bit+1,needle+1,m-2,icase))
+                return hay+i+bit;
+            mask &= mask-1;
+        }
+    }
+#endif
+
+    /* Tail, or the whole buffer without SSE2. */
+    if (!icase) return (const char*)memmem(hay+i,n-i,needle,m);
+    for (; i + m <= n; i++)
+        if (searchEqual(hay+i,needle,m,icase)) return hay+i;
+    return NULL;
+}
+
+/* Return a pointer to the last occurrence of 'needle' in 'hay', or NULL.
+ * The buffer is walked backward in windows, each one scanned forward. */
+const char *searchMemmemLast(const char *hay, size_t n, const char *needle, size_t m, int icase) {
+    const size_t window = 1<<16;
+    size_t hi = n;
+
+    if (m > n) return NULL;
+    while (hi > 0) {
+        size_t lo = hi > window ? hi - window : 0;
+        size_t end = std::min(n, hi + m - 1);
+        const char *p = hay + lo, *last = NULL;
+
+        while ((p = searchMemmem(p, end - (p - hay), needle, m, icase)) != NULL) {
+            if ((size_t)(p - hay) >= hi) break;
+            last = p++;
+        }
+        if (last) return last;
+        hi = lo;
+    }
+    return NULL;
+}
+
+/* Rebuild the contiguous search view if the document changed since the
+ * last time it was built. */
+void searchViewUpdate(editorConfig *E) {
+    editorSearch *s = &E->search;
+    size_t len = 0;
+    char *p;
+
+    if (s->view && s->version == E->version) return;
+    searchCancel(E);
+    for (long long j = 0; j < E->numrows; j++) len += E->row[j].size+1;
+    /* Jobs still running on the old view keep it alive via their own ref. */
+    s->view = p = (char*)malloc(len+1);
+    s->viewref.reset(s->view,free);
+    s->rowstart.resize(E->numrows);
+    for (long long j = 0; j < E->numrows; j++) {
+        s->rowstart[j] = p - s->view;
+        memcpy(p,E->row[j].chars,E->row[j].size);
+        p += E->row[j].size;
+        *p++ = '\n';
+    }
+    *p = '\0';
+    s->len = len;
+    s->version = E->version;
+}
+
+/* Return the row containing the view offset 'off'. */
+long long searchViewRow(editorConfig *E, size_t off) {
+    std::vector<size_t> &rs = E->search.rowstart;
+    return std::upper_bound(rs.begin(),rs.end(),off) - rs.begin() - 1;
+}
+
+struct searchJob {
+    std::shared_ptr<char> viewref;
+    const char *view;
+    char query[KILO_QUERY_LEN+1];
+    int qlen, icase;
+    std::shared_ptr<regexProg> re;  /* Set in regex mode. */
+    unsigned long long version;
+    std::vector<size_t> bounds;     /* Chunk k is view[bounds[k]..bounds[k+1]). */
+    std::vector<std::vector<size_t>> results, lens;
+    std::unique_ptr<std::atomic<int>[]> done;
+    std::atomic<int> cancel{0};
+    std::atomic<int> overflow{0};
+    std::atomic<size_t> total{0};
+    int collected = 0;              /* Chunks moved to E->search.matches. */
+};
+
+/* Worker side of a search job: collect every occurrence starting in chunk
+ * 'k'. Chunks end on line boundaries and matches never contain a newline,
+ * so there is nothing to look for across them. */
+static void searchChunk(std::shared_ptr<searchJob> job, int k) {
+    std::vector<size_t> found, lens;
+
+    if (!job->cancel.load(std::memory_order_relaxed)) {
+        const char *p = job->view + job->bounds[k];
+        const char *end = job->view + job->bounds[k+1];
+        if (job->re) {
+            regexMatcher *m = regexMatcherNew(job->re.get());
+            regexFindAll(m,p,end-p,p-job->view,&found,&lens);
+            regexMatcherFree(m);
+        } else {
+            while ((p = searchMemmem(p,end-p,job->query,job->qlen,job->icase))) {
+                found.push_back(p - job->view);
+                p++;
+            }
+        }
+        if (job->total.fetch_add(found.size()) + found.size() > SEARCH_MAX_MATCHES) {
+            job->overflow = 1;
+            job->cancel = 1;
+        }
+    }
+    job->results[k] = std::move(found);
+    job->lens[k] = std::move(lens);
+    job->done[k].store(1,std::memory_order_release);
+}
+
+/* Stop the running scan, if any. Workers notice it at the next chunk. */
+void searchCancel(editorConfig *E) {
+    editorSearch *s = &E->search;
+    if (!s->job) return;
+    s->job->cancel = 1;
+    s->job.reset();
+    s->matches.clear();
+    s->matchlen.clear();
+    s->qlen = -1;
+    s->covered = 0;
+}
+
+/* Move the chunks completed in order by the running job into 'matches'.
+ * Returns 1 when 'matches' holds every occurrence of the current query, 0
+ * while the scan is still running or if it overflowed. If 'count' is not
+ * NULL it is set to the number of matches found so far. */
+int searchCollect(editorConfig *E, size_t *count) {
+    editorSearch *s = &E->search;
+    std::shared_ptr<searchJob> job = s->job;
+
+    if (count) *count = s->matches.size();
+    if (!job) return s->qlen != -1;
+
+    int nchunks = job->bounds.size()-1;
+    while (job->collected < nchunks &&
+           job->done[job->collected].load(std::memory_order_acquire))
+    {
+        std::vector<size_t> &r = job->results[job->collected];
+        std::vector<size_t> &l = job->lens[job->collected];
+        s->matches.insert(s->matches.end(),r.begin(),r.end());
+        s->matchlen.insert(s->matchlen.end(),l.begin(),l.end());
+        std::vector<size_t>().swap(r);
+        std::vector<size_t>().swap(l);
+        job->collected++;
+    }
+    s->covered = job->bounds[job->collected];
+
+    if (job->overflow) {
+        memcpy(s->query,job->query,job->qlen+1);
+        s->qicase = job->icase;
+        s->qregex = job->re != NULL;
+        s->qversion = job->version;
+        s->job.reset();
+        s->matches.clear();
+        s->matches.shrink_to_fit();
+        s->matchlen.clear();
+        s->matchlen.shrink_to_fit();
+        s->overflow = 1;
+        if (count) *count = job->total;
+        return 0;
+    }
+    if (job->collected == nchunks) {
+        memcpy(s->query,job->query,job->qlen+1);
+        s->qlen = job->qlen;
+        s->qicase = job->icase;
+        s->qregex = job->re != NULL;
+        s->qversion = job->version;
+        s->job.reset();
+        if (count) *count = s->matches.size();
+        return 1;
+    }
+    if (count) {
+        *count = s->matches.size();
+        for (int k = job->collected; k < nchunks; k++)
+            if (job->done[k].load(std::memory_order_acquire))
+                *count += job->results[k].size();
+    }
+    return 0;
+}
+
+/* Length of the match at index 'idx' of 'matches'. */
+size_t searchMatchLen(editorConfig *E, size_t idx) {
+    editorSearch *s = &E->search;
+    return s->qregex ? s->matchlen[idx] : (size_t)s->qlen;
+}
+
+/* In regex mode make sure s->re is the compiled query. Returns 0 if the
+ * query is not a valid expression, leaving the reason in s->reerr. */
+static int searchCompile(editorConfig *E, const char *query) {
+    editorSearch *s = &E->search;
+
+    if (s->re && s->reicase == s->icase && !strcmp(s->repattern,query))
+        return 1;
+    if (s->rm) regexMatcherFree(s->rm);
+    s->rm = NULL;
+    s->re.reset();
+    snprintf(s->repattern,sizeof(s->repattern),"%s",query);
+    s->reicase = s->icase;
+    s->reerr = NULL;
+    regexProg *prog = regexCompile(query,s->icase,&s->reerr);
+    if (!prog) return 0;
+    s->re.reset(prog,regexFree);
+    s->rm = regexMatcherNew(prog);
+    return 1;
+}
+
+/* Bring E->search.matches up to date for 'query'. If the view did not change
+ * and the previous literal query is a prefix of this one, the old matches are
+ * the only candidates: each is re-verified on the bytes the query grew by.
+ * Otherwise the trigram index of big files may restrict the search to some
+ * lines, and failing that (regex mode, new document version, case mode
+ * switch, backspace...) a parallel scan of the whole view is started and
+ * searchCollect() reports its progress.
+ * Returns 1 if 'matches' already holds every occurrence, 0 otherwise. */
+int searchUpdateMatches(editorConfig *E, const char *query, int qlen) {
+    editorSearch *s = &E->search;
+
+    searchViewUpdate(E);
+    if (s->regex && !searchCompile(E,query)) {
+        searchCancel(E);
+        s->matches.clear();
+        s->matchlen.clear();
+        s->qlen = -1;
+        s->overflow = 0;
+        return 1; /* Nothing can match an invalid expression. */
+    }
+    if (s->job) {
+        searchJob *job = s->job.get();
+        if (job->qlen == qlen && job->icase == s->icase &&
+            (job->re != NULL) == s->regex &&
+            !memcmp(job->query,query,qlen)) return searchCollect(E,NULL);
+        searchCancel(E);
+    }
+    if (s->overflow && s->qversion == s->version && s->qicase == s->icase &&
+        s->qregex == s->regex && !strcmp(s->query,query)) return 0;
+    if (s->qlen != -1 && s->qversion == s->version && s->qicase == s->icase &&
+        s->qregex == s->regex && s->qlen == qlen && !strcmp(s->query,query))
+        return 1;
+    if (s->qlen != -1 && s->qversion == s->version && s->qicase == s->icase &&
+        !s->regex && !s->qregex && s->qlen < qlen &&
+        searchEqual(s->query,query,s->qlen,0))
+    {
+        size_t kept = 0, grow = qlen - s->qlen;
+        for (size_t j = 0; j < s->matches.size(); j++) {
+            size_t off = s->matches[j] + s->qlen;
+            if (off + grow <= s->len &&
+                searchEqual(s->view+off,query+s->qlen,grow,s->icase))
+                s->matches[kept++] = s->matches[j];
+        }
+        s->matches.resize(kept);
+        memcpy(s->query,query,qlen);
+        s->query[qlen] = '\0';
+        s->qlen = qlen;
+        return 1;
+    }
+
+    /* Big files: the trigram index may point at the few lines to check. */
+    if (trigramSearch(E,query,qlen)) return 1;
+
+    /* Full scan: split the view in line aligned chunks, one task each. */
+    std::shared_ptr<searchJob> job = std::make_shared<searchJob>();
+    size_t off = 0;
+
+    job->viewref = s->viewref;
+    job->view = s->view;
+    memcpy(job->query,query,qlen);
+    job->query[qlen] = '\0';
+    job->qlen = qlen;
+    job->icase = s->icase;
+    if (s->regex) job->re = s->re;
+    job->version = s->version;
+    job->bounds.push_back(0);
+    while (off < s->len) {
+        off += SEARCH_CHUNK_SIZE;
+        if (off >= s->len) {
+            off = s->len;
+        } else {
+            const char *nl = (const char*)memchr(s->view+off,'\n',s->len-off);
+            off = nl ? nl - s->view + 1 : s->len;
+        }
+        job->bounds.push_back(off);
+    }
+    int nchunks = job->bounds.size()-1;
+    job->results.resize(nchunks);
+    job->lens.resize(nchunks);
+    job->done.reset(new std::atomic<int>[nchunks]);
+    for (int k = 0; k < nchunks; k++) job->done[k] = 0;
+
+    s->matches.clear();
+    s->matchlen.clear();
+    s->qlen = -1;
+    s->qregex = s->regex;
+    s->covered = 0;
+    s->overflow = 0;
+    s->job = job;
+    editorPool *pool = poolGet();
+    for (int k = 0; k < nchunks; k++)
+        poolSubmit(pool,[job,k] { searchChunk(job,k); });
+    return searchCollect(E,NULL);
+}
+
+/* Search the view directly, without the match index, for the first match
+ * after offset 'from' (dir == 1) or the last one before it (dir == -1),
+ * wrapping around. Used when there are too many matches to index. Returns 1
+ * and sets the match offset and length, or returns 0. */
+int searchDirect(editorConfig *E, const char *query, int qlen, long long from,
+                 int dir, size_t *ms, size_t *mlen)
+{
+    editorSearch *s = &E->search;
+    const char *view = s->view, *match = NULL;
+    size_t len = s->len, me;
+
+    if (s->regex) {
+        if (!s->rm) return 0;
+        if (dir == 1) {
+            if (regexFind(s->rm,view,len,from+1,ms,&me) ||
+                regexFind(s->rm,view,len,0,ms,&me))
+            {
+                *mlen = me - *ms;
+                return 1;
+            }
+            return 0;
+        }
+        /* Backward: matches don't span lines, so walk the lines backward
+         * keeping the last match of each that starts before 'from'. */
+        size_t limit = from < 0 ? len : from;
+        for (int pass = 0; pass < 2; pass++) {
+            long long row = searchViewRow(E,limit ? limit-1 : 0);
+            for (; row >= 0; row--) {
+                size_t pos = s->rowstart[row], fs, fe;
+                size_t le = row+1 < (long long)s->rowstart.size() ?
+                            s->rowstart[row+1]-1 : len;
+                int found = 0;
+                while (pos <= le && regexFind(s->rm,view,le,pos,&fs,&fe) &&
+                       fs < limit)
+                {
+                    *ms = fs;
+                    *mlen = fe - fs;
+                    found = 1;
+                    pos = fe;
+                }
+                if (found) return 1;
+            }
+            limit = len;
+        }
+        return 0;
+    }
+
+    if (dir == 1) {
+        size_t start = from + 1;
+        match = searchMemmem(view+start,len-start,query,qlen,s->icase);
+        if (!match) match = searchMemmem(view,len,query,qlen,s->icase);
+    } else {
+        size_t to = from + qlen - 1;
+        match = searchMemmemLast(view,to,query,qlen,s->icase);
+        if (!match) match = searchMemmemLast(view,len,query,qlen,s->icase);
+    }
+    if (!match) return 0;
+    *ms = match - view;
+    *mlen = qlen;
+    return 1;
+}
@@ -0,0 +1,190 @@
+#include "editor.h"
+
+/* ============================== Frame statistics ============================
+ *
+ * Every frame the main loop draws is timed phase by phase:
+ *
+ *  read    the key from its first byte to its decoding (an ESC alone waits
+ *          for the timeout that tells it from an escape sequence)
+ *  key     the key decoded to the frame started: editorProcessKeypress
+ *  hl      syntax highlighting since the frame before, during the key or
+ *          while drawing, so it is part of one of the two other phases too
+ *  build   the frame started to its bytes ready
+ *  write   the write() of the frame to the terminal
+ *  frame   the key's first byte to the frame written, end to end
+ *
+ * Frames not caused by a key, as refreshes of a search in progress, only
+ * count for hl, build and write. The times go in histograms of log spaced
+ * buckets, eight per power of two, so percentiles are good to 1/8. The
+ * bytes written per frame are kept the same way.
+ *
+ * ":stats" shows the last and 99th percentile of every phase in the
+ * message row, and "texed --stats <file>" writes the histograms to the
+ * file on exit. There is one terminal per process, so the state is too. */
+
+#define STATS_BUCKETS 496   /* Enough for any 64 bit value. */
+
+struct statsHist {
+    uint64_t count, sum, max, last;
+    uint64_t bucket[STATS_BUCKETS];
+};
+
+static const char *statsNames[STATS_PHASES] = {
+    "read","key","hl","build","write","frame"
+};
+
+static struct {
+    statsHist phase[STATS_PHASES];
+    statsHist bytes;        /* Written per frame. */
+    uint64_t keyfirst;      /* First byte of the key not drawn yet, 0 if none. */
+    uint64_t keyread;       /* And when it was decoded. */
+    uint64_t hl;            /* Highlighting since the last frame. */
+    int overlay;            /* Show the stats in the message row. */
+    char *dumpfile;         /* Where to write them on exit, or NULL. */
+} Stats;
+
+uint64_t statsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* Values below 8 have a bucket each, then every power of two is split in
+ * eight by the three bits after the leading one. */
+static int statsBucket(uint64_t v) {
+    if (v < 8) return v;
+    int e = 63-__builtin_clzll(v);
+    return (e-2)*8 + ((v >> (e-3)) & 7);
+}
+
+static uint64_t statsBucketStart(int b) {
+    if (b < 8) return b;
+    int e = b/8+2;
+    return (uint64_t)(8 + b%8) << (e-3);
+}
+
+static void statsAdd(statsHist *h, uint64_t v) {
+    h->count++;
+    h->sum += v;
+    h->last = v;
+    if (v > h->max) h->max = v;
+    h->bucket[statsBucket(v)]++;
+}
+
+/* The value below which a fraction 'p' of the ones added are: the end of
+ * its bucket, but never past the largest. */
+static uint64_t statsPercentile(statsHist *h, double p) {
+    uint64_t rank = (uint64_t)(p*h->count), seen = 0;
+
+    if (h->count == 0) return 0;
+    if (rank >= h->count) rank = h->count-1;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen > rank) {
+            uint64_t end = b+1 < STATS_BUCKETS ? statsBucketStart(b+1)-1 : h->max;
+            return end < h->max ? end : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* A key was read: its first byte came at 'first', it was decoded now. */
+void statsKeyRead(uint64_t first) {
+    uint64_t now = statsNow();
+    statsAdd(&Stats.phase[STATS_READ],now-first);
+    /* Keys handled without a frame, as the ones of a prompt, all count as
+     * the first one. */
+    if (Stats.keyfirst == 0) {
+        Stats.keyfirst = first;
+        Stats.keyread = now;
+    }
+}
+
+/* Highlighting that started at 'start' is done. */
+void statsHighlighted(uint64_t start) {
+    Stats.hl += statsNow()-start;
+}
+
+/* A frame of 'bytes' bytes started at 'start' and was written from 'write'
+ * to now. */
+void statsFrame(uint64_t start, uint64_t write, size_t bytes) {
+    uint64_t now = statsNow();
+
+    if (Stats.keyfirst) {
+        statsAdd(&Stats.phase[STATS_KEY],start-Stats.keyread);
+        statsAdd(&Stats.phase[STATS_FRAME],now-Stats.keyfirst);
+        Stats.keyfirst = 0;
+    }
+    statsAdd(&Stats.phase[STATS_HL],Stats.hl);
+    statsAdd(&Stats.phase[STATS_BUILD],write-start);
+    statsAdd(&Stats.phase[STATS_WRITE],now-write);
+    statsAdd(&Stats.bytes,bytes);
+    Stats.hl = 0;
+}
+
+void statsToggleOverlay(editorConfig *E) {
+    Stats.overlay = !Stats.overlay;
+    editorSetStatusMessage(E,"Frame statistics %s",Stats.overlay ? "on" : "off");
+}
+
+/* Write the text of the overlay in 'buf': the last and 99th percentile of
+ * the phases, in milliseconds, and of the bytes per frame. Returns its
+ * length, 0 if the overlay is off. */
+int statsOverlay(char *buf, size_t len) {
+    size_t used = 0;
+
+    if (!Stats.overlay || len == 0) return 0;
+    buf[0] = '\0';
+    for (int j = 0; j < STATS_PHASES && used < len; j++) {
+        statsHist *h = &Stats.phase[j];
+        used += snprintf(buf+used,len-used,"%s %.2f/%.2f ",statsNames[j],
+                         h->last/1e6,statsPercentile(h,0.99)/1e6);
+    }
+    if (used < len)
+        used += snprintf(buf+used,len-used,"ms, %.1f/%.1f KB",
+                         Stats.bytes.last/1024.0,
+                         statsPercentile(&Stats.bytes,0.99)/1024.0);
+    return used < len ? used : len-1;
+}
+
+void statsDumpTo(const char *filename) {
+    free(Stats.dumpfile);
+    Stats.dumpfile = strdup(filename);
+}
+
+static void statsDumpHist(FILE *fp, const char *name, statsHist *h, double unit) {
+    fprintf(fp,"%-6s %10llu %12.3f %12.3f %12.3f %12.3f %12.3f\n",name,
+        (unsigned long long)h->count,
+        h->count ? (double)h->sum/h->count/unit : 0.0,
+        statsPercentile(h,0.5)/unit,statsPercentile(h,0.9)/unit,
+        statsPercentile(h,0.99)/unit,h->max/unit);
+}
+
+/* Write the histograms to the file given with statsDumpTo(), if any: a
+ * summary of every phase in microseconds, then the count of every bucket
+ * not empty. Returns -1 on errors. */
+int statsDump(void) {
+    if (Stats.dumpfile == NULL) return 0;
+    FILE *fp = fopen(Stats.dumpfile,"w");
+    if (fp == NULL) return -1;
+
+    fprintf(fp,"# times in microseconds, bytes per frame\n");
+    fprintf(fp,"%-6s %10s %12s %12s %12s %12s %12s\n",
+        "phase","count","mean","p50","p90","p99","max");
+    for (int j = 0; j < STATS_PHASES; j++)
+        statsDumpHist(fp,statsNames[j],&Stats.phase[j],1e3);
+    statsDumpHist(fp,"bytes",&Stats.bytes,1);
+
+    fprintf(fp,"\n# phase, bucket start, bucket end (excluded), count\n");
+    for (int j = 0; j <= STATS_PHASES; j++) {
+        statsHist *h = j < STATS_PHASES ? &Stats.phase[j] : &Stats.bytes;
+        const char *name = j < STATS_PHASES ? statsNames[j] : "bytes";
+        double unit = j < STATS_PHASES ? 1e3 : 1;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (h->bucket[b] == 0) continue;
+            fprintf(fp,"%s %.3f %.3f %llu\n",name,statsBucketStart(b)/unit,
+                statsBucketStart(b+1)/unit,(unsigned long long)h->bucket[b]);
+        }
+    }
+    return fclose(fp) == EOF ? -1 : 0;
+}
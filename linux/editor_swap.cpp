@@ -0,0 +1,496 @@
+#include "editor.h"
+#include <chrono>
+
+/* ============================== Crash recovery ==============================
+ *
+ * Every change to the rows is logged as a row operation to a swap file kept
+ * along the edited one, .<name>.swp, so that the unsaved changes survive the
+ * editor or the terminal dying. The file is:
+ *
+ *   header   "TXSWAP3\0", uint64 base, uint64 tailrow, uint64 tailoff
+ *   frames   uint64 length, uint64 hash of the payload,
+ *            payload: ops, each uint8 op, uint64 row, uint64 len, content.
+ *
+ * The ops apply to the file whose content hashes to 'base', or, if tailrow
+ * is not SWAP_WHOLE, to the rows before 'tailrow' of a file whose first
+ * 'tailoff' bytes hash to 'base', whatever follows them: see below.
+ *
+ * Logging only appends the op to an in memory batch. A writer thread commits
+ * the batch as one frame every SWAP_COMMIT_MS, or as soon as it grows past
+ * SWAP_BATCH_MAX, followed by a single fdatasync(2): heavy typing costs one
+ * write per batch, not one per key. Consecutive changes to the same short
+ * row in a batch are merged, so the batch holds it once at most. Edits to a
+ * long row log the bytes changed instead of the row, see swapLogSplice().
+ *
+ * A frame torn by a crash fails its hash, and recovery stops there. When the
+ * file is saved the swap starts over from the new content. The ops logged
+ * while the save runs apply to the snapshot it writes, so they are kept
+ * aside as well: once the save is done they are the new swap as they are,
+ * nothing is logged again.
+ *
+ * A save in place rewrites the file from a checkpoint on, and a crash midway
+ * leaves a file that is neither the old content nor the new. So before it
+ * writes, the save has the writer start the swap over from the rows before
+ * the checkpoint, which it leaves alone, with the rows it is about to write
+ * as the first ops: the swap then applies to the old file, the new one, and
+ * anything torn in between. */
+
+/* Ops in the format of a frame payload. */
+struct swapBatch {
+    std::string ops;
+    size_t lastop = std::string::npos; /* Offset of the last op. */
+    long long lastrow = -1; /* And the row it is about. */
+};
+
+struct swapHeader {
+    char magic[8];
+    uint64_t base;
+    uint64_t tailrow;
+    uint64_t tailoff;
+};
+
+struct swapFrame {
+    uint64_t len;
+    uint64_t hash;
+};
+
+struct swapWriter {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    swapBatch pending;      /* Ops not yet committed. */
+    int saving = 0;         /* A save runs: ops go to aftersave too. */
+    swapBatch aftersave;    /* Ops since the snapshot of that save. */
+    int rebase = 1;         /* Start the file over before the next frame. */
+    uint64_t base = 0;      /* Content hash the ops apply to. */
+    editorSaveJob *tail = NULL; /* Save in place waiting for its rows to
+                                   be committed, see swapSaveTail(). */
+    std::condition_variable taildone;
+    int stop = 0;
+    int exited = 0;         /* The writer thread is gone. */
+    std::string path;
+
+    /* Only used by the writer thread. */
+    int fd = -1;
+    swapHeader fileh;       /* Header of the file. */
+    int broken = 0;         /* Some write failed: the swap is gone. */
+};
+
+static int swapWriteAll(int fd, const void *buf, size_t len) {
+    const char *p = (const char*)buf;
+    while (len) {
+        ssize_t nw = write(fd,p,len);
+        if (nw == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += nw;
+        len -= nw;
+    }
+    return 0;
+}
+
+static void swapSetHeader(swapHeader *h, uint64_t base, uint64_t tailrow, uint64_t tailoff) {
+    memset(h,0,sizeof(*h));
+    memcpy(h->magic,SWAP_MAGIC,sizeof(h->magic));
+    h->base = base;
+    h->tailrow = tailrow;
+    h->tailoff = tailoff;
+}
+
+/* Start the file over with w->fileh, creating it if needed. */
+static int swapRewind(swapWriter *w) {
+    if (w->fd == -1) {
+        w->fd = open(w->path.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0600);
+        if (w->fd == -1) return -1;
+    } else if (ftruncate(w->fd,0) == -1) {
+        return -1;
+    }
+    return swapWriteAll(w->fd,&w->fileh,sizeof(w->fileh));
+}
+
+/* Write a frame whose payload is 'a' followed by 'b'. */
+static int swapWriteFrame(int fd, const char *a, size_t alen, const char *b, size_t blen) {
+    swapFrame f;
+    f.len = alen+blen;
+    f.hash = editorHashBytes(editorHashBytes(EDITOR_HASH_INIT,a,alen),b,blen);
+    return swapWriteAll(fd,&f,sizeof(f)) || swapWriteAll(fd,a,alen) ||
+           swapWriteAll(fd,b,blen);
+}
+
+/* A failed write would leave a hole in the log, so the swap is dropped
+ * altogether. */
+static void swapDrop(swapWriter *w) {
+    if (w->fd != -1) {
+        close(w->fd);
+        w->fd = -1;
+        unlink(w->path.c_str());
+    }
+    w->broken = 1;
+}
+
+/* Commit a batch: writer thread only. The file is created with the first ops
+ * to commit, so files never edited leave no swap behind. */
+static void swapCommit(swapWriter *w, const std::string &batch, int rebase, uint64_t base) {
+    if (w->broken) return;
+    if (rebase) swapSetHeader(&w->fileh,base,SWAP_WHOLE,0);
+    if (batch.empty() && !(rebase && w->fd != -1)) return;
+
+    int err = 0;
+    if (w->fd == -1 || rebase) err = swapRewind(w);
+    if (!err && !batch.empty())
+        err = swapWriteFrame(w->fd,batch.data(),batch.size(),NULL,0);
+    if (!err) err = fdatasync(w->fd);
+    if (err) swapDrop(w);
+}
+
+/* Append an op to 'b'. Consecutive changes to the same row are merged: the
+ * new content replaces the old, and a row inserted in the batch stays an
+ * insertion. */
+static void swapBatchAdd(swapBatch *b, int op, uint64_t row, const char *s, uint64_t len) {
+    if (op == SWAP_OP_SET && b->lastop != std::string::npos &&
+        b->lastrow == (long long)row)
+    {
+        op = b->ops[b->lastop];
+        if (op != SWAP_OP_SET && op != SWAP_OP_INSERT) op = SWAP_OP_SET;
+        else b->ops.resize(b->lastop);
+    }
+    b->lastop = b->ops.size();
+    b->lastrow = row;
+    b->ops += (char)op;
+    b->ops.append((const char*)&row,sizeof(row));
+    b->ops.append((const char*)&len,sizeof(len));
+    b->ops.append(s ? s : "",len);
+}
+
+/* Start the file over from the rows an in place save leaves alone, writer
+ * thread only: the rows it is about to write are the first ops, as many
+ * frames as needed, followed by the ops logged since its snapshot. Rows too
+ * long to copy in a batch get a frame of their own, written from the row.
+ * Until the save starts writing the old swap is the one that applies, so
+ * the new one is written aside and renamed over it. */
+static void swapCommitTail(swapWriter *w, editorSaveJob *job, const std::string &after) {
+    if (w->broken) return;
+    std::string tmppath = w->path + ".new";
+    int fd = open(tmppath.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,0600);
+    if (fd == -1) {
+        swapDrop(w);
+        return;
+    }
+    swapSetHeader(&w->fileh,job->start.hash,job->firstrow,job->start.off);
+    int err = swapWriteAll(fd,&w->fileh,sizeof(w->fileh));
+
+    swapBatch b;
+    swapBatchAdd(&b,SWAP_OP_TRUNCATE,job->firstrow,NULL,0);
+    for (size_t j = 0; !err && j < job->rows.size(); j++) {
+        const char *s = (const char*)job->rows[j].iov_base;
+        uint64_t row = job->firstrow+j, len = job->rows[j].iov_len;
+        if (!b.ops.empty() &&
+            (len >= SWAP_BATCH_MAX || b.ops.size() >= SWAP_BATCH_MAX))
+        {
+            err = swapWriteFrame(fd,b.ops.data(),b.ops.size(),NULL,0);
+            b = swapBatch();
+        }
+        if (len < SWAP_BATCH_MAX) {
+            swapBatchAdd(&b,SWAP_OP_INSERT,row,s,len);
+        } else if (!err) {
+            char op[17];
+            op[0] = SWAP_OP_INSERT;
+            memcpy(op+1,&row,8);
+            memcpy(op+9,&len,8);
+            err = swapWriteFrame(fd,op,sizeof(op),s,len);
+        }
+    }
+    if (!err && !b.ops.empty())
+        err = swapWriteFrame(fd,b.ops.data(),b.ops.size(),NULL,0);
+    if (!err && !after.empty())
+        err = swapWriteFrame(fd,after.data(),after.size(),NULL,0);
+    if (!err) err = fdatasync(fd) || rename(tmppath.c_str(),w->path.c_str());
+    if (err) {
+        close(fd);
+        unlink(tmppath.c_str());
+        swapDrop(w);
+        return;
+    }
+
+    /* The rename must be on disk before the save writes. */
+    std::string dir = w->path;
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : dir.substr(0,slash+1);
+    int dfd = open(dir.c_str(),O_RDONLY|O_DIRECTORY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    if (w->fd != -1) close(w->fd);
+    w->fd = fd;
+}
+
+static void swapWriterMain(swapWriter *w) {
+    std::unique_lock<std::mutex> lk(w->mutex);
+    while (1) {
+        w->cond.wait_for(lk,std::chrono::milliseconds(SWAP_COMMIT_MS),
+            [w]{ return w->stop || w->tail ||
+                        w->pending.ops.size() >= SWAP_BATCH_MAX; });
+        if (w->tail) {
+            /* What was logged before the snapshot is in the rows written
+             * now: only the ops since then follow them. */
+            editorSaveJob *job = w->tail;
+            std::string after = w->aftersave.ops;
+            w->pending = swapBatch();
+            w->rebase = 0;
+            lk.unlock();
+            swapCommitTail(w,job,after);
+            lk.lock();
+            w->tail = NULL;
+            w->taildone.notify_all();
+        }
+        std::string batch;
+        batch.swap(w->pending.ops);
+        w->pending.lastop = std::string::npos;
+        int rebase = w->rebase, stop = w->stop;
+        uint64_t base = w->base;
+        w->rebase = 0;
+        lk.unlock();
+        swapCommit(w,batch,rebase,base);
+        lk.lock();
+        if (stop) break;
+    }
+    if (w->fd != -1) close(w->fd);
+    w->exited = 1;
+    w->taildone.notify_all();
+}
+
+/* Log a change of the row at 'at': its new content for SWAP_OP_SET and
+ * SWAP_OP_INSERT, nothing else for SWAP_OP_DELETE and SWAP_OP_TRUNCATE, that
+ * drops the rows from 'at' to the end. */
+void swapLog(editorConfig *E, int op, long long at) {
+    swapWriter *w = E->swap.get();
+    if (w == NULL) return;
+
+    const char *s = NULL;
+    uint64_t len = 0;
+    if (op == SWAP_OP_SET || op == SWAP_OP_INSERT) {
+        s = E->row[at].chars;
+        len = E->row[at].size;
+    }
+
+    std::lock_guard<std::mutex> lk(w->mutex);
+    swapBatchAdd(&w->pending,op,at,s,len);
+    if (w->saving) swapBatchAdd(&w->aftersave,op,at,s,len);
+    if (w->pending.ops.size() >= SWAP_BATCH_MAX) w->cond.notify_one();
+}
+
+/* Log a change to the bytes of the row at 'at': the 'del' bytes at 'col'
+ * replaced by the 'len' bytes at 's'. Short rows are logged whole, so that
+ * their changes merge into one op per batch. Long rows log the bytes alone:
+ * a key costs as much on a row of megabytes as on a short one. */
+void swapLogSplice(editorConfig *E, long long at, long long col, long long del, const char *s, size_t len) {
+    swapWriter *w = E->swap.get();
+    if (w == NULL) return;
+    if (E->row[at].size < ROW_LONG_LINE) {
+        swapLog(E,SWAP_OP_SET,at);
+        return;
+    }
+
+    std::string op;
+    uint64_t u[2] = {(uint64_t)col,(uint64_t)del};
+    op.append((const char*)u,sizeof(u));
+    op.append(s ? s : "",len);
+    std::lock_guard<std::mutex> lk(w->mutex);
+    swapBatchAdd(&w->pending,SWAP_OP_SPLICE,at,op.data(),op.size());
+    if (w->saving) swapBatchAdd(&w->aftersave,SWAP_OP_SPLICE,at,op.data(),op.size());
+    if (w->pending.ops.size() >= SWAP_BATCH_MAX) w->cond.notify_one();
+}
+
+/* A save of the rows as they are now starts: keep the ops from here on. */
+void swapSaveStart(editorConfig *E) {
+    swapWriter *w = E->swap.get();
+    if (w == NULL) return;
+    std::lock_guard<std::mutex> lk(w->mutex);
+    w->saving = 1;
+    w->aftersave = swapBatch();
+}
+
+/* The save is over. If it succeeded, the content hashed 'hash' is on disk
+ * and the swap starts over from it, with the ops logged since the save
+ * started. Otherwise the swap goes on as it was. */
+void swapSaveEnd(editorConfig *E, int ok, uint64_t hash) {
+    swapWriter *w = E->swap.get();
+    if (w == NULL) return;
+    std::lock_guard<std::mutex> lk(w->mutex);
+    if (ok) {
+        w->pending = std::move(w->aftersave);
+        w->rebase = 1;
+        w->base = hash;
+        if (w->pending.ops.size() >= SWAP_BATCH_MAX) w->cond.notify_one();
+    }
+    w->saving = 0;
+    w->aftersave = swapBatch();
+}
+
+/* Called by the thread of a save in place before it writes anything: wait
+ * for the writer to start the swap over from the rows it leaves alone. */
+void swapSaveTail(swapWriter *w, editorSaveJob *job) {
+    std::unique_lock<std::mutex> lk(w->mutex);
+    if (w->exited) return;
+    w->tail = job;
+    w->cond.notify_one();
+    w->taildone.wait(lk,[w]{ return w->tail == NULL || w->exited; });
+}
+
+struct swapOp {
+    int op;
+    long long row;
+    std::string s;
+};
+
+/* Do the ops of a swap with header 'h' apply to the file just loaded? The
+ * loader keeps a checkpoint every SAVE_CHECKPOINT_ROWS rows, so the rows
+ * before the tail of a save in place are checked without reading them again.
+ * The checkpoint is missing if the file was torn right after them. */
+static int swapApplies(editorConfig *E, const swapHeader *h) {
+    if (h->tailrow == SWAP_WHOLE) return h->base == E->file_hash;
+    if (h->tailrow % SAVE_CHECKPOINT_ROWS) return 0;
+    size_t c = h->tailrow / SAVE_CHECKPOINT_ROWS;
+    if (c < E->saved.ckpt.size())
+        return E->saved.ckpt[c].off == h->tailoff &&
+               E->saved.ckpt[c].hash == h->base;
+    return (uint64_t)E->numrows == h->tailrow &&
+           (uint64_t)E->saved.size == h->tailoff && E->file_hash == h->base;
+}
+
+/* Read the ops of the swap at 'path' if they apply to the file just loaded.
+ * Stops at the first frame that is torn or corrupted. */
+static void swapRead(editorConfig *E, const char *path, std::vector<swapOp> *ops) {
+    int fd = open(path,O_RDONLY);
+    struct stat st;
+    if (fd == -1) return;
+    if (fstat(fd,&st) == -1 || (size_t)st.st_size < sizeof(swapHeader)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const char *p = (const char*)map, *end = p+st.st_size;
+    swapHeader h;
+    memcpy(&h,p,sizeof(h));
+    p += sizeof(h);
+    if (memcmp(h.magic,SWAP_MAGIC,sizeof(h.magic)) || !swapApplies(E,&h)) p = end;
+    while ((size_t)(end-p) >= sizeof(swapFrame)) {
+        swapFrame f;
+        memcpy(&f,p,sizeof(f));
+        p += sizeof(f);
+        if (f.len > (size_t)(end-p) ||
+            editorHashBytes(EDITOR_HASH_INIT,p,f.len) != f.hash) break;
+        const char *q = p, *fend = p+f.len;
+        while (fend-q >= 17) {
+            swapOp op;
+            uint64_t row, len;
+            op.op = (unsigned char)*q;
+            memcpy(&row,q+1,8);
+            memcpy(&len,q+9,8);
+            q += 17;
+            if (len > (size_t)(fend-q) || row > LLONG_MAX) break;
+            op.row = row;
+            op.s.assign(q,len);
+            q += len;
+            ops->push_back(std::move(op));
+        }
+        p = fend;
+    }
+    munmap(map,st.st_size);
+}
+
+/* Apply the recovered ops to the rows. Returns the number applied: ops that
+ * don't fit the rows mean a swap we can't trust, and stop the replay. */
+static size_t swapReplay(editorConfig *E, std::vector<swapOp> &ops) {
+    size_t j;
+    for (j = 0; j < ops.size(); j++) {
+        swapOp &op = ops[j];
+        if (op.row < 0 || op.row > E->numrows ||
+            (op.row == E->numrows && op.op != SWAP_OP_INSERT &&
+             op.op != SWAP_OP_TRUNCATE)) break;
+        switch(op.op) {
+        case SWAP_OP_SET:
+            editorRowSetChars(E,&E->row[op.row],op.s.data(),op.s.size());
+            break;
+        case SWAP_OP_INSERT:
+            editorInsertRow(E,op.row,(char*)op.s.c_str(),op.s.size());
+            break;
+        case SWAP_OP_DELETE:
+            editorDelRow(E,op.row);
+            break;
+        case SWAP_OP_TRUNCATE:
+            while (E->numrows > op.row) editorDelRow(E,E->numrows-1);
+            break;
+        case SWAP_OP_SPLICE: {
+            erow *row = &E->row[op.row];
+            uint64_t u[2];
+            if (op.s.size() < sizeof(u)) return j;
+            memcpy(u,op.s.data(),sizeof(u));
+            if (u[0] > (uint64_t)row->size || u[1] > row->size-u[0]) return j;
+            editorRowSplice(E,row,u[0],u[1],op.s.data()+sizeof(u),
+                            op.s.size()-sizeof(u));
+        } break;
+        default:
+            return j;
+        }
+    }
+    return j;
+}
+
+/* Start logging the changes of the file just loaded. If a swap left by a
+ * crash applies to it, the user is asked whether to recover its changes:
+ * that needs the terminal, so it is only done in raw mode. */
+void swapStart(editorConfig *E) {
+    char path[PATH_MAX];
+    std::vector<swapOp> ops;
+
+    swapClose(E);
+    editorSidecarPath(E->filename,"swp",path,sizeof(path));
+    if (E->rawmode) swapRead(E,path,&ops);
+
+    std::shared_ptr<swapWriter> w = std::make_shared<swapWriter>();
+    w->path = path;
+    w->base = E->file_hash;
+    w->thread = std::thread(swapWriterMain,w.get());
+    E->swap = w;
+    if (ops.empty()) return;
+
+    editorSetStatusMessage(E,"Unsaved changes of %.30s found (%zu edits), recover them? (y/n)",
+        E->filename,ops.size());
+    editorRefreshScreen(E);
+    int c;
+    do {
+        c = editorReadKey(STDIN_FILENO);
+    } while (c != 'y' && c != 'n' && c != ESC);
+    if (c != 'y') {
+        unlink(path);
+        editorSetStatusMessage(E,"");
+        return;
+    }
+    size_t applied = swapReplay(E,ops);
+    if (applied < ops.size())
+        editorSetStatusMessage(E,"Recovered %zu edits, %zu could not be applied",
+            applied,ops.size()-applied);
+    else
+        editorSetStatusMessage(E,"Recovered %zu edits",applied);
+}
+
+/* Stop logging: the last ops are committed first. The swap is only kept if
+ * there are unsaved changes it may recover. */
+void swapClose(editorConfig *E) {
+    swapWriter *w = E->swap.get();
+    if (w == NULL) return;
+    {
+        std::lock_guard<std::mutex> lk(w->mutex);
+        w->stop = 1;
+    }
+    w->cond.notify_one();
+    w->thread.join();
+    if (!E->dirty) unlink(w->path.c_str());
+    E->swap.reset();
+}
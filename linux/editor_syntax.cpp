@@ -4,151 +4,186 @@
  * that starts at this row or at one before, and does not end at the end
  * of the row but spawns to the next row. */
 int editorRowHasOpenComment(erow *row) {
+    if (row->hl_stale) return row->hl_oc; /* Can't have changed, see editorRowSetChars(). */
+    if (row->ll) return row->hl_oc; /* Kept by longLineUpdateSyntax(). */
     if (row->hl && row->rsize && row->hl[row->rsize-1] == HL_MLCOMMENT &&
         (row->rsize < 2 || (row->render[row->rsize-2] != '*' ||
                             row->render[row->rsize-1] != '/'))) return 1;
     return 0;
 }
 
-/* Set every byte of row->hl (that corresponds to every character in the line)
- * to the right syntax highlight type (HL_* defines). */
-void editorUpdateSyntax(editorConfig *E, erow *row) {
-    row->hl = (unsigned char*)realloc(row->hl,row->rsize);
-    memset(row->hl,HL_NORMAL,row->rsize);
-
-    if (E->syntax == NULL) return; /* No syntax, everything is HL_NORMAL. */
-
-    int i, prev_sep, in_string, in_comment;
-    char *p;
+/* Highlight the rendered text 'p', 'end' bytes long, into 'hl' starting in
+ * the state 'st', that is left at the state where it stopped: at offset
+ * 'stop', or a bit after it if a token crosses 'stop'. Returns that offset.
+ * 'hl' can be NULL to only follow the state, see editor_longline.cpp. */
+long long editorHighlight(editorConfig *E, const char *p, long long end,
+                          long long stop, unsigned char *hl, editorHlState *st)
+{
     char **keywords = E->syntax->keywords;
     char *scs = E->syntax->singleline_comment_start;
     char *mcs = E->syntax->multiline_comment_start;
     char *mce = E->syntax->multiline_comment_end;
+    editorHlState s = *st; /* A copy the compiler can keep in registers. */
+    long long i = 0;
 
-    /* Point to the first non-space char. */
-    p = row->render;
-    i = 0; /* Current char offset */
-    while(*p && isspace(*p)) {
-        p++;
-        i++;
-    }
-    prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
-    in_string = 0; /* Are we inside "" or '' ? */
-    in_comment = 0; /* Are we inside multi-line comment? */
-
-    /* If the previous line has an open comment, this line starts
-     * with an open comment state. */
-    if (row->idx > 0 && editorRowHasOpenComment(&E->row[row->idx-1]))
-        in_comment = 1;
+    while(i < stop) {
+        const char *c = p+i;
+        int number = s.number;
+        s.number = 0;
 
-    while(*p) {
         /* Handle // comments. */
-        if (prev_sep && *p == scs[0] && *(p+1) == scs[1]) {
+        if (s.in_lcomment || (s.prev_sep && c[0] == scs[0] && c[1] == scs[1])) {
             /* From here to end is a comment */
-            memset(row->hl+i,HL_COMMENT,row->size-i);
-            return;
+            if (hl) memset(hl+i,HL_COMMENT,end-i);
+            s.in_lcomment = 1;
+            *st = s;
+            return stop;
         }
 
         /* Handle multi line comments. */
-        if (in_comment) {
-            row->hl[i] = HL_MLCOMMENT;
-            if (*p == mce[0] && *(p+1) == mce[1]) {
-                row->hl[i+1] = HL_MLCOMMENT;
-                p += 2; i += 2;
-                in_comment = 0;
-                prev_sep = 1;
+        if (s.in_comment) {
+            if (hl) hl[i] = HL_MLCOMMENT;
+            if (c[0] == mce[0] && c[1] == mce[1]) {
+                if (hl) hl[i+1] = HL_MLCOMMENT;
+                i += 2;
+                s.in_comment = 0;
+                s.prev_sep = 1;
                 continue;
             } else {
-                prev_sep = 0;
-                p++; i++;
+                s.prev_sep = 0;
+                i++;
                 continue;
             }
-        } else if (*p == mcs[0] && *(p+1) == mcs[1]) {
-            row->hl[i] = HL_MLCOMMENT;
-            row->hl[i+1] = HL_MLCOMMENT;
-            p += 2; i += 2;
-            in_comment = 1;
-            prev_sep = 0;
+        } else if (c[0] == mcs[0] && c[1] == mcs[1]) {
+            if (hl) hl[i] = hl[i+1] = HL_MLCOMMENT;
+            i += 2;
+            s.in_comment = 1;
+            s.prev_sep = 0;
             continue;
         }
 
         /* Handle "" and '' */
-        if (in_string) {
-            row->hl[i] = HL_STRING;
-            if (*p == '\\') {
-                row->hl[i+1] = HL_STRING;
-                p += 2; i += 2;
-                prev_sep = 0;
+        if (s.in_string) {
+            if (hl) hl[i] = HL_STRING;
+            if (c[0] == '\\' && c[1]) {
+                if (hl) hl[i+1] = HL_STRING;
+                i += 2;
+                s.prev_sep = 0;
                 continue;
             }
-            if (*p == in_string) in_string = 0;
-            p++; i++;
+            if (c[0] == s.in_string) s.in_string = 0;
+            i++;
             continue;
         } else {
-            if (*p == '"' || *p == '\'') {
-                in_string = *p;
-                row->hl[i] = HL_STRING;
-                p++; i++;
-                prev_sep = 0;
+            if (c[0] == '"' || c[0] == '\'') {
+                s.in_string = c[0];
+                if (hl) hl[i] = HL_STRING;
+                i++;
+                s.prev_sep = 0;
                 continue;
             }
         }
 
-        /* Handle non printable chars. */
-        if (!isprint(*p)) {
-            row->hl[i] = HL_NONPRINT;
-            p++; i++;
-            prev_sep = 0;
+        /* Handle non printable chars. Bytes above 0x7f are parts of UTF-8
+         * chars: invalid ones were rendered as DEL, and editorDrawRow()
+         * shows them as '?' in long rows. */
+        if (!(c[0] & 0x80) && !isprint(c[0])) {
+            if (hl) hl[i] = HL_NONPRINT;
+            i++;
+            s.prev_sep = 0;
             continue;
         }
 
         /* Handle numbers */
-        if ((isdigit(*p) && (prev_sep || row->hl[i-1] == HL_NUMBER)) ||
-            (*p == '.' && i >0 && row->hl[i-1] == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
-            p++; i++;
-            prev_sep = 0;
+        if ((isdigit(c[0]) && (s.prev_sep || number)) ||
+            (c[0] == '.' && number)) {
+            if (hl) hl[i] = HL_NUMBER;
+            i++;
+            s.prev_sep = 0;
+            s.number = 1;
             continue;
         }
 
-        /* Handle keywords and lib calls */
-        if (prev_sep) {
+        /* Handle keywords and lib calls. They leave the state as if they
+         * were plain words, so they only matter when highlighting. */
+        if (s.prev_sep && hl) {
             int j;
             for (j = 0; keywords[j]; j++) {
                 int klen = strlen(keywords[j]);
                 int kw2 = keywords[j][klen-1] == '|';
                 if (kw2) klen--;
 
-                if (!memcmp(p,keywords[j],klen) &&
-                    is_separator(*(p+klen)))
+                if (!strncmp(c,keywords[j],klen) &&
+                    is_separator(c[klen]))
                 {
                     /* Keyword */
-                    memset(row->hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
-                    p += klen;
+                    memset(hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
                     i += klen;
                     break;
                 }
             }
             if (keywords[j] != NULL) {
-                prev_sep = 0;
+                s.prev_sep = 0;
                 continue; /* We had a keyword match */
             }
         }
 
         /* Not special chars */
-        prev_sep = is_separator(*p);
-        p++; i++;
+        s.prev_sep = is_separator(c[0]);
+        i++;
+    }
+    *st = s;
+    return i;
+}
+
+/* Set 'st' to the highlighter state at the start of 'row'. */
+void editorHlStart(editorConfig *E, erow *row, editorHlState *st) {
+    memset(st,0,sizeof(*st));
+    st->prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
+
+    /* If the previous line has an open comment, this line starts
+     * with an open comment state. */
+    if (row->idx > 0 && editorRowHasOpenComment(&E->row[row->idx-1]))
+        st->in_comment = 1;
+}
+
+/* Set every byte of row->hl (that corresponds to every character in the line)
+ * to the right syntax highlight type (HL_* defines). */
+static void editorHighlightRow(editorConfig *E, erow *row) {
+    row->hl_stale = 0;
+    if (row->ll) {
+        longLineUpdateSyntax(E,row);
+        return;
     }
+    row->hl = (unsigned char*)realloc(row->hl,row->rsize);
+    memset(row->hl,HL_NORMAL,row->rsize);
+
+    if (E->syntax == NULL) return; /* No syntax, everything is HL_NORMAL. */
+
+    editorHlState st;
+    long long i = 0;
+
+    /* Point to the first non-space char. */
+    while(i < row->rsize && isspace(row->render[i])) i++;
+    editorHlStart(E,row,&st);
+    editorHighlight(E,row->render+i,row->rsize-i,row->rsize-i,row->hl+i,&st);
 
     /* Propagate syntax change to the next row if the open commen
      * state changed. This may recursively affect all the following rows
      * in the file. */
     int oc = editorRowHasOpenComment(row);
     if (row->hl_oc != oc && row->idx+1 < E->numrows)
-        editorUpdateSyntax(E, &E->row[row->idx+1]);
+        editorHighlightRow(E, &E->row[row->idx+1]);
     row->hl_oc = oc;
 }
 
+void editorUpdateSyntax(editorConfig *E, erow *row) {
+    TRACE_SPAN("editorUpdateSyntax");
+    uint64_t start = statsNow();
+    editorHighlightRow(E,row);
+    statsHighlighted(start);
+}
+
 
 /* Maps syntax highlight token types to terminal colors. */
 int editorSyntaxToColor(int hl) {
@@ -0,0 +1,121 @@
+#include "editor.h"
+
+#include <atomic>
+#include <mutex>
+
+/* ================================ Tracing ===================================
+ *
+ * "texed --trace <file>" records spans of the editor internals, marked with
+ * TRACE_SPAN() in the functions worth looking at, and writes them on exit
+ * in the trace event format of Chrome, that chrome://tracing and Perfetto
+ * open.
+ *
+ * Each thread writes to a ring of its own, without locks: only the last
+ * TRACE_RING_EVENTS spans of a thread are kept. A thread that exits gives
+ * its ring to the next one that starts, as the thread of every save does,
+ * so they show as one track. Without --trace a span costs the test of
+ * traceOn when it starts, and the test of its start time when it ends. */
+
+#define TRACE_RING_EVENTS 65536
+#define TRACE_MAX_THREADS 64
+
+struct traceEvent {
+    const char *name;
+    uint64_t start, dur;
+};
+
+struct traceRing {
+    traceEvent ev[TRACE_RING_EVENTS];
+    std::atomic<uint64_t> count;    /* Spans written, the last ones kept. */
+    int tid;
+    int free;                       /* Its thread exited: it can be reused. */
+};
+
+int traceOn = 0;
+
+static std::mutex traceLock;
+static traceRing *traceRings[TRACE_MAX_THREADS];
+static int traceThreads;
+static char *traceFile;
+static uint64_t traceEpoch;
+
+/* The ring of the calling thread, handed back when the thread exits. */
+struct traceThread {
+    traceRing *ring = NULL;
+    ~traceThread() {
+        if (ring == NULL) return;
+        std::lock_guard<std::mutex> lock(traceLock);
+        ring->free = 1;
+    }
+};
+static thread_local traceThread traceSelf;
+
+static traceRing *traceAcquire(void) {
+    std::lock_guard<std::mutex> lock(traceLock);
+
+    for (int j = 0; j < traceThreads; j++) {
+        if (traceRings[j]->free) {
+            traceRings[j]->free = 0;
+            return traceSelf.ring = traceRings[j];
+        }
+    }
+    if (traceThreads == TRACE_MAX_THREADS) return NULL;
+    traceRing *r = new traceRing();
+    r->tid = traceThreads;
+    traceRings[traceThreads++] = r;
+    return traceSelf.ring = r;
+}
+
+/* Start recording, to write the spans to 'filename' on exit. The calling
+ * thread is shown as the main one. */
+void traceStart(const char *filename) {
+    free(traceFile);
+    traceFile = strdup(filename);
+    traceEpoch = statsNow();
+    if (traceSelf.ring == NULL) traceAcquire();
+    traceOn = 1;
+}
+
+/* The span 'name' that started at 'start' ends now. */
+void traceEnd(const char *name, uint64_t start) {
+    traceRing *r = traceSelf.ring;
+    if (r == NULL && (r = traceAcquire()) == NULL) return;
+
+    uint64_t n = r->count.load(std::memory_order_relaxed);
+    traceEvent *e = &r->ev[n % TRACE_RING_EVENTS];
+    e->name = name;
+    e->start = start;
+    e->dur = statsNow()-start;
+    r->count.store(n+1,std::memory_order_release);
+}
+
+/* Write the spans recorded to the file given to traceStart(), if any.
+ * Threads still running may add spans meanwhile: the ones written are
+ * those there when their ring is reached. Returns -1 on errors. */
+int traceDump(void) {
+    if (traceFile == NULL) return 0;
+    FILE *fp = fopen(traceFile,"w");
+    if (fp == NULL) return -1;
+
+    std::lock_guard<std::mutex> lock(traceLock);
+    int pid = getpid();
+    fprintf(fp,"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (int j = 0; j < traceThreads; j++) {
+        traceRing *r = traceRings[j];
+        fprintf(fp,"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                   "\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                j ? ",\n" : "",pid,r->tid,j ? "thread" : "main",r->tid);
+
+        uint64_t n = r->count.load(std::memory_order_acquire);
+        uint64_t first = n > TRACE_RING_EVENTS ? n-TRACE_RING_EVENTS : 0;
+        for (uint64_t k = first; k < n; k++) {
+            traceEvent *e = &r->ev[k % TRACE_RING_EVENTS];
+            if (e->start < traceEpoch) continue;
+            fprintf(fp,",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                       "\"ts\":%.3f,\"dur\":%.3f}",e->name,pid,r->tid,
+                       (e->start-traceEpoch)/1e3,e->dur/1e3);
+        }
+    }
+    fprintf(fp,"\n]}\n");
+    return fclose(fp) == EOF ? -1 : 0;
+}
@@ -0,0 +1,456 @@
+#include "editor.h"
+
+#include <algorithm>
+#include <string>
+
+/* =============================== Trigram index ==============================
+ *
+ * For big files editorFind does not need to look at the whole document: a
+ * literal query (or a regex starting with a literal) of three bytes or more
+ * can only occur in lines containing all of its trigrams. After the file is
+ * loaded a background job maps it and records, for each trigram, the blocks
+ * of lines where it appears; searches then verify only the lines of the
+ * blocks found in every posting list.
+ *
+ * The build runs on the thread pool, one task per region of the file. A
+ * changed row gets a fresh line id, that is indexed by the next search: a
+ * row typed into gets a single fresh id until then, and is read once per
+ * search however many keys changed it, rather than once per key. The
+ * postings of old ids are never removed: they just don't map to a row
+ * anymore.
+ *
+ * The index of the file as loaded is cached in ".<filename>.trigrams", tagged
+ * with the content hash, so reopening the same file skips the build. */
+
+struct trigramBuild {
+    std::string filename;
+    uint64_t hash;              /* Content hash of the file as loaded. */
+    uint32_t nlines;            /* Lines of the file as loaded. */
+    off_t size;
+    struct timespec mtime;
+    const unsigned char *map = NULL;
+    size_t nblocks = 0, per = 0; /* File blocks, and blocks per region. */
+    std::vector<trigramMap> maps; /* Postings of each region. */
+    std::vector<std::vector<uint32_t>> counts; /* Lines starting in each block. */
+    std::atomic<int> pending{0}; /* Regions still running. */
+    std::atomic<int> cancel{0};
+    std::atomic<int> done{0};   /* 1 when built, -1 on failure. */
+    trigramMap postings;        /* The result. */
+    std::vector<uint32_t> blockline;
+};
+
+struct trigramCacheHeader {
+    char magic[8];
+    uint64_t content_hash;
+    uint64_t nlines;
+    uint64_t nblocks;
+    uint64_t nkeys;
+};
+/* Followed by blockline (nblocks+1 uint32), then for every key a uint32
+ * key, last and data length, and the data. */
+
+#define TRIGRAM_KEY(a,b,c) ((uint32_t)tolower(a)<<16 | \
+                            (uint32_t)tolower(b)<<8 | (uint32_t)tolower(c))
+
+static void trigramPut(std::vector<uint8_t> &d, uint32_t v) {
+    while (v >= 0x80) {
+        d.push_back(v | 0x80);
+        v >>= 7;
+    }
+    d.push_back(v);
+}
+
+static uint32_t trigramGet(const uint8_t **p) {
+    uint32_t v = 0;
+    int shift = 0;
+    while (**p & 0x80) {
+        v |= (uint32_t)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return v | (uint32_t)*(*p)++ << shift;
+}
+
+/* Add 'block' to a posting list. Blocks are appended in increasing order. */
+static void trigramAdd(trigramPosting *p, uint32_t block) {
+    if (!p->data.empty() && p->last == block) return;
+    trigramPut(p->data,block - p->last);
+    p->last = block;
+}
+
+/* Append the list 'src', whose blocks all follow the ones of 'dst'. Only the
+ * first delta needs to be encoded again. */
+static void trigramConcat(trigramPosting *dst, const trigramPosting *src) {
+    const uint8_t *p = src->data.data();
+    uint32_t first = trigramGet(&p);
+    trigramPut(dst->data,first - dst->last);
+    dst->data.insert(dst->data.end(),p,src->data.data()+src->data.size());
+    dst->last = src->last;
+}
+
+static std::vector<uint32_t> trigramDecode(const trigramPosting *p) {
+    std::vector<uint32_t> blocks;
+    const uint8_t *d = p->data.data(), *end = d + p->data.size();
+    uint32_t b = 0;
+    while (d < end) {
+        b += trigramGet(&d);
+        blocks.push_back(b);
+    }
+    return blocks;
+}
+
+static uint32_t trigramLidBlock(editorTrigram *t, uint32_t lid) {
+    return t->blockline.size()-1 + (lid - t->base)/TRIGRAM_EDIT_BLOCK;
+}
+
+static void trigramIndexLine(editorTrigram *t, uint32_t lid, const char *s, size_t len) {
+    uint32_t block = trigramLidBlock(t,lid);
+    const unsigned char *u = (const unsigned char*)s;
+    for (size_t j = 0; j+2 < len; j++)
+        trigramAdd(&t->postings[TRIGRAM_KEY(u[j],u[j+1],u[j+2])],block);
+}
+
+/* ------------------------------- Cache file ------------------------------- */
+
+static void trigramCacheWrite(trigramBuild *b) {
+    char path[PATH_MAX], tmppath[PATH_MAX+8];
+    trigramCacheHeader h;
+    FILE *fp;
+
+    editorSidecarPath(b->filename.c_str(),"trigrams",path,sizeof(path));
+    snprintf(tmppath,sizeof(tmppath),"%s.tmp",path);
+    fp = fopen(tmppath,"w");
+    if (!fp) return;
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,TRIGRAM_CACHE_MAGIC,sizeof(h.magic));
+    h.content_hash = b->hash;
+    h.nlines = b->nlines;
+    h.nblocks = b->nblocks;
+    h.nkeys = b->postings.size();
+    fwrite(&h,sizeof(h),1,fp);
+    fwrite(b->blockline.data(),sizeof(uint32_t),b->blockline.size(),fp);
+    for (auto &kv : b->postings) {
+        uint32_t rec[3] = {kv.first, kv.second.last,
+                           (uint32_t)kv.second.data.size()};
+        fwrite(rec,sizeof(rec),1,fp);
+        fwrite(kv.second.data.data(),1,kv.second.data.size(),fp);
+    }
+    if (fclose(fp) == EOF || rename(tmppath,path) == -1) unlink(tmppath);
+}
+
+/* Load the cached index of the file as loaded, if there is a valid one.
+ * Returns 1 on success. */
+static int trigramCacheLoad(trigramBuild *b) {
+    char path[PATH_MAX];
+    struct stat st;
+    trigramCacheHeader *h;
+    void *map;
+    int ok = 0;
+
+    editorSidecarPath(b->filename.c_str(),"trigrams",path,sizeof(path));
+    int fd = open(path,O_RDONLY);
+    if (fd == -1) return 0;
+    if (fstat(fd,&st) == -1 || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const uint8_t *p = (const uint8_t*)map, *end = p + st.st_size;
+    h = (trigramCacheHeader*)map;
+    p += sizeof(*h);
+    if (memcmp(h->magic,TRIGRAM_CACHE_MAGIC,sizeof(h->magic)) ||
+        h->content_hash != b->hash || h->nlines != b->nlines ||
+        h->nblocks != b->nblocks ||
+        (uint64_t)(end-p) < (h->nblocks+1)*sizeof(uint32_t)) goto done;
+
+    b->blockline.resize(h->nblocks+1);
+    memcpy(b->blockline.data(),p,(h->nblocks+1)*sizeof(uint32_t));
+    p += (h->nblocks+1)*sizeof(uint32_t);
+    for (uint64_t k = 0; k < h->nkeys; k++) {
+        uint32_t rec[3];
+        if ((size_t)(end-p) < sizeof(rec)) goto done;
+        memcpy(rec,p,sizeof(rec));
+        p += sizeof(rec);
+        if ((size_t)(end-p) < rec[2]) goto done;
+        trigramPosting &post = b->postings[rec[0]];
+        post.last = rec[1];
+        post.data.assign(p,p+rec[2]);
+        p += rec[2];
+    }
+    ok = p == end;
+
+done:
+    munmap(map,st.st_size);
+    if (!ok) {
+        b->postings.clear();
+        b->blockline.clear();
+    }
+    return ok;
+}
+
+/* ---------------------------------- Build --------------------------------- */
+
+/* Called by the last region to finish: join the regions and publish. */
+static void trigramBuildMerge(trigramBuild *b) {
+    size_t nregions = b->maps.size();
+    int ok = !b->cancel;
+
+    if (ok) {
+        b->blockline.push_back(0);
+        for (size_t r = 0; r < nregions; r++)
+            for (uint32_t c : b->counts[r])
+                b->blockline.push_back(b->blockline.back() + c);
+        /* The file changed under us if it does not split the same way. */
+        ok = b->blockline.back() == b->nlines;
+    }
+    for (size_t r = 0; ok && r < nregions; r++) {
+        for (auto &kv : b->maps[r]) {
+            trigramPosting &dst = b->postings[kv.first];
+            if (dst.data.empty())
+                dst = std::move(kv.second);
+            else
+                trigramConcat(&dst,&kv.second);
+        }
+        trigramMap().swap(b->maps[r]);
+    }
+    munmap((void*)b->map,b->size);
+    if (ok) trigramCacheWrite(b);
+    b->done = ok ? 1 : -1;
+}
+
+/* Index the lines starting in the blocks of region 'r'. A line belongs to
+ * the block it starts in, even when it ends in a later one. */
+static void trigramBuildRegion(std::shared_ptr<trigramBuild> b, size_t r) {
+    size_t first = r*b->per, last = std::min(b->nblocks,first+b->per);
+    size_t size = b->size, end = std::min(size,last*TRIGRAM_BLOCK);
+    size_t p = first*TRIGRAM_BLOCK, block = first;
+    const unsigned char *m = b->map;
+    std::vector<uint64_t> seen((1<<24)/64); /* Trigrams seen in 'block'. */
+    std::vector<uint32_t> touched;
+    trigramMap &map = b->maps[r];
+    std::vector<uint32_t> &counts = b->counts[r];
+
+    counts.assign(last-first,0);
+    if (p > 0) {
+        const unsigned char *nl = (const unsigned char*)memchr(m+p-1,'\n',size-p+1);
+        p = nl ? nl - m + 1 : size;
+    }
+    while (p < end && !b->cancel.load(std::memory_order_relaxed)) {
+        if (p/TRIGRAM_BLOCK != block) {
+            for (uint32_t key : touched) {
+                trigramAdd(&map[key],block);
+                seen[key>>6] &= ~(1ULL << (key&63));
+            }
+            touched.clear();
+            block = p/TRIGRAM_BLOCK;
+        }
+        const unsigned char *nl = (const unsigned char*)memchr(m+p,'\n',size-p);
+        size_t le = nl ? nl - m : size;
+        counts[block-first]++;
+        for (size_t j = p; j+2 < le; j++) {
+            uint32_t key = TRIGRAM_KEY(m[j],m[j+1],m[j+2]);
+            if (!(seen[key>>6] & (1ULL << (key&63)))) {
+                seen[key>>6] |= 1ULL << (key&63);
+                touched.push_back(key);
+            }
+        }
+        p = le+1;
+    }
+    for (uint32_t key : touched) trigramAdd(&map[key],block);
+
+    if (--b->pending == 0) trigramBuildMerge(b.get());
+}
+
+/* First task of a build: use the cache if possible, otherwise map the file
+ * and fan out one task per region. */
+static void trigramBuildStart(std::shared_ptr<trigramBuild> b) {
+    struct stat st;
+
+    if (trigramCacheLoad(b.get())) {
+        b->done = 1;
+        return;
+    }
+
+    int fd = open(b->filename.c_str(),O_RDONLY);
+    if (fd == -1) {
+        b->done = -1;
+        return;
+    }
+    void *map = MAP_FAILED;
+    if (fstat(fd,&st) == 0 && st.st_size == b->size &&
+        st.st_mtim.tv_sec == b->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == b->mtime.tv_nsec)
+        map = mmap(NULL,b->size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        b->done = -1;
+        return;
+    }
+    madvise(map,b->size,MADV_SEQUENTIAL);
+    b->map = (const unsigned char*)map;
+
+    editorPool *pool = poolGet();
+    size_t nregions = (b->nblocks + b->per - 1) / b->per;
+    b->maps.resize(nregions);
+    b->counts.resize(nregions);
+    b->pending = nregions;
+    for (size_t r = 0; r < nregions; r++)
+        poolSubmit(pool,[b,r] { trigramBuildRegion(b,r); });
+}
+
+/* Start indexing the file just loaded by editorOpen() if it is big enough.
+ * 'st' is the stat of the file as it was read. */
+void trigramStart(editorConfig *E, struct stat *st) {
+    editorTrigram *t = &E->trigram;
+
+    /* Line ids are 32 bit, with room left for the ones of edited lines. */
+    if (st->st_size < TRIGRAM_MIN_FILE_SIZE || E->numrows > UINT32_MAX/2) return;
+    std::shared_ptr<trigramBuild> b = std::make_shared<trigramBuild>();
+    b->filename = E->filename;
+    b->hash = E->file_hash;
+    b->nlines = E->numrows;
+    b->size = st->st_size;
+    b->mtime = st->st_mtim;
+    b->nblocks = (b->size + TRIGRAM_BLOCK - 1) / TRIGRAM_BLOCK;
+    b->per = (b->nblocks + poolGet()->nworkers - 1) / poolGet()->nworkers;
+    t->base = t->indexed = E->numrows;
+    t->build = b;
+    poolSubmit(poolGet(),[b] { trigramBuildStart(b); });
+}
+
+/* Drop the index, stopping the build if it is still running. */
+void trigramClose(editorConfig *E) {
+    if (E->trigram.build) E->trigram.build->cancel = 1;
+    E->trigram = editorTrigram();
+}
+
+/* Install the result of a finished build. */
+static void trigramPoll(editorConfig *E) {
+    editorTrigram *t = &E->trigram;
+    std::shared_ptr<trigramBuild> b = t->build;
+
+    if (!b || !b->done) return;
+    t->build.reset();
+    if (b->done != 1) return;
+    t->postings.swap(b->postings);
+    t->blockline.swap(b->blockline);
+    t->ready = 1;
+}
+
+/* Map line ids to rows, and index the rows changed since the last search,
+ * in line id order so that postings stay sorted. */
+static void trigramRefresh(editorConfig *E) {
+    editorTrigram *t = &E->trigram;
+
+    if (t->lidversion != E->version) {
+        t->lidrow.assign(t->nextlid,-1);
+        for (long long j = 0; j < E->numrows; j++) t->lidrow[E->row[j].lid] = j;
+        t->lidversion = E->version;
+    }
+    for (uint32_t lid = t->indexed; lid < t->nextlid; lid++) {
+        long long j = t->lidrow[lid];
+        if (j != -1) trigramIndexLine(t,lid,E->row[j].chars,E->row[j].size);
+    }
+    t->indexed = t->nextlid;
+}
+
+/* The content of 'row' changed: give it a fresh line id, unless the one it
+ * has is not indexed yet. */
+void trigramUpdateRow(editorConfig *E, erow *row) {
+    editorTrigram *t = &E->trigram;
+    if (row->lid < t->indexed || row->lid >= t->nextlid)
+        row->lid = t->nextlid++;
+}
+
+/* ---------------------------------- Search -------------------------------- */
+
+/* Fill E->search.matches for 'query' verifying only the candidate lines.
+ * Returns 1 on success, 0 if the index can't help: not built yet, query
+ * without a literal trigram, or so many candidates that the parallel full
+ * scan is the better deal. */
+int trigramSearch(editorConfig *E, const char *query, int qlen) {
+    editorSearch *s = &E->search;
+    editorTrigram *t = &E->trigram;
+    const char *lit = query;
+    size_t litlen = qlen;
+
+    trigramPoll(E);
+    if (!t->ready) return 0;
+    if (s->regex) lit = regexPrefix(s->re.get(),&litlen);
+    if (litlen < 3) return 0;
+    trigramRefresh(E);
+
+    /* Blocks in every posting list, intersecting from the shortest. */
+    std::vector<const trigramPosting*> lists;
+    const unsigned char *u = (const unsigned char*)lit;
+    for (size_t j = 0; j+2 < litlen; j++) {
+        auto it = t->postings.find(TRIGRAM_KEY(u[j],u[j+1],u[j+2]));
+        lists.push_back(it == t->postings.end() ? NULL : &it->second);
+    }
+    std::vector<uint32_t> blocks;
+    if (std::find(lists.begin(),lists.end(),nullptr) == lists.end()) {
+        std::sort(lists.begin(),lists.end(),
+            [](const trigramPosting *a, const trigramPosting *b) {
+                return a->data.size() < b->data.size();
+            });
+        lists.erase(std::unique(lists.begin(),lists.end()),lists.end());
+        blocks = trigramDecode(lists[0]);
+        for (size_t j = 1; j < lists.size() && !blocks.empty(); j++) {
+            std::vector<uint32_t> other = trigramDecode(lists[j]), both;
+            std::set_intersection(blocks.begin(),blocks.end(),
+                other.begin(),other.end(),std::back_inserter(both));
+            blocks.swap(both);
+        }
+    }
+
+    /* Blocks to rows. */
+    std::vector<long long> rows;
+    uint32_t nfb = t->blockline.size()-1;
+    for (uint32_t b : blocks) {
+        uint32_t lo, hi;
+        if (b < nfb) {
+            lo = t->blockline[b];
+            hi = t->blockline[b+1];
+        } else {
+            lo = t->base + (b-nfb)*TRIGRAM_EDIT_BLOCK;
+            hi = std::min(lo + TRIGRAM_EDIT_BLOCK,t->nextlid);
+        }
+        for (uint32_t lid = lo; lid < hi; lid++)
+            if (t->lidrow[lid] != -1) rows.push_back(t->lidrow[lid]);
+        if (rows.size() > (size_t)E->numrows/4) return 0;
+    }
+    std::sort(rows.begin(),rows.end());
+
+    /* Verify runs of consecutive candidate rows in the view. */
+    s->matches.clear();
+    s->matchlen.clear();
+    for (size_t j = 0; j < rows.size(); ) {
+        size_t k = j;
+        while (k+1 < rows.size() && rows[k+1] == rows[k]+1) k++;
+        const char *p = s->view + s->rowstart[rows[j]];
+        const char *end = s->view + s->rowstart[rows[k]] + E->row[rows[k]].size;
+        if (s->regex) {
+            regexFindAll(s->rm,p,end-p,p-s->view,&s->matches,&s->matchlen);
+        } else {
+            while ((p = searchMemmem(p,end-p,query,qlen,s->icase))) {
+                s->matches.push_back(p - s->view);
+                p++;
+            }
+        }
+        if (s->matches.size() > SEARCH_MAX_MATCHES) return 0;
+        j = k+1;
+    }
+
+    memcpy(s->query,query,qlen);
+    s->query[qlen] = '\0';
+    s->qlen = qlen;
+    s->qicase = s->icase;
+    s->qregex = s->regex;
+    s->qversion = s->version;
+    s->covered = s->len;
+    s->overflow = 0;
+    return 1;
+}
@@ -0,0 +1,238 @@
+#include "editor.h"
+
+/* ========================= Persistent undo journal ==========================
+ *
+ * When a file is saved the whole undo history is written to
+ * ".<filename>.undo" in the same directory, together with a hash of the
+ * content that was saved. When the same content is opened again the journal
+ * is mmap()ed and becomes the oldest part of the history: buses are decoded
+ * from the mapping one at a time by editorUndoGetBus(), so opening a file
+ * with a huge history only costs an open(), an mmap() and a header check. */
+
+/* 64 bit FNV-1a. Pass EDITOR_HASH_INIT as 'h' for the first chunk. */
+uint64_t editorHashBytes(uint64_t h, const void *p, size_t len) {
+    const unsigned char *s = (const unsigned char*)p;
+    for (size_t j = 0; j < len; j++) {
+        h ^= s[j];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Store in 'buf' the path of a file kept along 'filename': same directory,
+ * hidden, with extension 'ext'. */
+void editorSidecarPath(const char *filename, const char *ext, char *buf, size_t buflen) {
+    const char *base = strrchr(filename,'/');
+    if (base)
+        snprintf(buf,buflen,"%.*s/.%s.%s",
+            (int)(base-filename),filename,base+1,ext);
+    else
+        snprintf(buf,buflen,".%s.%s",filename,ext);
+}
+
+size_t editorUndoHistorySize(editorConfig *E) {
+    return E->m_journal.nbuses + E->m_command_queue.size();
+}
+
+/* Fetch the bus at index 'i' of the history, decoding it from the mapped
+ * journal if it is old enough to live there. */
+void editorUndoGetBus(editorConfig *E, size_t i, UndoCommandBus *bus) {
+    UndoJournal *j = &E->m_journal;
+
+    bus->clear();
+    if (i >= j->nbuses) {
+        *bus = E->m_command_queue[i - j->nbuses];
+        return;
+    }
+    for (uint64_t k = j->offsets[i]; k < j->offsets[i+1]; k++) {
+        UndoCommand cmd;
+        cmd.ID = j->cmds[k].ID;
+        cmd.c = j->cmds[k].c;
+        cmd.pos = {j->cmds[k].x, j->cmds[k].y};
+        if (cmd.ID == UNDO_CMD_REPLACE_ROW) {
+            uint64_t t = (uint64_t)j->cmds[k].x;
+            if (t+1 >= j->ntexts) continue;
+            std::shared_ptr<UndoRowText> text = std::make_shared<UndoRowText>();
+            const uint64_t *o = j->textoffs;
+            text->before.assign(j->texts+o[t],o[t+1]-o[t]);
+            text->after.assign(j->texts+o[t+1],o[t+2]-o[t+1]);
+            cmd.text = text;
+        }
+        bus->push_back(cmd);
+    }
+}
+
+void editorUndoJournalClose(editorConfig *E) {
+    UndoJournal *j = &E->m_journal;
+    if (j->map) munmap(j->map,j->maplen);
+    *j = UndoJournal();
+}
+
+/* True if the n+1 offsets at 'o' never decrease and end at 'end', so that
+ * every range between two of them is within the 'end' items they index. */
+static int editorUndoJournalOffsetsOk(const uint64_t *o, uint64_t n, uint64_t end) {
+    for (uint64_t k = 0; k < n; k++)
+        if (o[k] > o[k+1]) return 0;
+    return o[n] == end;
+}
+
+/* Map the journal of the current file if there is one matching the content
+ * we just loaded. Any problem just means starting with an empty history. */
+void editorUndoJournalLoad(editorConfig *E) {
+    char path[PATH_MAX];
+    struct stat st;
+    UndoJournalHeader *h;
+    void *map;
+    uint64_t need;
+
+    editorUndoJournalClose(E);
+    editorSidecarPath(E->filename,"undo",path,sizeof(path));
+    int fd = open(path,O_RDONLY);
+    if (fd == -1) return;
+    if (fstat(fd,&st) == -1 || (size_t)st.st_size < sizeof(*h)) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    h = (UndoJournalHeader*)map;
+    need = sizeof(*h) + (h->nbuses+1)*sizeof(uint64_t) +
+           (h->ntexts+1)*sizeof(uint64_t) +
+           h->ncmds*sizeof(UndoDiskCommand) + h->textbytes;
+    if (memcmp(h->magic,UNDO_JOURNAL_MAGIC,sizeof(h->magic)) ||
+        h->content_hash != E->file_hash ||
+        h->nbuses > (uint64_t)st.st_size || h->ncmds > (uint64_t)st.st_size ||
+        h->ntexts > (uint64_t)st.st_size ||
+        h->textbytes > (uint64_t)st.st_size ||
+        h->index > h->nbuses ||
+        need != (uint64_t)st.st_size)
+    {
+        munmap(map,st.st_size);
+        return;
+    }
+
+    UndoJournal *j = &E->m_journal;
+    j->map = map;
+    j->maplen = st.st_size;
+    j->offsets = (const uint64_t*)(h+1);
+    j->textoffs = j->offsets + h->nbuses + 1;
+    j->cmds = (const UndoDiskCommand*)(j->textoffs + h->ntexts + 1);
+    j->texts = (const char*)(j->cmds + h->ncmds);
+    j->ntexts = h->ntexts;
+    if (!editorUndoJournalOffsetsOk(j->offsets,h->nbuses,h->ncmds) ||
+        !editorUndoJournalOffsetsOk(j->textoffs,h->ntexts,h->textbytes))
+    {
+        editorUndoJournalClose(E);
+        return;
+    }
+    j->nbuses = h->nbuses;
+    E->m_command_queue.clear();
+    E->m_command_index = h->index;
+}
+
+/* Write the whole history for the content hashed in E->file_hash. The new
+ * journal is written aside and renamed over the old one, then mapped in place
+ * of the in memory queue. Returns 0 on success, -1 on error. */
+int editorUndoJournalWrite(editorConfig *E) {
+    char path[PATH_MAX], tmppath[PATH_MAX+8];
+    UndoJournal *j = &E->m_journal;
+    UndoJournalHeader h;
+    uint64_t off, jcmds = j->nbuses ? j->offsets[j->nbuses] : 0;
+    uint64_t jtexts = 0, jtextbytes = 0;
+    FILE *fp;
+
+    /* The texts of the mapped buses still in history are kept as they are,
+     * with the texts that follow them. Cheap enough to copy them all. */
+    if (j->nbuses) {
+        jtexts = j->ntexts;
+        jtextbytes = j->textoffs[j->ntexts];
+    }
+
+    editorSidecarPath(E->filename,"undo",path,sizeof(path));
+    snprintf(tmppath,sizeof(tmppath),"%s.tmp",path);
+    fp = fopen(tmppath,"w");
+    if (!fp) return -1;
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,UNDO_JOURNAL_MAGIC,sizeof(h.magic));
+    h.content_hash = E->file_hash;
+    h.nbuses = editorUndoHistorySize(E);
+    h.index = E->m_command_index;
+    h.ncmds = jcmds;
+    h.ntexts = jtexts;
+    h.textbytes = jtextbytes;
+    for (auto &bus : E->m_command_queue) {
+        h.ncmds += bus.size();
+        for (auto &cmd : bus) {
+            if (cmd.ID != UNDO_CMD_REPLACE_ROW) continue;
+            h.ntexts += 2;
+            h.textbytes += cmd.text->before.size() + cmd.text->after.size();
+        }
+    }
+    fwrite(&h,sizeof(h),1,fp);
+
+    /* Offsets: the mapped ones are still valid as a prefix. */
+    if (j->nbuses) fwrite(j->offsets,sizeof(uint64_t),j->nbuses,fp);
+    off = jcmds;
+    for (auto &bus : E->m_command_queue) {
+        fwrite(&off,sizeof(off),1,fp);
+        off += bus.size();
+    }
+    fwrite(&off,sizeof(off),1,fp);
+
+    /* Text offsets. */
+    if (jtexts) fwrite(j->textoffs,sizeof(uint64_t),jtexts,fp);
+    off = jtextbytes;
+    for (auto &bus : E->m_command_queue) {
+        for (auto &cmd : bus) {
+            if (cmd.ID != UNDO_CMD_REPLACE_ROW) continue;
+            fwrite(&off,sizeof(off),1,fp);
+            off += cmd.text->before.size();
+            fwrite(&off,sizeof(off),1,fp);
+            off += cmd.text->after.size();
+        }
+    }
+    fwrite(&off,sizeof(off),1,fp);
+
+    /* Commands. */
+    uint64_t text = jtexts;
+    if (jcmds) fwrite(j->cmds,sizeof(UndoDiskCommand),jcmds,fp);
+    for (auto &bus : E->m_command_queue) {
+        for (auto &cmd : bus) {
+            UndoDiskCommand dc;
+            memset(&dc,0,sizeof(dc));
+            dc.x = cmd.pos.x;
+            dc.y = cmd.pos.y;
+            dc.ID = cmd.ID;
+            dc.c = cmd.c;
+            if (cmd.ID == UNDO_CMD_REPLACE_ROW) {
+                dc.x = (int64_t)text;
+                text += 2;
+            }
+            fwrite(&dc,sizeof(dc),1,fp);
+        }
+    }
+
+    /* Texts. */
+    if (jtextbytes) fwrite(j->texts,1,jtextbytes,fp);
+    for (auto &bus : E->m_command_queue) {
+        for (auto &cmd : bus) {
+            if (cmd.ID != UNDO_CMD_REPLACE_ROW) continue;
+            fwrite(cmd.text->before.data(),1,cmd.text->before.size(),fp);
+            fwrite(cmd.text->after.data(),1,cmd.text->after.size(),fp);
+        }
+    }
+
+    if (fclose(fp) == EOF || rename(tmppath,path) == -1) {
+        unlink(tmppath);
+        return -1;
+    }
+
+    /* The history now lives on disk: drop the queue and map the new file. */
+    uint64_t index = E->m_command_index;
+    editorUndoJournalLoad(E);
+    E->m_command_index = index;
+    return 0;
+}
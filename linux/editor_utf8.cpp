@@ -0,0 +1,105 @@
+#include "editor.h"
+
+#include <algorithm>
+
+/* =================================== UTF-8 ==================================
+ *
+ * Rows are shown as UTF-8: a valid sequence is one char, taking the columns
+ * its width says, and any other byte above 0x7f is shown as a '?' of its
+ * own. Most rows of most files are pure ASCII: the pass over the row that
+ * counts its TABs tells, and those rows skip everything else.
+ *
+ * Widths come from a table of the ranges of wide (East Asian, emoji) and
+ * zero width (combining, format) code points, kept small by leaving out the
+ * rare ones. The answers for the BMP, where nearly all text is, are cached
+ * so that a row of CJK costs a lookup per char. */
+
+/* Decode the UTF-8 sequence at 's', of at most 'len' bytes, into '*cp'.
+ * Returns its size, or 0 if it is not a valid one: truncated, overlong, a
+ * surrogate or past U+10FFFF. */
+int utf8Decode(const char *s, size_t len, uint32_t *cp) {
+    const unsigned char *p = (const unsigned char*)s;
+    uint32_t c, min;
+    int n;
+
+    if (len == 0) return 0;
+    if (p[0] < 0x80) {
+        *cp = p[0];
+        return 1;
+    } else if ((p[0] & 0xe0) == 0xc0) {
+        c = p[0] & 0x1f; n = 2; min = 0x80;
+    } else if ((p[0] & 0xf0) == 0xe0) {
+        c = p[0] & 0x0f; n = 3; min = 0x800;
+    } else if ((p[0] & 0xf8) == 0xf0) {
+        c = p[0] & 0x07; n = 4; min = 0x10000;
+    } else {
+        return 0;
+    }
+    if ((size_t)n > len) return 0;
+    for (int j = 1; j < n; j++) {
+        if ((p[j] & 0xc0) != 0x80) return 0;
+        c = (c << 6) | (p[j] & 0x3f);
+    }
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) return 0;
+    *cp = c;
+    return n;
+}
+
+struct utf8Range {
+    uint32_t first, last;
+    signed char width;
+};
+
+/* Code points not one column wide, sorted. */
+static const utf8Range utf8Widths[] = {
+    {0x0300,0x036f,0}, {0x0483,0x0489,0}, {0x0591,0x05bd,0}, {0x05bf,0x05bf,0},
+    {0x05c1,0x05c2,0}, {0x05c4,0x05c5,0}, {0x05c7,0x05c7,0}, {0x0610,0x061a,0},
+    {0x064b,0x065f,0}, {0x0670,0x0670,0}, {0x06d6,0x06dc,0}, {0x06df,0x06e4,0},
+    {0x06e7,0x06e8,0}, {0x06ea,0x06ed,0}, {0x0900,0x0902,0}, {0x093a,0x093a,0},
+    {0x093c,0x093c,0}, {0x0941,0x0948,0}, {0x094d,0x094d,0}, {0x0951,0x0957,0},
+    {0x0e31,0x0e31,0}, {0x0e34,0x0e3a,0}, {0x0e47,0x0e4e,0}, {0x1100,0x115f,2},
+    {0x1ab0,0x1aff,0}, {0x1dc0,0x1dff,0}, {0x200b,0x200f,0}, {0x202a,0x202e,0},
+    {0x2060,0x2064,0}, {0x20d0,0x20ff,0}, {0x231a,0x231b,2}, {0x2329,0x232a,2},
+    {0x23e9,0x23ec,2}, {0x23f0,0x23f0,2}, {0x23f3,0x23f3,2}, {0x25fd,0x25fe,2},
+    {0x2614,0x2615,2}, {0x2648,0x2653,2}, {0x267f,0x267f,2}, {0x2693,0x2693,2},
+    {0x26a1,0x26a1,2}, {0x26aa,0x26ab,2}, {0x26bd,0x26be,2}, {0x26c4,0x26c5,2},
+    {0x26ce,0x26ce,2}, {0x26d4,0x26d4,2}, {0x26ea,0x26ea,2}, {0x26f2,0x26f3,2},
+    {0x26f5,0x26f5,2}, {0x26fa,0x26fa,2}, {0x26fd,0x26fd,2}, {0x2705,0x2705,2},
+    {0x270a,0x270b,2}, {0x2728,0x2728,2}, {0x274c,0x274c,2}, {0x274e,0x274e,2},
+    {0x2753,0x2755,2}, {0x2757,0x2757,2}, {0x2795,0x2797,2}, {0x27b0,0x27b0,2},
+    {0x27bf,0x27bf,2}, {0x2b1b,0x2b1c,2}, {0x2b50,0x2b50,2}, {0x2b55,0x2b55,2},
+    {0x2e80,0x3029,2}, {0x302a,0x302d,0}, {0x302e,0x303e,2}, {0x3041,0x3098,2},
+    {0x3099,0x309a,0}, {0x309b,0xa4cf,2}, {0xa960,0xa97f,2}, {0xac00,0xd7a3,2},
+    {0xf900,0xfaff,2}, {0xfe00,0xfe0f,0}, {0xfe10,0xfe19,2}, {0xfe20,0xfe2f,0},
+    {0xfe30,0xfe6f,2}, {0xfeff,0xfeff,0}, {0xff00,0xff60,2}, {0xffe0,0xffe6,2},
+    {0x16fe0,0x16fe4,2}, {0x17000,0x18aff,2}, {0x1b000,0x1b2ff,2},
+    {0x1f004,0x1f004,2}, {0x1f0cf,0x1f0cf,2}, {0x1f18e,0x1f18e,2},
+    {0x1f191,0x1f19a,2}, {0x1f200,0x1f202,2}, {0x1f210,0x1f23b,2},
+    {0x1f240,0x1f248,2}, {0x1f250,0x1f251,2}, {0x1f260,0x1f265,2},
+    {0x1f300,0x1f64f,2}, {0x1f680,0x1f6ff,2}, {0x1f7e0,0x1f7eb,2},
+    {0x1f90c,0x1f9ff,2}, {0x1fa70,0x1faff,2}, {0x20000,0x2fffd,2},
+    {0x30000,0x3fffd,2}, {0xe0001,0xe0001,0}, {0xe0020,0xe007f,0},
+    {0xe0100,0xe01ef,0},
+};
+
+static int utf8LookupWidth(uint32_t cp) {
+    const utf8Range *end = utf8Widths+sizeof(utf8Widths)/sizeof(utf8Widths[0]);
+    const utf8Range *r = std::upper_bound(utf8Widths,end,cp,
+        [](uint32_t c, const utf8Range &range) { return c < range.first; });
+    if (r != utf8Widths && cp <= r[-1].last) return r[-1].width;
+    return 1;
+}
+
+/* Columns the code point 'cp' takes on screen: 2 for wide chars, 0 for
+ * the ones combining with the char before, -1 for controls, that are not
+ * shown as they are. */
+int utf8Width(uint32_t cp) {
+    /* Width+2 of every BMP code point looked up so far, 0 if not yet. */
+    static unsigned char cache[0x10000];
+
+    if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) return -1;
+    if (cp < 0x300) return 1;
+    if (cp > 0xffff) return utf8LookupWidth(cp);
+    if (cache[cp] == 0) cache[cp] = utf8LookupWidth(cp)+2;
+    return cache[cp]-2;
+}
@@ -0,0 +1,415 @@
+#include "editor.h"
+
+#include <algorithm>
+
+/* ============================== Terminal model ==============================
+ *
+ * A model of the VT100 (and the parts of xterm) the editor draws on: it
+ * takes the bytes written to the terminal and keeps the grid of cells they
+ * leave, with their colors, and the cursor. It is what tells whether a
+ * change of editorRefreshScreen() still shows the same screen, and how many
+ * bytes and escape sequences it takes to do it: see "screen" in batch mode
+ * and bench_keys.cpp.
+ *
+ * Understood: printable chars as UTF-8, wide ones taking two cells, with
+ * autowrap; CR, LF, BS, TAB; cursor moves (CUP, CUU/CUD/CUF/CUB, CHA, VPA,
+ * ESC 7 / ESC 8); erase in line and display, insert/delete/erase chars;
+ * SGR bold, underline, inverse and colors, 8, 16 and 256 of them; scroll
+ * regions (DECSTBM) with LF, RI, SU/SD and insert/delete lines; modes ?7
+ * and ?25. Anything else is read whole and counted in vt->unknown. */
+
+enum { VT_GROUND, VT_ESC, VT_CSI, VT_OSC, VT_CHARSET };
+
+static vtCell vtBlank(vtScreen *vt) {
+    /* Erased cells take the background of the pen, as xterm does. */
+    vtCell c = {' ',-1,vt->pen.bg,0};
+    return c;
+}
+
+void vtInit(vtScreen *vt, int rows, int cols) {
+    *vt = vtScreen();
+    vt->rows = rows;
+    vt->cols = cols;
+    vt->pen = {' ',-1,-1,0};
+    vt->savedpen = vt->pen;
+    vt->cells.assign((size_t)rows*cols,vt->pen);
+    vt->bottom = rows-1;
+    vt->autowrap = 1;
+    vt->cursor = 1;
+}
+
+vtCell *vtAt(vtScreen *vt, int y, int x) {
+    return &vt->cells[(size_t)y*vt->cols+x];
+}
+
+/* The text of row 'y' as UTF-8, without the blanks at its end. */
+std::string vtRowText(vtScreen *vt, int y) {
+    std::string s;
+    size_t keep = 0;
+
+    for (int x = 0; x < vt->cols; x++) {
+        uint32_t c = vtAt(vt,y,x)->ch;
+        if (c == 0) continue;
+        if (c < 0x80) {
+            s += (char)c;
+        } else if (c < 0x800) {
+            s += (char)(0xc0 | c>>6);
+            s += (char)(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            s += (char)(0xe0 | c>>12);
+            s += (char)(0x80 | (c>>6 & 0x3f));
+            s += (char)(0x80 | (c & 0x3f));
+        } else {
+            s += (char)(0xf0 | c>>18);
+            s += (char)(0x80 | (c>>12 & 0x3f));
+            s += (char)(0x80 | (c>>6 & 0x3f));
+            s += (char)(0x80 | (c & 0x3f));
+        }
+        if (c != ' ') keep = s.size();
+    }
+    s.resize(keep);
+    return s;
+}
+
+/* Cells written over must not leave half of a wide char. */
+static void vtSplitWide(vtScreen *vt, int y, int x) {
+    vtCell *c = vtAt(vt,y,x);
+    if (c->ch == 0 && x > 0) vtAt(vt,y,x-1)->ch = ' ';
+    if (x+1 < vt->cols && vtAt(vt,y,x+1)->ch == 0) vtAt(vt,y,x+1)->ch = ' ';
+}
+
+/* Blank the cells from 'x' to 'x'+'n' of row 'y'. */
+static void vtErase(vtScreen *vt, int y, int x, int n) {
+    vtCell blank = vtBlank(vt);
+    int end = std::min(x+n,vt->cols);
+
+    if (x >= end) return;
+    vtSplitWide(vt,y,x);
+    vtSplitWide(vt,y,end-1);
+    for (int j = x; j < end; j++) *vtAt(vt,y,j) = blank;
+}
+
+/* Move the rows from 'top' to 'bottom' up by 'n', blanking the ones left at
+ * the bottom. Negative 'n' moves them down. */
+static void vtScroll(vtScreen *vt, int top, int bottom, int n) {
+    int height = bottom-top+1;
+    if (n > height) n = height;
+    if (n < -height) n = -height;
+    if (n == 0) return;
+
+    vtCell *base = vtAt(vt,top,0);
+    size_t rowlen = vt->cols;
+    if (n > 0) {
+        memmove(base,base+n*rowlen,sizeof(vtCell)*(height-n)*rowlen);
+        for (int y = bottom-n+1; y <= bottom; y++) vtErase(vt,y,0,vt->cols);
+    } else {
+        n = -n;
+        memmove(base+n*rowlen,base,sizeof(vtCell)*(height-n)*rowlen);
+        for (int y = top; y < top+n; y++) vtErase(vt,y,0,vt->cols);
+    }
+}
+
+static void vtLineFeed(vtScreen *vt) {
+    if (vt->y == vt->bottom)
+        vtScroll(vt,vt->top,vt->bottom,1);
+    else if (vt->y < vt->rows-1)
+        vt->y++;
+}
+
+static void vtPut(vtScreen *vt, uint32_t cp) {
+    int w = utf8Width(cp);
+    if (w == 0) return; /* Combining: the cell keeps its base char. */
+    if (w < 0) w = 1;
+    if (w > vt->cols) return;
+
+    if (vt->wrapnext || (w == 2 && vt->x == vt->cols-1 && vt->autowrap)) {
+        if (vt->autowrap) {
+            vt->x = 0;
+            vtLineFeed(vt);
+        }
+        vt->wrapnext = 0;
+    }
+    if (vt->x+w > vt->cols) vt->x = vt->cols-w;
+    vtSplitWide(vt,vt->y,vt->x);
+    if (w == 2) vtSplitWide(vt,vt->y,vt->x+1);
+    vtCell *c = vtAt(vt,vt->y,vt->x);
+    *c = vt->pen;
+    c->ch = cp;
+    if (w == 2) {
+        c[1] = vt->pen;
+        c[1].ch = 0;
+    }
+    vt->printed++;
+    vt->x += w;
+    if (vt->x >= vt->cols) {
+        vt->x = vt->cols-1;
+        vt->wrapnext = vt->autowrap;
+    }
+}
+
+/* Parameter 'i' of the CSI sequence, 'def' if it is missing or 0. */
+static int vtParam(const std::vector<int> &p, size_t i, int def) {
+    return i < p.size() && p[i] > 0 ? p[i] : def;
+}
+
+static void vtSgr(vtScreen *vt, const std::vector<int> &p) {
+    if (p.empty()) {
+        vt->pen = {' ',-1,-1,0};
+        return;
+    }
+    for (size_t i = 0; i < p.size(); i++) {
+        int n = p[i];
+        if (n == 0) vt->pen = {' ',-1,-1,0};
+        else if (n == 1) vt->pen.attr |= VT_BOLD;
+        else if (n == 4) vt->pen.attr |= VT_UNDERLINE;
+        else if (n == 7) vt->pen.attr |= VT_INVERSE;
+        else if (n == 22) vt->pen.attr &= ~VT_BOLD;
+        else if (n == 24) vt->pen.attr &= ~VT_UNDERLINE;
+        else if (n == 27) vt->pen.attr &= ~VT_INVERSE;
+        else if (n >= 30 && n <= 37) vt->pen.fg = n-30;
+        else if (n == 39) vt->pen.fg = -1;
+        else if (n >= 40 && n <= 47) vt->pen.bg = n-40;
+        else if (n == 49) vt->pen.bg = -1;
+        else if (n >= 90 && n <= 97) vt->pen.fg = n-90+8;
+        else if (n >= 100 && n <= 107) vt->pen.bg = n-100+8;
+        else if ((n == 38 || n == 48) && i+2 < p.size() && p[i+1] == 5) {
+            short color = p[i+2] & 0xff;
+            if (n == 38) vt->pen.fg = color; else vt->pen.bg = color;
+            i += 2;
+        } else if ((n == 38 || n == 48) && i+1 < p.size() && p[i+1] == 2) {
+            i += 4; /* True color: no palette index for it. */
+            vt->unknown++;
+        }
+    }
+}
+
+static void vtCsi(vtScreen *vt) {
+    const std::string &s = vt->seq;
+    char final = s.back();
+    int priv = s[0] == '?';
+    std::vector<int> p;
+
+    /* Parameters, as numbers separated by ';'. */
+    size_t i = priv;
+    if (i < s.size()-1) p.push_back(0);
+    for (; i < s.size()-1; i++) {
+        if (isdigit(s[i])) p.back() = p.back()*10 + (s[i]-'0');
+        else if (s[i] == ';') p.push_back(0);
+    }
+
+    int n = vtParam(p,0,1);
+    if (priv) {
+        if (final != 'h' && final != 'l') {
+            vt->unknown++;
+            return;
+        }
+        for (int mode : p) {
+            if (mode == 25) vt->cursor = final == 'h';
+            else if (mode == 7) vt->autowrap = final == 'h';
+            else vt->unknown++;
+        }
+        return;
+    }
+
+    if (final != 'm') vt->wrapnext = 0;
+    switch(final) {
+    case 'A': vt->y = std::max(vt->y-n,0); break;
+    case 'B': vt->y = std::min(vt->y+n,vt->rows-1); break;
+    case 'C': vt->x = std::min(vt->x+n,vt->cols-1); break;
+    case 'D': vt->x = std::max(vt->x-n,0); break;
+    case 'G': vt->x = std::min(n,vt->cols)-1; break;
+    case 'd': vt->y = std::min(n,vt->rows)-1; break;
+    case 'H':
+    case 'f':
+        vt->y = std::min(vtParam(p,0,1),vt->rows)-1;
+        vt->x = std::min(vtParam(p,1,1),vt->cols)-1;
+        break;
+    case 'J': {
+        int mode = p.empty() ? 0 : p[0];
+        if (mode == 0) {
+            vtErase(vt,vt->y,vt->x,vt->cols);
+            for (int y = vt->y+1; y < vt->rows; y++) vtErase(vt,y,0,vt->cols);
+        } else if (mode == 1) {
+            for (int y = 0; y < vt->y; y++) vtErase(vt,y,0,vt->cols);
+            vtErase(vt,vt->y,0,vt->x+1);
+        } else {
+            for (int y = 0; y < vt->rows; y++) vtErase(vt,y,0,vt->cols);
+        }
+        break;
+    }
+    case 'K': {
+        int mode = p.empty() ? 0 : p[0];
+        if (mode == 0) vtErase(vt,vt->y,vt->x,vt->cols);
+        else if (mode == 1) vtErase(vt,vt->y,0,vt->x+1);
+        else vtErase(vt,vt->y,0,vt->cols);
+        break;
+    }
+    case 'X':
+        vtErase(vt,vt->y,vt->x,n);
+        break;
+    case '@':
+    case 'P': {
+        vtCell *row = vtAt(vt,vt->y,0);
+        int x = vt->x, len = vt->cols-x;
+        if (n > len) n = len;
+        vtSplitWide(vt,vt->y,x);
+        if (final == '@') {
+            memmove(row+x+n,row+x,sizeof(vtCell)*(len-n));
+            vtErase(vt,vt->y,x,n);
+        } else {
+            memmove(row+x,row+x+n,sizeof(vtCell)*(len-n));
+            vtErase(vt,vt->y,vt->cols-n,n);
+        }
+        break;
+    }
+    case 'S': vtScroll(vt,vt->top,vt->bottom,n); break;
+    case 'T': vtScroll(vt,vt->top,vt->bottom,-n); break;
+    case 'L':
+    case 'M':
+        if (vt->y >= vt->top && vt->y <= vt->bottom) {
+            vtScroll(vt,vt->y,vt->bottom,final == 'L' ? -n : n);
+            vt->x = 0;
+        }
+        break;
+    case 'm': vtSgr(vt,p); break;
+    case 'r': {
+        int top = vtParam(p,0,1)-1, bottom = vtParam(p,1,vt->rows)-1;
+        if (bottom >= vt->rows) bottom = vt->rows-1;
+        if (top < bottom) {
+            vt->top = top;
+            vt->bottom = bottom;
+            vt->x = vt->y = 0;
+            vt->wrapnext = 0;
+        }
+        break;
+    }
+    default:
+        vt->unknown++;
+        break;
+    }
+}
+
+static void vtEsc(vtScreen *vt, char c) {
+    switch(c) {
+    case '7':
+        vt->savedx = vt->x;
+        vt->savedy = vt->y;
+        vt->savedpen = vt->pen;
+        break;
+    case '8':
+        vt->x = vt->savedx;
+        vt->y = vt->savedy;
+        vt->pen = vt->savedpen;
+        vt->wrapnext = 0;
+        break;
+    case 'D': vtLineFeed(vt); break;
+    case 'E': vt->x = 0; vtLineFeed(vt); break;
+    case 'M':
+        if (vt->y == vt->top) vtScroll(vt,vt->top,vt->bottom,-1);
+        else if (vt->y > 0) vt->y--;
+        break;
+    case 'c': {
+        vtScreen fresh;
+        vtInit(&fresh,vt->rows,vt->cols);
+        fresh.bytes = vt->bytes;
+        fresh.sequences = vt->sequences;
+        fresh.unknown = vt->unknown;
+        fresh.printed = vt->printed;
+        *vt = fresh;
+        break;
+    }
+    default:
+        vt->unknown++;
+        break;
+    }
+}
+
+/* Read the bytes 's' written to the terminal. Sequences and UTF-8 chars can
+ * be split between calls. */
+void vtFeed(vtScreen *vt, const char *s, size_t len) {
+    vt->bytes += len;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+
+        switch(vt->state) {
+        case VT_ESC:
+            if (c == '[') {
+                vt->state = VT_CSI; /* Counted when complete. */
+                vt->seq.clear();
+                continue;
+            }
+            vt->sequences++;
+            if (c == ']') {
+                vt->state = VT_OSC;
+                vt->unknown++;
+            } else if (c == '(' || c == ')') {
+                vt->state = VT_CHARSET;
+            } else {
+                vtEsc(vt,c);
+                vt->state = VT_GROUND;
+            }
+            continue;
+        case VT_CSI:
+            vt->seq += c;
+            if (c >= 0x40 && c <= 0x7e) {
+                vt->sequences++;
+                vtCsi(vt);
+                vt->state = VT_GROUND;
+            }
+            continue;
+        case VT_OSC:
+            /* Ends with BEL, or ESC \ that leaves the ESC to the ground. */
+            if (c == 7) vt->state = VT_GROUND;
+            else if (c == 0x1b) vt->state = VT_ESC;
+            continue;
+        case VT_CHARSET:
+            vt->state = VT_GROUND;
+            continue;
+        }
+
+        /* Ground. */
+        if (vt->ulen) {
+            if ((c & 0xc0) == 0x80) {
+                uint32_t cp;
+                vt->utf8[vt->ulen++] = c;
+                int n = utf8Decode(vt->utf8,vt->ulen,&cp);
+                if (n) {
+                    vtPut(vt,cp);
+                    vt->ulen = 0;
+                } else if (vt->ulen == 4) {
+                    vtPut(vt,0xfffd);
+                    vt->ulen = 0;
+                }
+                continue;
+            }
+            vtPut(vt,0xfffd); /* Cut short. */
+            vt->ulen = 0;
+        }
+        if (c >= 0x80) {
+            vt->utf8[vt->ulen++] = c;
+            continue;
+        }
+        if (c >= 0x20 && c != 0x7f) {
+            vtPut(vt,c);
+            continue;
+        }
+
+        switch(c) {
+        case 0x1b: vt->state = VT_ESC; break;
+        case '\r': vt->x = 0; vt->wrapnext = 0; break;
+        case '\n':
+        case '\v':
+        case '\f': vtLineFeed(vt); vt->wrapnext = 0; break;
+        case '\b':
+            if (vt->x > 0) vt->x--;
+            vt->wrapnext = 0;
+            break;
+        case '\t':
+            vt->x = std::min((vt->x/8+1)*8,vt->cols-1);
+            vt->wrapnext = 0;
+            break;
+        case 7: case 0: case 0x7f: break;
+        default: vt->unknown++; break;
+        }
+    }
+}
@@ -0,0 +1,316 @@
+#include "editor.h"
+#include <algorithm>
+
+/* ================================ Soft wrap =================================
+ *
+ * With soft wrap on ('w' in normal mode) rows wider than the screen continue
+ * on the lines below instead of scrolling horizontally. Rows break after the
+ * last space that fits, or at the screen width if there is none. Long rows
+ * (editor_longline.cpp) always break at the screen width.
+ *
+ * The screen column where every line of a row starts is laid out lazily,
+ * when the row is shown or the cursor goes there, and kept until the row
+ * changes or the screen width does. A Fenwick tree holds the number of lines
+ * of every row, so that file rows and screen lines map to each other in
+ * O(log n). Rows not laid out yet are counted as if they broke at the screen
+ * width, the least lines they can take, and corrected when laid out.
+ *
+ * The top of the screen is line E->wrap.lineoff of the row E->rowoff. The
+ * cursor keeps its file position in rowoff+cy and coloff+cx as without wrap:
+ * only where it is shown changes. */
+
+/* Lines 'row' takes if broken at the screen width. A row as wide as the
+ * screen takes an empty line after it, where the cursor can go. */
+static long long wrapEstimate(editorWrap *w, erow *row) {
+    return editorRowWidth(row)/w->cols + 1;
+}
+
+static void wrapAdd(editorWrap *w, long long idx, long long delta) {
+    for (idx++; idx < (long long)w->tree.size(); idx += idx & -idx)
+        w->tree[idx] += delta;
+}
+
+/* Build the tree again, for a new screen width or after rows were inserted
+ * or deleted. Rows laid out for this width keep their count, the others
+ * are laid out again when needed. */
+static void wrapSync(editorConfig *E) {
+    editorWrap *w = &E->wrap;
+
+    if (w->cols != E->screencols) {
+        w->cols = E->screencols;
+        w->valid = 0;
+    }
+    if (w->valid) return;
+    w->tree.assign(E->numrows+1,0);
+    for (long long j = 0; j < E->numrows; j++) {
+        erow *row = &E->row[j];
+        if (row->wrapcols != w->cols) {
+            row->wrapcols = 0;
+            row->wraplines = wrapEstimate(w,row);
+        }
+        w->tree[j+1] += row->wraplines;
+        long long up = (j+1) + ((j+1) & -(j+1));
+        if (up <= E->numrows) w->tree[up] += w->tree[j+1];
+    }
+    w->valid = 1;
+}
+
+/* Lines taken by the rows before 'idx'. Rows past the end take one. */
+static long long wrapPrefix(editorConfig *E, long long idx) {
+    long long lines = 0, extra = 0;
+    if (idx > E->numrows) {
+        extra = idx-E->numrows;
+        idx = E->numrows;
+    }
+    for (; idx > 0; idx -= idx & -idx) lines += E->wrap.tree[idx];
+    return lines+extra;
+}
+
+/* Row shown at the screen line 'line' counting from the top of the file,
+ * setting '*sub' to the line of the row it is. */
+static long long wrapFind(editorConfig *E, long long line, long long *sub) {
+    std::vector<long long> &tree = E->wrap.tree;
+    long long n = E->numrows, pos = 0, step = 1;
+
+    while (step*2 <= n) step *= 2;
+    for (; step; step /= 2) {
+        if (pos+step <= n && tree[pos+step] <= line) {
+            pos += step;
+            line -= tree[pos];
+        }
+    }
+    if (pos >= n) {
+        *sub = 0;
+        return n+line;
+    }
+    *sub = line;
+    return pos;
+}
+
+/* Lay out the lines of 'row' for the current screen width. */
+static void wrapLayout(editorConfig *E, erow *row) {
+    editorWrap *w = &E->wrap;
+    std::vector<long long> starts;
+
+    if (row->wrapcols == w->cols) return;
+    free(row->wrap);
+    row->wrap = NULL;
+    long long lines = wrapEstimate(w,row);
+    if (!row->ll) {
+        long long s = 0, width = editorRowWidth(row);
+        while (width-s >= w->cols) {
+            /* The render bytes of the chars that fit: for rows of ASCII
+             * the same as their columns. */
+            long long b = editorRowRxToRender(row,s);
+            long long e = editorRowRxToRender(row,s+w->cols);
+            const char *sp = (const char*)memrchr(row->render+b,' ',e-b);
+            long long next = editorRowRenderToRx(row,sp ? sp-row->render+1 : e);
+            s = next > s ? next : s+w->cols;
+            starts.push_back(s);
+        }
+        lines = starts.size()+1;
+        if (!starts.empty()) {
+            row->wrap = (long long*)malloc(sizeof(long long)*starts.size());
+            memcpy(row->wrap,starts.data(),sizeof(long long)*starts.size());
+        }
+    }
+    row->wrapcols = w->cols;
+    if (w->valid && lines != row->wraplines)
+        wrapAdd(w,row-E->row,lines-row->wraplines);
+    row->wraplines = lines;
+}
+
+/* Screen column where the line 'sub' of a laid out row starts. Past its
+ * last line this is the end of the row. */
+static long long wrapLineStart(editorConfig *E, erow *row, long long sub) {
+    if (sub <= 0) return 0;
+    if (sub >= row->wraplines) return editorRowWidth(row);
+    return row->wrap ? row->wrap[sub-1] : sub*E->wrap.cols;
+}
+
+/* Line of a laid out row the screen column 'rx' is on. */
+static long long wrapLineOf(editorConfig *E, erow *row, long long rx) {
+    if (row->wrap == NULL) return std::min(rx/E->wrap.cols,row->wraplines-1);
+    return std::upper_bound(row->wrap,row->wrap+row->wraplines-1,rx) - row->wrap;
+}
+
+/* Line of the row and column on it the cursor is shown at. */
+static void wrapCursorLine(editorConfig *E, long long *sub, long long *x) {
+    long long filerow = E->rowoff+E->cy;
+    long long filecol = E->coloff+E->cx;
+
+    if (filerow < 0 || filerow >= E->numrows) {
+        *sub = 0;
+        *x = filecol;
+        return;
+    }
+    erow *row = &E->row[filerow];
+    wrapLayout(E,row);
+    long long rx = editorRowCxToRx(row,filecol);
+    *sub = wrapLineOf(E,row,rx);
+    *x = rx-wrapLineStart(E,row,*sub);
+}
+
+/* Scroll so that the cursor is on screen. Called before drawing. */
+void wrapScroll(editorConfig *E) {
+    editorWrap *w = &E->wrap;
+    long long filerow = E->rowoff+E->cy;
+    long long sub, x;
+
+    wrapSync(E);
+    if (w->linerow != E->rowoff) w->lineoff = 0;
+    if (E->rowoff < E->numrows) {
+        wrapLayout(E,&E->row[E->rowoff]);
+        w->lineoff = std::min(w->lineoff,E->row[E->rowoff].wraplines-1);
+    }
+
+    /* The rows from the top to the cursor are laid out first, as they may
+     * take more lines than counted. A screen of them is enough: past that
+     * the cursor is below the screen anyway. */
+    while (1) {
+        for (long long j = E->rowoff;
+             j < filerow && j < E->numrows && j < E->rowoff+E->screenrows; j++)
+            wrapLayout(E,&E->row[j]);
+        wrapCursorLine(E,&sub,&x);
+        long long top = wrapPrefix(E,E->rowoff)+w->lineoff;
+        long long cur = wrapPrefix(E,filerow)+sub;
+        if (cur < top)
+            top = cur;
+        else if (cur >= top+E->screenrows)
+            top = cur-E->screenrows+1;
+        else
+            break;
+        E->rowoff = wrapFind(E,top,&w->lineoff);
+        E->cy = filerow-E->rowoff;
+    }
+    w->linerow = E->rowoff;
+}
+
+/* Put the cursor on the row 'filerow' at the byte 'filecol', keeping the
+ * invariants of cx and coloff the rest of the editor relies on. */
+static void wrapSetCursor(editorConfig *E, long long filerow, long long filecol) {
+    E->cy = filerow-E->rowoff;
+    if (filecol > E->screencols-1) {
+        E->coloff = filecol-E->screencols+1;
+        E->cx = E->screencols-1;
+    } else {
+        E->coloff = 0;
+        E->cx = filecol;
+    }
+}
+
+/* Put the cursor at the column 'x' of the line 'sub' of 'filerow', or at the
+ * end of that line if it is shorter, and scroll to it so that cy stays on
+ * screen as elsewhere. */
+static void wrapGoto(editorConfig *E, long long filerow, long long sub, long long x) {
+    if (filerow >= E->numrows) {
+        wrapSetCursor(E,filerow,0);
+    } else {
+        erow *row = &E->row[filerow];
+        wrapLayout(E,row);
+        long long start = wrapLineStart(E,row,sub);
+        long long end = wrapLineStart(E,row,sub+1);
+        /* The end of a line but the last is the start of the next one. */
+        if (sub+1 < row->wraplines) end--;
+        wrapSetCursor(E,filerow,editorRowRxToCx(row,std::min(start+x,end)));
+    }
+    wrapScroll(E);
+}
+
+/* ARROW_UP and ARROW_DOWN move by screen lines. */
+void wrapMoveCursor(editorConfig *E, int key) {
+    long long filerow = E->rowoff+E->cy;
+    long long sub, x;
+
+    wrapSync(E);
+    wrapCursorLine(E,&sub,&x);
+    if (key == ARROW_DOWN) {
+        if (filerow >= E->numrows) return;
+        if (sub+1 < E->row[filerow].wraplines) {
+            sub++;
+        } else {
+            filerow++;
+            sub = 0;
+        }
+    } else {
+        if (sub > 0) {
+            sub--;
+        } else if (filerow > 0) {
+            filerow--;
+            if (filerow < E->numrows) {
+                wrapLayout(E,&E->row[filerow]);
+                sub = E->row[filerow].wraplines-1;
+            }
+        } else {
+            return;
+        }
+    }
+    wrapGoto(E,filerow,sub,x);
+}
+
+/* PAGE_UP and PAGE_DOWN: the cursor goes to the top or bottom line of the
+ * screen, then a screen further. */
+void wrapPage(editorConfig *E, int key) {
+    editorWrap *w = &E->wrap;
+    long long sub;
+
+    wrapScroll(E);
+    long long top = wrapPrefix(E,E->rowoff)+w->lineoff;
+    long long line = key == PAGE_UP ? top-E->screenrows :
+                                      top+2*E->screenrows-1;
+    line = std::max(0LL,std::min(line,wrapPrefix(E,E->numrows)));
+    long long filerow = wrapFind(E,line,&sub);
+    wrapGoto(E,filerow,sub,0);
+}
+
+/* Draw the screen lines of the rows from the top of the screen on. */
+void wrapDrawRows(editorConfig *E, struct abuf *ab) {
+    long long filerow = E->rowoff, sub = E->wrap.lineoff;
+
+    for (int y = 0; y < E->screenrows; y++) {
+        if (filerow >= E->numrows) {
+            editorDrawRow(E,ab,NULL,0,0,y);
+            continue;
+        }
+        erow *row = &E->row[filerow];
+        wrapLayout(E,row);
+        long long from = wrapLineStart(E,row,sub);
+        editorDrawRow(E,ab,row,from,wrapLineStart(E,row,sub+1)-from,y);
+        if (++sub == row->wraplines) {
+            filerow++;
+            sub = 0;
+        }
+    }
+}
+
+/* Screen position of the cursor, zero based. */
+void wrapCursorPos(editorConfig *E, int *y, int *x) {
+    long long sub, col;
+
+    wrapCursorLine(E,&sub,&col);
+    *y = wrapPrefix(E,E->rowoff+E->cy)+sub -
+         (wrapPrefix(E,E->rowoff)+E->wrap.lineoff);
+    *x = std::min(col,(long long)E->screencols-1);
+}
+
+/* The content of 'row' changed: its lines are laid out again when needed,
+ * and counted meanwhile as if broken at the screen width. */
+void wrapRowChanged(editorConfig *E, erow *row) {
+    editorWrap *w = &E->wrap;
+
+    row->wrapcols = 0;
+    if (!w->on || !w->valid) {
+        w->valid = 0;
+        return;
+    }
+    long long lines = wrapEstimate(w,row);
+    if (lines != row->wraplines) wrapAdd(w,row-E->row,lines-row->wraplines);
+    row->wraplines = lines;
+}
+
+void wrapToggle(editorConfig *E) {
+    E->wrap.on = !E->wrap.on;
+    E->wrap.valid = 0;
+    E->wrap.lineoff = 0;
+    editorSetStatusMessage(E,"Soft wrap %s",E->wrap.on ? "on" : "off");
+}
@@ -24,14 +24,6 @@ void PushCommand(editorConfig *E, UndoCommandBus* bus, char ID, char c);
 void PushCommandBus(editorConfig *E, UndoCommandBus bus);
 void editorSetStatusMessage(editorConfig *E, const char *fmt, ...);
 
-void editorCopy() {
-
-}
-
-void editorPaste() {
-
-}
-
 int main(int argc, char **argv) {
 	/*
 	char c;
@@ -43,19 +35,36 @@ int main(int argc, char **argv) {
 
 	editorConfig E;
 
+    if (argc >= 2 && !strcmp(argv[1],"--batch"))
+        return batchMain(argc-2, argv+2);
+    while (argc >= 4) {
+        if (!strcmp(argv[1],"--stats"))
+            statsDumpTo(argv[2]);
+        else if (!strcmp(argv[1],"--trace"))
+            traceStart(argv[2]);
+        else
+            break;
+        argc -= 2;
+        argv += 2;
+    }
     if (argc != 2) {
-        fprintf(stderr,"Usage: texed <filename>\n");
+        fprintf(stderr,"Usage: texed [--stats <file>] [--trace <file>] <filename>\n"
+                       "       texed --batch <script> <filename>...\n");
         exit(1);
     }
 
     initEditor(&E);
     editorSelectSyntaxHighlight(&E, argv[1]);
-    editorOpen(&E, argv[1]);
-
+    /* Raw mode first: opening may ask whether to recover unsaved changes. */
     if (enableRawMode(&E, STDIN_FILENO) == -1) exit(0);
     editorSetStatusMessage(&E, "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorOpen(&E, argv[1]);
+
     while(1) {
         editorRefreshScreen(&E);
+        /* Report a background save as soon as it completes. */
+        while (E.save && !editorWaitInput(STDIN_FILENO, 100))
+            if (editorSaveReap(&E, 0)) editorRefreshScreen(&E);
         editorProcessKeypress(&E, STDIN_FILENO);
     	editorHandleResize(&E);
 	}
@@ -0,0 +1,204 @@
+/* Regex search checked against std::regex.
+ *
+ * Usage: test_regex [pairs]
+ *
+ * Random patterns over a small alphabet are matched against random lines
+ * by regexFindAll(), then replaced by editorReplaceAll() as ":s/pattern/_/r"
+ * does, and the match bounds and the rows after the replace compared with
+ * those of std::regex in POSIX extended mode. std::regex_search() doesn't
+ * always find the longest match, so std::regex_match() is tried on every
+ * span of the line instead, for the leftmost start and the longest end.
+ * The lines of a pair are searched as one text, so that matches never
+ * crossing a newline is checked too, and :s must tell how many it replaced.
+ * A few hand written cases come first.
+ *
+ * Prints the pairs that differ and exits with 1 if any did. */
+
+#include "editor.h"
+
+#include <regex>
+
+#define TEST_LINES 4            /* Lines of text per pair. */
+#define TEST_SHOW 10            /* Differences printed at most. */
+
+static unsigned int seed = 1;
+
+static unsigned int testRandom(void) {
+    seed = seed*1103515245+12345;
+    return seed>>8;
+}
+
+/* A random pattern of about 'depth' levels. */
+static std::string makePattern(int depth) {
+    static const char *atoms[] = {"a","b","c",".","[ab]","[^a]","a","b"};
+    std::string p;
+    int n = 1 + testRandom() % 3;
+
+    for (int j = 0; j < n; j++) {
+        std::string atom;
+        if (depth > 0 && testRandom() % 4 == 0)
+            atom = "(" + makePattern(depth-1) + ")";
+        else
+            atom = atoms[testRandom() % (sizeof(atoms)/sizeof(atoms[0]))];
+        /* Repeats of repeats take std::regex exponential time. */
+        int nested = atom.find_first_of("*+") != std::string::npos;
+        switch(testRandom() % 6) {
+        case 0: atom += nested ? "" : "*"; break;
+        case 1: atom += nested ? "" : "+"; break;
+        case 2: atom += "?"; break;
+        }
+        p += atom;
+    }
+    if (depth > 0 && testRandom() % 4 == 0) p += "|" + makePattern(depth-1);
+    return p;
+}
+
+static std::string makeLine(void) {
+    std::string s;
+    int len = testRandom() % 13;
+    for (int j = 0; j < len; j++) s += "abc"[testRandom() % 3];
+    return s;
+}
+
+typedef std::vector<std::pair<size_t,size_t>> testSpans;
+
+/* Is line[start..end) a match of 're'? */
+static int refIsMatch(const std::regex &re, const std::string &line,
+                      size_t start, size_t end) {
+    auto flags = std::regex_constants::match_default;
+    if (start > 0) flags |= std::regex_constants::match_not_bol;
+    if (end < line.size()) flags |= std::regex_constants::match_not_eol;
+    return std::regex_match(line.cbegin()+start,line.cbegin()+end,re,flags);
+}
+
+/* The matches of 're' in 'line', one after the other as a search does. */
+static testSpans refMatches(const std::regex &re, const std::string &line) {
+    testSpans spans;
+    for (size_t start = 0; start < line.size(); start++) {
+        for (size_t end = line.size(); end > start; end--) {
+            if (!refIsMatch(re,line,start,end)) continue;
+            spans.push_back({start,end});
+            start = end-1;
+            break;
+        }
+    }
+    return spans;
+}
+
+static std::string spansString(const testSpans &spans) {
+    std::string s;
+    for (auto &sp : spans)
+        s += "[" + std::to_string(sp.first) + "," + std::to_string(sp.second) + ")";
+    return s.empty() ? "none" : s;
+}
+
+static int failed;
+
+static void report(const std::string &pattern, const std::string &line,
+                   const std::string &what, const std::string &got,
+                   const std::string &want) {
+    if (failed++ < TEST_SHOW)
+        printf("/%s/ on \"%s\": %s %s, std::regex %s\n",pattern.c_str(),
+               line.c_str(),what.c_str(),got.c_str(),want.c_str());
+}
+
+/* Check 'pattern' on 'lines'. Returns 0 if the pattern was skipped, as one
+ * that can match the empty string. */
+static int checkPair(editorConfig *E, const std::string &pattern,
+                     const std::vector<std::string> &lines) {
+    const char *err;
+    regexProg *prog = regexCompile(pattern.c_str(),0,&err);
+    if (prog == NULL) return 0;
+    std::regex re(pattern,std::regex::extended);
+
+    /* Match bounds, all the lines as one text. */
+    std::string text;
+    std::vector<size_t> starts, lens;
+    for (size_t j = 0; j < lines.size(); j++) text += lines[j] + "\n";
+    regexMatcher *m = regexMatcherNew(prog);
+    regexFindAll(m,text.data(),text.size(),0,&starts,&lens);
+    regexMatcherFree(m);
+    regexFree(prog);
+
+    size_t off = 0, k = 0;
+    long long count = 0;
+    std::vector<std::string> replaced;
+    for (const std::string &line : lines) {
+        testSpans want = refMatches(re,line), got;
+        count += want.size();
+        for (; k < starts.size() && starts[k] <= off+line.size(); k++)
+            got.push_back({starts[k]-off,starts[k]+lens[k]-off});
+        if (got != want)
+            report(pattern,line,"matches",spansString(got),spansString(want));
+
+        std::string rep;
+        size_t copied = 0;
+        for (auto &sp : want) {
+            rep += line.substr(copied,sp.first-copied) + "_";
+            copied = sp.second;
+        }
+        replaced.push_back(rep + line.substr(copied));
+        off += line.size()+1;
+    }
+
+    /* The same as :s/pattern/_/r on a document of those lines. */
+    for (const std::string &line : lines)
+        editorInsertRow(E,E->numrows,(char*)line.data(),line.size());
+    long long replacedcount = editorReplaceAll(E,pattern.c_str(),"_",1,0);
+    if (replacedcount != count)
+        report(pattern,lines[0],":s count",std::to_string(replacedcount),
+               std::to_string(count));
+    for (size_t j = 0; j < lines.size(); j++) {
+        std::string row(E->row[j].chars,E->row[j].size);
+        if (row != replaced[j])
+            report(pattern,lines[j],":s gives",row,replaced[j]);
+    }
+    editorCloseFile(E);
+    return 1;
+}
+
+/* :s of the literal 'pattern' on 'line' must give 'want'. */
+static void checkLiteral(editorConfig *E, const char *pattern,
+                         const char *line, const char *want) {
+    editorInsertRow(E,0,(char*)line,strlen(line));
+    editorReplaceAll(E,pattern,"_",0,0);
+    std::string row(E->row[0].chars,E->row[0].size);
+    if (row != want) report(pattern,line,":s gives",row,want);
+    editorCloseFile(E);
+}
+
+int main(int argc, char **argv) {
+    long pairs = argc > 1 ? atol(argv[1]) : 20000, checked = 0;
+    editorConfig E;
+
+    E.headless = 1;
+    E.mode = EDITOR_MODE_NORMAL;
+    initEditor(&E);
+    E.screenrows = 24;
+    E.screencols = 80;
+
+    /* Matches next to each other, also replaced as literals, and a match
+     * starting before the first one to end. */
+    checked += checkPair(&E,"a",{"aaab","a","ba"});
+    checked += checkPair(&E,"[a-z]",{"hello world"});
+    checked += checkPair(&E,"abcde|c",{"abcde","xxcxx"});
+    checked += checkPair(&E,"a|ab|abc",{"abcabcab"});
+    checked += checkPair(&E,"(ab)+|b",{"abababb"});
+    checked += checkPair(&E,"^a|a$",{"aaa","a"});
+    checked += checkPair(&E,"aa",{"aaaaa","aaaa"});
+    checked += checkPair(&E,"ab|b",{"abbabb"});
+    checkLiteral(&E,"a","aaab","___b");
+    checkLiteral(&E,"aa","aaaaa","__a");
+    checkLiteral(&E,"ab","ababab","___");
+
+    for (long j = 0; j < pairs; j++) {
+        std::string pattern = makePattern(2);
+        if (testRandom() % 8 == 0) pattern = "^" + pattern;
+        if (testRandom() % 8 == 0) pattern += "$";
+        std::vector<std::string> lines;
+        for (int k = 0; k < TEST_LINES; k++) lines.push_back(makeLine());
+        checked += checkPair(&E,pattern,lines);
+    }
+    printf("%ld patterns checked, %d differences\n",checked,failed);
+    return failed != 0;
+}